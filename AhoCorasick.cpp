@@ -0,0 +1,127 @@
+#include <algorithm>
+#include <queue>
+#include "AhoCorasick.h"
+
+//--------------------------------------- Definitions ----------------------------------------------
+/**
+ * The root state of the automaton
+ */
+#define ROOT 0
+
+/**
+ * Marks a missing trie edge during build
+ */
+#define NO_STATE (-1)
+
+/**
+ * Byte class shared by all the bytes that don't appear in any pattern
+ */
+#define OTHER_CLASS 0
+
+//---------------------------------------------------------------------------------------------------
+
+AhoCorasick::AhoCorasick() : nClasses(1)
+{
+	std::fill(classes, classes + 256, OTHER_CLASS);
+	build(std::vector<std::string>());
+}
+
+void AhoCorasick::build(const std::vector<std::string> &patterns)
+{
+	// assign a class to every byte that appears in a pattern
+	std::fill(classes, classes + 256, OTHER_CLASS);
+	nClasses = 1;
+	for (const std::string &pattern : patterns)
+		for (unsigned char c : pattern)
+			if (classes[c] == OTHER_CLASS)
+				classes[c] = nClasses++;
+
+	// build the trie
+	transitions.assign(nClasses, NO_STATE);
+	std::vector<std::vector<int32_t>> stateOutputs(1);
+	for (size_t id = 0; id < patterns.size(); ++id)
+	{
+		int32_t state = ROOT;
+		for (unsigned char c : patterns[id])
+		{
+			int32_t &next = transitions[state * nClasses + classes[c]];
+			if (next == NO_STATE)
+			{
+				next = (int32_t)stateOutputs.size();
+				stateOutputs.push_back(std::vector<int32_t>());
+				transitions.resize(transitions.size() + nClasses, NO_STATE);
+			}
+			state = transitions[state * nClasses + classes[c]];
+		}
+		stateOutputs[state].push_back((int32_t)id);
+	}
+
+	// compute the failure links in breadth first order and replace the missing edges with the
+	// edge of the failure state, turning the trie into a complete transition table
+	std::vector<int32_t> fail(stateOutputs.size(), ROOT);
+	std::queue<int32_t> queue;
+	for (int c = 0; c < nClasses; ++c)
+	{
+		int32_t &next = transitions[ROOT * nClasses + c];
+		if (next == NO_STATE)
+			next = ROOT;
+		else
+			queue.push(next);
+	}
+
+	while (!queue.empty())
+	{
+		int32_t state = queue.front();
+		queue.pop();
+
+		for (int c = 0; c < nClasses; ++c)
+		{
+			int32_t next = transitions[state * nClasses + c];
+			int32_t fallback = transitions[fail[state] * nClasses + c];
+			if (next == NO_STATE)
+			{
+				transitions[state * nClasses + c] = fallback;
+				continue;
+			}
+
+			fail[next] = fallback;
+			// a state also reports the patterns of its failure state, which was already visited
+			stateOutputs[next].insert(stateOutputs[next].end(), stateOutputs[fallback].begin(),
+									  stateOutputs[fallback].end());
+			queue.push(next);
+		}
+	}
+
+	// flatten the output lists
+	outputFirst.assign(1, 0);
+	outputs.clear();
+	for (const std::vector<int32_t> &stateOutput : stateOutputs)
+	{
+		outputs.insert(outputs.end(), stateOutput.begin(), stateOutput.end());
+		outputFirst.push_back((int32_t)outputs.size());
+	}
+}
+
+void AhoCorasick::match(const std::string &text, std::vector<int> &out) const
+{
+	out.clear();
+
+	// empty patterns end at the root and match every text
+	int32_t state = ROOT;
+	out.insert(out.end(), outputs.begin() + outputFirst[ROOT], outputs.begin() + outputFirst[ROOT + 1]);
+
+	const int32_t* table = transitions.data();
+	for (unsigned char c : text)
+	{
+		state = table[state * nClasses + classes[c]];
+		if (outputFirst[state] != outputFirst[state + 1])
+			out.insert(out.end(), outputs.begin() + outputFirst[state],
+					   outputs.begin() + outputFirst[state + 1]);
+	}
+
+	if (out.size() > 1)
+	{
+		std::sort(out.begin(), out.end());
+		out.erase(std::unique(out.begin(), out.end()), out.end());
+	}
+}
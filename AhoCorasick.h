@@ -0,0 +1,41 @@
+#ifndef MAPREDUCE2_AHOCORASICK_H
+#define MAPREDUCE2_AHOCORASICK_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/**
+ * @brief Multi-pattern substring matcher.
+ * The automaton is compiled to a dense transition table indexed by state and byte class, where
+ * bytes that don't appear in any pattern share a single class. Matching never follows failure
+ * links, each text byte costs one table lookup. The table is read only after build, so one
+ * automaton can be shared by all the map threads.
+ */
+class AhoCorasick
+{
+public:
+	AhoCorasick();
+
+	/**
+	 * Compiles the automaton, pattern ids are their positions in the given vector
+	 * @param patterns the patterns to search for
+	 */
+	void build(const std::vector<std::string> &patterns);
+
+	/**
+	 * Finds the patterns that appear in the given text
+	 * @param text the text to search
+	 * @param out vector the sorted unique ids of the matched patterns are written to
+	 */
+	void match(const std::string &text, std::vector<int> &out) const;
+
+private:
+	int classes[256];
+	int nClasses;
+	std::vector<int32_t> transitions;
+	std::vector<int32_t> outputFirst;
+	std::vector<int32_t> outputs;
+};
+
+#endif //MAPREDUCE2_AHOCORASICK_H
@@ -0,0 +1,254 @@
+#include <pthread.h>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+#include "InternedString.h"
+
+//--------------------------------------- Definitions ----------------------------------------------
+/**
+ * Number of independently locked table shards, a power of 2
+ */
+#define N_SHARDS 64
+
+/**
+ * Number of hash bits used to select the shard
+ */
+#define SHARD_BITS 6
+
+/**
+ * Initial number of slots in a shard hash table, a power of 2
+ */
+#define INITIAL_SLOTS 256
+
+/**
+ * Size of the blocks the entries are allocated from
+ */
+#define ARENA_BLOCK 65536
+
+/**
+ * FNV-1a 64 bit parameters
+ */
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+//-------------------------------------- Data structures --------------------------------------------------
+/**
+ * A part of the string table, open addressing hash table of entries allocated from an arena
+ */
+struct Shard
+{
+	pthread_mutex_t mutex;
+	std::vector<const InternedEntry*> slots;
+	size_t count;
+	std::vector<char*> blocks;
+	size_t blockUsed;
+	size_t blockSize;
+};
+
+/**
+ * The string table
+ */
+static Shard shards[N_SHARDS];
+
+/**
+ * Makes sure the shard mutexes are initialized once
+ */
+static pthread_once_t shardsOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * The entry of the empty string, it isn't stored in the table
+ */
+static const InternedEntry emptyEntry = {FNV_OFFSET, 0, 0, {0}};
+
+//------------------------------------- function declarations --------------------------------------------
+
+static void initShards();
+static const InternedEntry* intern(const char *chars, size_t length);
+static InternedEntry* allocateEntry(Shard &shard, size_t length);
+static void growShard(Shard &shard);
+static void lock(pthread_mutex_t *mutex);
+static void unlock(pthread_mutex_t *mutex);
+
+//---------------------------------------------------------------------------------------------------
+
+InternedString::InternedString() : entry(&emptyEntry) {}
+
+InternedString::InternedString(const char *chars, size_t length) : entry(intern(chars, length)) {}
+
+InternedString::InternedString(const std::string &str) : entry(intern(str.data(), str.size())) {}
+
+void clearInternedStrings()
+{
+	pthread_once(&shardsOnce, &initShards);
+
+	for (Shard &shard : shards)
+	{
+		lock(&shard.mutex);
+		for (char* block : shard.blocks)
+			free(block);
+		shard.blocks.clear();
+		shard.blockUsed = 0;
+		shard.blockSize = 0;
+		shard.slots.assign(INITIAL_SLOTS, nullptr);
+		shard.count = 0;
+		unlock(&shard.mutex);
+	}
+}
+
+size_t internedStringCount()
+{
+	pthread_once(&shardsOnce, &initShards);
+
+	size_t count = 0;
+	for (Shard &shard : shards)
+	{
+		lock(&shard.mutex);
+		count += shard.count;
+		unlock(&shard.mutex);
+	}
+	return count;
+}
+
+/**
+ * Initializes the shard mutexes and hash tables
+ */
+static void initShards()
+{
+	for (Shard &shard : shards)
+	{
+		pthread_mutex_init(&shard.mutex, nullptr);
+		shard.slots.assign(INITIAL_SLOTS, nullptr);
+		shard.count = 0;
+		shard.blockUsed = 0;
+		shard.blockSize = 0;
+	}
+}
+
+/**
+ * Returns the table entry of the given string, adding it if it isn't in the table
+ * @param chars pointer to the characters
+ * @param length number of characters
+ * @return the string entry
+ */
+static const InternedEntry* intern(const char *chars, size_t length)
+{
+	if (length == 0)
+		return &emptyEntry;
+
+	pthread_once(&shardsOnce, &initShards);
+
+	uint64_t hash = FNV_OFFSET;
+	for (size_t i = 0; i < length; ++i)
+		hash = (hash ^ (unsigned char)chars[i]) * FNV_PRIME;
+
+	Shard &shard = shards[hash >> (64 - SHARD_BITS)];
+	lock(&shard.mutex);
+
+	// linear probing, the low hash bits select the slot
+	size_t mask = shard.slots.size() - 1;
+	size_t slot = hash & mask;
+	while (shard.slots[slot] != nullptr)
+	{
+		const InternedEntry* entry = shard.slots[slot];
+		if (entry->hash == hash && entry->length == length && memcmp(entry->chars, chars, length) == 0)
+		{
+			unlock(&shard.mutex);
+			return entry;
+		}
+		slot = (slot + 1) & mask;
+	}
+
+	InternedEntry* entry = allocateEntry(shard, length);
+	entry->hash = hash;
+	entry->length = (uint32_t)length;
+	memcpy(entry->chars, chars, length);
+	entry->chars[length] = '\0';
+
+	entry->prefix = 0;
+	for (size_t i = 0; i < sizeof(entry->prefix); ++i)
+		entry->prefix = (entry->prefix << 8) | (i < length ? (unsigned char)chars[i] : 0);
+
+	shard.slots[slot] = entry;
+	if (++shard.count * 2 > shard.slots.size())
+		growShard(shard);
+
+	unlock(&shard.mutex);
+	return entry;
+}
+
+/**
+ * Allocates an entry for a string of the given length from the shard arena
+ * @param shard the shard the entry belongs to, must be locked
+ * @param length number of characters
+ * @return pointer to the uninitialized entry
+ */
+static InternedEntry* allocateEntry(Shard &shard, size_t length)
+{
+	size_t size = offsetof(InternedEntry, chars) + length + 1;
+	size = (size + alignof(InternedEntry) - 1) & ~(alignof(InternedEntry) - 1);
+
+	if (shard.blockUsed + size > shard.blockSize)
+	{
+		size_t blockSize = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+		char* block = (char*)malloc(blockSize);
+		if (block == nullptr)
+		{
+			std::cerr << "MapReduceFramework Failure: malloc failed.";
+			exit(1);
+		}
+		shard.blocks.push_back(block);
+		shard.blockUsed = 0;
+		shard.blockSize = blockSize;
+	}
+
+	InternedEntry* entry = (InternedEntry*)(shard.blocks.back() + shard.blockUsed);
+	shard.blockUsed += size;
+	return entry;
+}
+
+/**
+ * Doubles the number of slots in the given shard
+ * @param shard the shard to grow, must be locked
+ */
+static void growShard(Shard &shard)
+{
+	std::vector<const InternedEntry*> slots(shard.slots.size() * 2, nullptr);
+	size_t mask = slots.size() - 1;
+
+	for (const InternedEntry* entry : shard.slots)
+	{
+		if (entry == nullptr)
+			continue;
+		size_t slot = entry->hash & mask;
+		while (slots[slot] != nullptr)
+			slot = (slot + 1) & mask;
+		slots[slot] = entry;
+	}
+	shard.slots.swap(slots);
+}
+
+/**
+ * Locks the given mutex, exits on failure
+ * @param mutex pointer to a mutex
+ */
+static void lock(pthread_mutex_t *mutex)
+{
+	if (pthread_mutex_lock(mutex) != 0)
+	{
+		std::cerr << "MapReduceFramework Failure: pthread_mutex_lock failed.";
+		exit(1);
+	}
+}
+
+/**
+ * Unlocks the given mutex, exits on failure
+ * @param mutex pointer to a mutex
+ */
+static void unlock(pthread_mutex_t *mutex)
+{
+	if (pthread_mutex_unlock(mutex) != 0)
+	{
+		std::cerr << "MapReduceFramework Failure: pthread_mutex_unlock failed.";
+		exit(1);
+	}
+}
@@ -0,0 +1,109 @@
+#ifndef INTERNEDSTRING_H
+#define INTERNEDSTRING_H
+
+#include <string>
+#include <cstring>
+#include <cstddef>
+#include <stdint.h>
+#include "MapReduceClient.h"
+
+/**
+ * Interned string table entry. Entries are unique and never move, so two interned strings
+ * are equal if and only if they point to the same entry.
+ */
+struct InternedEntry
+{
+	uint64_t hash;
+	uint64_t prefix;	// the first 8 bytes in big endian order, zero padded
+	uint32_t length;
+	char chars[1];		// null terminated, allocated to fit the string
+};
+
+/**
+ * @brief Handle to a string stored once in the job string table.
+ * Copying a handle copies a pointer, equality compares pointers and ordering compares the
+ * cached prefixes before falling back to the characters. The order is the same as std::string.
+ * Strings are interned by the map threads concurrently. The table belongs to the running job and
+ * is released when RunMapReduceFramework returns, with or without autoDeleteV2K2, so a handle,
+ * including one created by the client before the job, must not be read after the job ends. Keys a
+ * client deletes itself can still be deleted then, deleting a handle doesn't touch the table.
+ */
+class InternedString
+{
+public:
+	/**
+	 * Handle to the empty string
+	 */
+	InternedString();
+
+	/**
+	 * Interns the given characters
+	 * @param chars pointer to the characters, they don't have to be null terminated
+	 * @param length number of characters
+	 */
+	InternedString(const char *chars, size_t length);
+
+	/**
+	 * Interns the given string
+	 * @param str the string to intern
+	 */
+	explicit InternedString(const std::string &str);
+
+	const char *c_str() const { return entry->chars; }
+	size_t size() const { return entry->length; }
+	uint64_t hash() const { return entry->hash; }
+	std::string str() const { return std::string(entry->chars, entry->length); }
+
+	bool operator==(const InternedString &other) const { return entry == other.entry; }
+	bool operator!=(const InternedString &other) const { return entry != other.entry; }
+
+	bool operator<(const InternedString &other) const
+	{
+		if (entry == other.entry)
+			return false;
+		if (entry->prefix != other.entry->prefix)
+			return entry->prefix < other.entry->prefix;
+
+		// same first 8 bytes, compare the rest
+		uint32_t length = entry->length < other.entry->length ? entry->length : other.entry->length;
+		int cmp = memcmp(entry->chars, other.entry->chars, length);
+		if (cmp != 0)
+			return cmp < 0;
+		return entry->length < other.entry->length;
+	}
+
+private:
+	const InternedEntry *entry;
+};
+
+/**
+ * @brief Framework supplied intermediate key for jobs with string keys.
+ * Duplicate keys emitted by different map calls share one copy of the string, and comparisons
+ * don't copy or walk the strings unless their prefixes are equal.
+ */
+struct StringKey2 : public k2Base
+{
+	InternedString key;
+
+	explicit StringKey2(const InternedString &str) : key(str) {}
+	explicit StringKey2(const std::string &str) : key(str) {}
+	StringKey2(const char *chars, size_t length) : key(chars, length) {}
+	~StringKey2() {}
+
+	virtual bool operator<(const k2Base &other) const
+	{
+		return key < ((StringKey2*)(&other))->key;
+	}
+};
+
+/**
+ * Releases every interned string, called by the framework when every job ends
+ */
+void clearInternedStrings();
+
+/**
+ * @return the number of distinct strings in the table
+ */
+size_t internedStringCount();
+
+#endif //INTERNEDSTRING_H
@@ -0,0 +1,731 @@
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#include "MapReduceAsync.h"
+#include "MapReduceTrace.h"
+
+//--------------------------------------- Definitions ----------------------------------------------
+/**
+ * Bytes requested by every file read
+ */
+#define READ_SIZE (64 * 1024)
+
+/**
+ * user_data of the eventfd read that wakes an io_uring engine when the pool completes its requests
+ */
+#define EVENT_TAG (~0ULL)
+
+/**
+ * Convert seconds to nanoseconds
+ */
+#define SEC_TO_NS(x) ((x) * 1000000000ULL)
+
+/**
+ * Number of opcodes the io_uring probe asks about
+ */
+#define PROBE_OPS 256
+
+//-------------------------------------- Data structures --------------------------------------------------
+/**
+ * A request in flight, owned by the engine it was submitted to
+ */
+struct AsyncOperation
+{
+	AsyncRequest request;
+	AsyncResult result;
+	size_t tag;
+	AsyncEngine* owner;
+	int fd;			// the file or directory opened by io_uring, -1 until the open completes
+	size_t offset;	// bytes read so far
+	uint64_t submitted;	// monotonic time the operation's current io_uring entry was submitted
+	uint64_t ioTime;	// nanoseconds the request was performed, without the time it waited
+};
+
+/**
+ * The pool threads
+ */
+static std::vector<pthread_t> poolThreads;
+
+/**
+ * Maximal number of pool threads, they are created as requests queue up
+ */
+static size_t poolMax = 0;
+
+/**
+ * Number of pool threads waiting for a request
+ */
+static size_t nIdleThreads = 0;
+
+/**
+ * Requests waiting for a pool thread
+ */
+static std::deque<AsyncOperation*> poolQueue;
+
+/**
+ * Used to lock poolQueue, poolThreads, nIdleThreads and poolStopping
+ */
+static pthread_mutex_t mut_pool = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Signaled when a request is queued or the pool stops
+ */
+static pthread_cond_t cv_pool = PTHREAD_COND_INITIALIZER;
+
+/**
+ * True once the pool threads should exit
+ */
+static bool poolStopping = false;
+
+//---------------------------------------------------------------------------------------------------
+
+/**
+ * Exits the program, used when the io_uring ring breaks after it was set up
+ * @param functionName the name of the failed function
+ */
+static void failure(std::string functionName)
+{
+	std::cerr << "MapReduceFramework Failure: " << functionName << " failed.";
+	exit(1);
+}
+
+/**
+ * @return the CLOCK_MONOTONIC time in nanoseconds
+ */
+static uint64_t monotonicNow()
+{
+	struct timespec now;
+	if (clock_gettime(CLOCK_MONOTONIC, &now) != 0)
+		failure("clock_gettime");
+	return SEC_TO_NS((uint64_t)now.tv_sec) + now.tv_nsec;
+}
+
+/**
+ * Creates an operation for the given request
+ * @param request the request
+ * @param tag the request tag
+ * @param owner the engine the request is submitted to
+ * @return a new operation
+ */
+static AsyncOperation *newOperation(const AsyncRequest &request, size_t tag, AsyncEngine *owner)
+{
+	AsyncOperation* op = new AsyncOperation;
+	op->request = request;
+	op->tag = tag;
+	op->owner = owner;
+	op->fd = -1;
+	op->offset = 0;
+	op->submitted = 0;
+	op->ioTime = 0;
+	return op;
+}
+
+/**
+ * Moves the result out of a completed operation and deletes it
+ * @param op the completed operation
+ * @param result the request result
+ * @param ioTime set to the nanoseconds the request was performed
+ * @return the request tag
+ */
+static size_t finishOperation(AsyncOperation *op, AsyncResult &result, uint64_t &ioTime)
+{
+	size_t tag = op->tag;
+	result = std::move(op->result);
+	ioTime = op->ioTime;
+	delete op;
+	return tag;
+}
+
+static void* ExecAsync(void* p);
+
+/**
+ * Queues an operation for the pool threads, starts another thread if every thread is busy and the
+ * pool is smaller than poolMax
+ * @param op the operation
+ */
+static void poolSubmit(AsyncOperation *op)
+{
+	pthread_mutex_lock(&mut_pool);
+	poolQueue.push_back(op);
+	if (poolQueue.size() > nIdleThreads && poolThreads.size() < poolMax)
+	{
+		pthread_t thread;
+		if (pthread_create(&thread, nullptr, &ExecAsync, nullptr) != 0)
+			failure("pthread_create");
+		poolThreads.push_back(thread);
+	}
+	pthread_cond_signal(&cv_pool);
+	pthread_mutex_unlock(&mut_pool);
+}
+
+/**
+ * Lists an open directory and closes it
+ * @param dirp the directory stream
+ * @param result gets the entry names
+ */
+static void listDirectory(DIR *dirp, AsyncResult &result)
+{
+	struct dirent* dirstruct;
+	while ((dirstruct = readdir(dirp)) != NULL)
+		result.entries.push_back(dirstruct->d_name);
+	closedir(dirp);
+}
+
+/**
+ * Lists a directory io_uring opened, closes the descriptor
+ * @param fd the directory descriptor
+ * @param result gets the entry names or the error
+ */
+static void listOpenDirectory(int fd, AsyncResult &result)
+{
+	DIR* dirp = fdopendir(fd);
+	if (dirp == NULL)
+	{
+		result.error = errno;
+		close(fd);
+		return;
+	}
+	listDirectory(dirp, result);
+}
+
+/**
+ * Pool thread, performs queued requests and hands them back to their engines
+ * @param p ignored parameter, needed for pthread_init argument signature
+ * @return always returns nullptr
+ */
+static void* ExecAsync(void* p)
+{
+	(void)p;
+	traceThreadName("ExecAsync");
+
+	while (true)
+	{
+		pthread_mutex_lock(&mut_pool);
+		nIdleThreads++;
+		while (poolQueue.empty() && !poolStopping)
+			pthread_cond_wait(&cv_pool, &mut_pool);
+		nIdleThreads--;
+		if (poolQueue.empty())
+		{
+			pthread_mutex_unlock(&mut_pool);
+			break;
+		}
+		AsyncOperation* op = poolQueue.front();
+		poolQueue.pop_front();
+		pthread_mutex_unlock(&mut_pool);
+
+		uint64_t start = traceNow();
+		uint64_t ioStart = monotonicNow();
+		if (op->fd != -1)
+			listOpenDirectory(op->fd, op->result);
+		else
+			asyncExecute(op->request, op->result);
+		op->ioTime += monotonicNow() - ioStart;
+		traceEvent(op->request.op == ASYNC_LIST_DIR ? "list dir" : "read file", "io", start);
+		op->owner->complete(op);
+	}
+
+	return nullptr;
+}
+
+void asyncExecute(const AsyncRequest &request, AsyncResult &result)
+{
+	result = AsyncResult();
+
+	if (request.op == ASYNC_LIST_DIR)
+	{
+		DIR* dirp = opendir(request.path.c_str());
+		if (dirp == NULL)
+		{
+			result.error = errno;
+			return;
+		}
+		listDirectory(dirp, result);
+	}
+	else if (request.op == ASYNC_READ_FILE)
+	{
+		int fd = open(request.path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd == -1)
+		{
+			result.error = errno;
+			return;
+		}
+
+		char buffer[READ_SIZE];
+		ssize_t count;
+		while ((count = read(fd, buffer, sizeof(buffer))) != 0)
+		{
+			if (count == -1 && errno == EINTR)
+				continue;
+			if (count == -1)
+			{
+				result.error = errno;
+				break;
+			}
+			result.data.append(buffer, (size_t)count);
+		}
+		close(fd);
+	}
+}
+
+void AsyncMapReduceBase::Map(const k1Base *const key, const v1Base *const val) const
+{
+	AsyncResult result;
+	asyncExecute(MapRequest(key, val), result);
+	MapComplete(key, val, result);
+}
+
+bool asyncPoolStart(size_t maxThreads)
+{
+	poolStopping = false;
+	poolMax = maxThreads;
+	nIdleThreads = 0;
+	poolThreads.clear();
+
+	// one thread up front, so a job that can't create threads fails before it maps
+	pthread_t thread;
+	if (pthread_create(&thread, nullptr, &ExecAsync, nullptr) != 0)
+		return false;
+	pthread_mutex_lock(&mut_pool);
+	poolThreads.push_back(thread);
+	pthread_mutex_unlock(&mut_pool);
+	return true;
+}
+
+void asyncPoolStop()
+{
+	pthread_mutex_lock(&mut_pool);
+	poolStopping = true;
+	pthread_cond_broadcast(&cv_pool);
+	pthread_mutex_unlock(&mut_pool);
+
+	// no request is submitted anymore, so the vector doesn't grow
+	for (pthread_t &thread : poolThreads)
+		pthread_join(thread, nullptr);
+	poolThreads.clear();
+}
+
+/**
+ * @brief Engine that hands every request to the pool threads
+ */
+class PoolEngine : public AsyncEngine
+{
+public:
+	PoolEngine()
+	{
+		pthread_mutex_init(&mut_done, nullptr);
+		pthread_cond_init(&cv_done, nullptr);
+	}
+
+	~PoolEngine()
+	{
+		pthread_mutex_destroy(&mut_done);
+		pthread_cond_destroy(&cv_done);
+	}
+
+	void submit(const AsyncRequest &request, size_t tag)
+	{
+		poolSubmit(newOperation(request, tag, this));
+	}
+
+	size_t wait(AsyncResult &result, uint64_t &ioTime)
+	{
+		pthread_mutex_lock(&mut_done);
+		while (done.empty())
+			pthread_cond_wait(&cv_done, &mut_done);
+		AsyncOperation* op = done.front();
+		done.pop_front();
+		pthread_mutex_unlock(&mut_done);
+
+		return finishOperation(op, result, ioTime);
+	}
+
+	const char *name() const
+	{
+		return "thread pool";
+	}
+
+	void complete(AsyncOperation *op)
+	{
+		pthread_mutex_lock(&mut_done);
+		done.push_back(op);
+		pthread_cond_signal(&cv_done);
+		pthread_mutex_unlock(&mut_done);
+	}
+
+private:
+	std::deque<AsyncOperation*> done;
+	pthread_mutex_t mut_done;
+	pthread_cond_t cv_done;
+};
+
+/**
+ * @brief Engine that opens and reads files and opens directories with io_uring.
+ * The kernel has no asynchronous directory listing, so once the ring opened a directory the pool
+ * threads read its entries and wake the ring through an eventfd when they are done.
+ */
+class UringEngine : public AsyncEngine
+{
+public:
+	UringEngine() : ringFd(-1), eventFd(-1), sqRing(MAP_FAILED), cqRing(MAP_FAILED), sqes(MAP_FAILED),
+					sqRingSize(0), cqRingSize(0), sqesSize(0), eventValue(0)
+	{
+		pthread_mutex_init(&mut_done, nullptr);
+	}
+
+	~UringEngine()
+	{
+		if (eventFd != -1 && ringFd != -1)
+		{
+			// complete the pending eventfd read, the kernel must not write eventValue after it's freed
+			uint64_t one = 1;
+			if (write(eventFd, &one, sizeof(one)) == (ssize_t)sizeof(one))
+				while (nextCompletion() != EVENT_TAG) {}
+		}
+
+		if (sqes != MAP_FAILED)
+			munmap(sqes, sqesSize);
+		if (cqRing != MAP_FAILED && cqRing != sqRing)
+			munmap(cqRing, cqRingSize);
+		if (sqRing != MAP_FAILED)
+			munmap(sqRing, sqRingSize);
+		if (ringFd != -1)
+			close(ringFd);
+		if (eventFd != -1)
+			close(eventFd);
+		pthread_mutex_destroy(&mut_done);
+	}
+
+	/**
+	 * Sets up the ring
+	 * @param depth the maximal number of requests in flight
+	 * @return true if the kernel supports everything the engine needs, otherwise false
+	 */
+	bool init(unsigned depth)
+	{
+		// every request has at most one entry in the ring, plus the eventfd read
+		struct io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		ringFd = (int)syscall(__NR_io_uring_setup, depth + 1, &params);
+		if (ringFd == -1)
+			return false;
+
+		if (!supports(IORING_OP_OPENAT) || !supports(IORING_OP_READ))
+			return false;
+
+		sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+		if (params.features & IORING_FEAT_SINGLE_MMAP)
+			sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+
+		sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+					  IORING_OFF_SQ_RING);
+		if (sqRing == MAP_FAILED)
+			return false;
+		if (params.features & IORING_FEAT_SINGLE_MMAP)
+			cqRing = sqRing;
+		else
+			cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+						  IORING_OFF_CQ_RING);
+		if (cqRing == MAP_FAILED)
+			return false;
+		sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+		sqes = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+					IORING_OFF_SQES);
+		if (sqes == MAP_FAILED)
+			return false;
+
+		char* sq = (char*)sqRing;
+		sqTail = (unsigned*)(sq + params.sq_off.tail);
+		sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+		sqArray = (unsigned*)(sq + params.sq_off.array);
+		char* cq = (char*)cqRing;
+		cqHead = (unsigned*)(cq + params.cq_off.head);
+		cqTail = (unsigned*)(cq + params.cq_off.tail);
+		cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+		cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+		eventFd = eventfd(0, EFD_CLOEXEC);
+		if (eventFd == -1)
+			return false;
+		armEvent();
+		return true;
+	}
+
+	void submit(const AsyncRequest &request, size_t tag)
+	{
+		AsyncOperation* op = newOperation(request, tag, this);
+		if (request.op != ASYNC_READ_FILE && request.op != ASYNC_LIST_DIR)
+		{
+			poolSubmit(op);
+			return;
+		}
+
+		struct io_uring_sqe* sqe = nextEntry();
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uint64_t)(uintptr_t)op->request.path.c_str();
+		sqe->open_flags = O_RDONLY | O_CLOEXEC;
+		if (request.op == ASYNC_LIST_DIR)
+			sqe->open_flags |= O_DIRECTORY;
+		sqe->user_data = (uint64_t)(uintptr_t)op;
+		op->submitted = monotonicNow();
+		submitEntry();
+	}
+
+	size_t wait(AsyncResult &result, uint64_t &ioTime)
+	{
+		while (ready.empty())
+		{
+			int res;
+			uint64_t userData = nextCompletion(&res);
+			if (userData == EVENT_TAG)
+			{
+				// the pool completed some directory listings
+				pthread_mutex_lock(&mut_done);
+				ready.insert(ready.end(), done.begin(), done.end());
+				done.clear();
+				pthread_mutex_unlock(&mut_done);
+				armEvent();
+			}
+			else
+			{
+				readCompleted((AsyncOperation*)(uintptr_t)userData, res);
+			}
+		}
+
+		AsyncOperation* op = ready.front();
+		ready.pop_front();
+		return finishOperation(op, result, ioTime);
+	}
+
+	const char *name() const
+	{
+		return "io_uring";
+	}
+
+	void complete(AsyncOperation *op)
+	{
+		// the engine may return op as soon as it's in done and then be destroyed, so the eventfd is
+		// written before the lock is released
+		pthread_mutex_lock(&mut_done);
+		done.push_back(op);
+		uint64_t one = 1;
+		if (write(eventFd, &one, sizeof(one)) != (ssize_t)sizeof(one))
+			failure("write");
+		pthread_mutex_unlock(&mut_done);
+	}
+
+private:
+	int ringFd;
+	int eventFd;
+	void* sqRing;
+	void* cqRing;
+	void* sqes;
+	size_t sqRingSize;
+	size_t cqRingSize;
+	size_t sqesSize;
+	unsigned* sqTail;
+	unsigned sqMask;
+	unsigned* sqArray;
+	unsigned* cqHead;
+	unsigned* cqTail;
+	unsigned cqMask;
+	struct io_uring_cqe* cqes;
+
+	/**
+	 * Buffer of the eventfd read
+	 */
+	uint64_t eventValue;
+
+	/**
+	 * Operations completed by the ring or moved from done, waiting to be returned by wait
+	 */
+	std::deque<AsyncOperation*> ready;
+
+	/**
+	 * Operations completed by the pool threads, locked by mut_done
+	 */
+	std::deque<AsyncOperation*> done;
+	pthread_mutex_t mut_done;
+
+	/**
+	 * @param opcode an IORING_OP_* opcode
+	 * @return true if the kernel supports the opcode, otherwise false
+	 */
+	bool supports(unsigned opcode)
+	{
+		size_t size = sizeof(struct io_uring_probe) + PROBE_OPS * sizeof(struct io_uring_probe_op);
+		struct io_uring_probe* probe = (struct io_uring_probe*)calloc(1, size);
+		if (probe == nullptr)
+			return false;
+
+		bool supported = syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE, probe, PROBE_OPS) == 0 &&
+						 opcode <= probe->last_op && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+		free(probe);
+		return supported;
+	}
+
+	/**
+	 * Returns a cleared submission queue entry, the queue never fills since every request has at
+	 * most one entry in flight and entries are submitted right away
+	 * @return the entry
+	 */
+	struct io_uring_sqe *nextEntry()
+	{
+		unsigned index = *sqTail & sqMask;
+		struct io_uring_sqe* sqe = &((struct io_uring_sqe*)sqes)[index];
+		memset(sqe, 0, sizeof(*sqe));
+		sqArray[index] = index;
+		return sqe;
+	}
+
+	/**
+	 * Publishes the entry returned by nextEntry and submits it
+	 */
+	void submitEntry()
+	{
+		__atomic_store_n(sqTail, *sqTail + 1, __ATOMIC_RELEASE);
+		enter(1, 0, 0);
+	}
+
+	/**
+	 * Wraps io_uring_enter for error handling
+	 * @param toSubmit number of entries to submit
+	 * @param minComplete number of completions to wait for
+	 * @param flags IORING_ENTER_* flags
+	 */
+	void enter(unsigned toSubmit, unsigned minComplete, unsigned flags)
+	{
+		while (syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, nullptr, 0) == -1)
+			if (errno != EINTR && errno != EAGAIN)
+				failure("io_uring_enter");
+	}
+
+	/**
+	 * Blocks until the ring has a completion and consumes it
+	 * @param res set to the completion result, if given
+	 * @return the completion user_data
+	 */
+	uint64_t nextCompletion(int *res = nullptr)
+	{
+		unsigned head = *cqHead;
+		while (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+			enter(0, 1, IORING_ENTER_GETEVENTS);
+
+		struct io_uring_cqe* cqe = &cqes[head & cqMask];
+		uint64_t userData = cqe->user_data;
+		if (res != nullptr)
+			*res = cqe->res;
+		__atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+		return userData;
+	}
+
+	/**
+	 * Submits a read of the eventfd, it completes when a pool thread calls complete
+	 */
+	void armEvent()
+	{
+		struct io_uring_sqe* sqe = nextEntry();
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = eventFd;
+		sqe->addr = (uint64_t)(uintptr_t)&eventValue;
+		sqe->len = sizeof(eventValue);
+		sqe->off = (uint64_t)-1;
+		sqe->user_data = EVENT_TAG;
+		submitEntry();
+	}
+
+	/**
+	 * Submits the next read of a file
+	 * @param op the file read operation
+	 */
+	void submitRead(AsyncOperation *op)
+	{
+		op->result.data.resize(op->offset + READ_SIZE);
+
+		struct io_uring_sqe* sqe = nextEntry();
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = op->fd;
+		sqe->addr = (uint64_t)(uintptr_t)&op->result.data[op->offset];
+		sqe->len = READ_SIZE;
+		sqe->off = op->offset;
+		sqe->user_data = (uint64_t)(uintptr_t)op;
+		op->submitted = monotonicNow();
+		submitEntry();
+	}
+
+	/**
+	 * Advances a file read after its open or read completed
+	 * @param op the file read operation
+	 * @param res the completion result
+	 */
+	void readCompleted(AsyncOperation *op, int res)
+	{
+		// the entry ran from its submission until its completion was reaped
+		op->ioTime += monotonicNow() - op->submitted;
+
+		if (op->fd == -1)
+		{
+			// the open completed
+			if (res < 0)
+			{
+				op->result.error = -res;
+				ready.push_back(op);
+				return;
+			}
+			op->fd = res;
+
+			// the pool lists the directory and closes it
+			if (op->request.op == ASYNC_LIST_DIR)
+				poolSubmit(op);
+			else
+				submitRead(op);
+			return;
+		}
+
+		if (res == -EINTR || res == -EAGAIN)
+		{
+			submitRead(op);
+			return;
+		}
+		if (res > 0)
+		{
+			op->offset += res;
+			submitRead(op);
+			return;
+		}
+
+		// end of file or error
+		if (res < 0)
+			op->result.error = -res;
+		op->result.data.resize(op->offset);
+		close(op->fd);
+		ready.push_back(op);
+	}
+};
+
+AsyncEngine *AsyncEngine::create(unsigned depth, bool pool)
+{
+	if (pool)
+		return new PoolEngine;
+
+	UringEngine* engine = new UringEngine;
+	if (engine->init(depth))
+		return engine;
+
+	delete engine;
+	return new PoolEngine;
+}
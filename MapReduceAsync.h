@@ -0,0 +1,77 @@
+#ifndef MAPREDUCEASYNC_H
+#define MAPREDUCEASYNC_H
+
+#include <cstddef>
+#include <stdint.h>
+#include "MapReduceClient.h"
+
+struct AsyncOperation;
+
+/**
+ * Performs the given request, blocking until it's done
+ * @param request the request
+ * @param result the request result
+ */
+void asyncExecute(const AsyncRequest &request, AsyncResult &result);
+
+/**
+ * Starts the pool that lists the directories io_uring opened, or performs all the requests when
+ * io_uring is unavailable. The threads are shared by all the map threads of the job and started
+ * as requests queue up, so every map thread can have its requests performed at once.
+ * @param maxThreads the maximal number of threads, asyncDepth for every map thread
+ * @return true if successful, otherwise false
+ */
+bool asyncPoolStart(size_t maxThreads);
+
+/**
+ * Stops and joins the pool threads
+ */
+void asyncPoolStop();
+
+/**
+ * @brief Event loop of a single map thread.
+ * Requests are submitted without blocking and wait returns them as they complete, in any order.
+ */
+class AsyncEngine
+{
+public:
+	/**
+	 * Creates an io_uring engine, or a thread pool engine if io_uring is unavailable or not wanted
+	 * @param depth the maximal number of requests the caller keeps in flight
+	 * @param pool if true a thread pool engine is created even where io_uring is available
+	 * @return a new engine
+	 */
+	static AsyncEngine *create(unsigned depth, bool pool);
+
+	virtual ~AsyncEngine() {}
+
+	/**
+	 * Starts the given request
+	 * @param request the request
+	 * @param tag returned by wait when the request completes
+	 */
+	virtual void submit(const AsyncRequest &request, size_t tag) = 0;
+
+	/**
+	 * Blocks until a submitted request completes
+	 * @param result the request result
+	 * @param ioTime set to the nanoseconds the request was performed, the time it waited for a pool
+	 * thread or for the map thread to take it isn't counted. An io_uring entry counts from its
+	 * submission until its completion is reaped.
+	 * @return the request tag
+	 */
+	virtual size_t wait(AsyncResult &result, uint64_t &ioTime) = 0;
+
+	/**
+	 * @return the backend name
+	 */
+	virtual const char *name() const = 0;
+
+	/**
+	 * Hands a request performed by a pool thread back to the engine, called by the pool thread
+	 * @param op the completed operation
+	 */
+	virtual void complete(AsyncOperation *op) = 0;
+};
+
+#endif //MAPREDUCEASYNC_H
@@ -0,0 +1,275 @@
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "MapReduceCheckpoint.h"
+
+//--------------------------------------- Definitions ----------------------------------------------
+/**
+ * Identifies a chunk file and its format version
+ */
+#define CHUNK_MAGIC "MRCKPT02"
+
+/**
+ * Length of the magic string, without the terminating null
+ */
+#define CHUNK_MAGIC_LENGTH 8
+
+/**
+ * Chunk file name prefix and suffix, the index of the chunk's first item is in between
+ */
+#define CHUNK_PREFIX "chunk-"
+#define CHUNK_SUFFIX ".ckpt"
+
+/**
+ * Suffix of a chunk file that is being written, appended to the chunk file name
+ */
+#define TEMP_SUFFIX ".tmp"
+
+/**
+ * FNV-1a 64 bit parameters
+ */
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+//--------------------------------------- File layout ----------------------------------------------
+/**
+ * Chunk file header, followed by size bytes of records. Every record is a uint32_t length and
+ * the bytes written by SerializeK2V2.
+ */
+struct ChunkHeader
+{
+	char magic[CHUNK_MAGIC_LENGTH];
+	uint64_t nItems;
+	uint64_t fingerprint;
+	uint64_t first;
+	uint64_t last;
+	uint64_t size;
+	uint64_t checksum;
+};
+
+//-------------------------------------- Data structures --------------------------------------------------
+/**
+ * The checkpoint directory of the current job
+ */
+static std::string checkpointDir;
+
+/**
+ * Number of input items of the current job
+ */
+static size_t checkpointItems = 0;
+
+/**
+ * Hash of the current job's type and MapReduceOptions::checkpointFingerprint
+ */
+static uint64_t checkpointFingerprint = 0;
+
+/**
+ * If true every chunk file is synced before it's renamed
+ */
+static bool checkpointSync = false;
+
+//---------------------------------------------------------------------------------------------------
+
+/**
+ * @param data bytes to hash
+ * @param size number of bytes
+ * @return FNV-1a hash of the bytes
+ */
+static uint64_t checksum(const char *data, size_t size)
+{
+	uint64_t hash = FNV_OFFSET;
+	for (size_t i = 0; i < size; ++i)
+		hash = (hash ^ (unsigned char)data[i]) * FNV_PRIME;
+	return hash;
+}
+
+/**
+ * @param first index of the first item of the chunk
+ * @return the chunk file path
+ */
+static std::string chunkPath(size_t first)
+{
+	std::stringstream path;
+	path << checkpointDir << "/" << CHUNK_PREFIX << first << CHUNK_SUFFIX;
+	return path.str();
+}
+
+/**
+ * @param name a file name
+ * @return true if the name is CHUNK_PREFIX, a decimal item index and CHUNK_SUFFIX, optionally
+ * followed by TEMP_SUFFIX, otherwise false
+ */
+static bool isChunkName(const std::string &name)
+{
+	size_t prefix = strlen(CHUNK_PREFIX);
+	if (name.compare(0, prefix, CHUNK_PREFIX) != 0)
+		return false;
+
+	size_t digits = prefix;
+	while (digits < name.size() && name[digits] >= '0' && name[digits] <= '9')
+		digits++;
+	if (digits == prefix)
+		return false;
+
+	std::string suffix = name.substr(digits);
+	return suffix == CHUNK_SUFFIX || suffix == std::string(CHUNK_SUFFIX) + TEMP_SUFFIX;
+}
+
+/**
+ * @param path a chunk file path
+ * @return true if the file has a chunk header with the current job's fingerprint, otherwise false
+ */
+static bool isJobChunk(const std::string &path)
+{
+	std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+	ChunkHeader header;
+	file.read((char*)&header, sizeof(header));
+	return !file.fail() && memcmp(header.magic, CHUNK_MAGIC, CHUNK_MAGIC_LENGTH) == 0 &&
+		   header.fingerprint == checkpointFingerprint;
+}
+
+bool checkpointStart(const std::string &dir, size_t nItems, const std::string &jobType, uint64_t fingerprint,
+					 bool sync)
+{
+	checkpointDir = dir;
+	checkpointItems = nItems;
+	checkpointSync = sync;
+	std::string job = jobType;
+	job.append((const char*)&fingerprint, sizeof(fingerprint));
+	checkpointFingerprint = checksum(job.data(), job.size());
+	return mkdir(dir.c_str(), 0755) == 0 || errno == EEXIST;
+}
+
+bool checkpointLoad(const MapReduceBase &job, size_t first, size_t last, CHECKPOINT_PAIRS &pairs)
+{
+	pairs.clear();
+
+	std::ifstream file(chunkPath(first).c_str(), std::ios::in | std::ios::binary);
+	if (file.fail())
+		return false;
+
+	ChunkHeader header;
+	file.read((char*)&header, sizeof(header));
+	if (file.fail() || memcmp(header.magic, CHUNK_MAGIC, CHUNK_MAGIC_LENGTH) != 0 ||
+		header.nItems != checkpointItems || header.fingerprint != checkpointFingerprint ||
+		header.first != first || header.last != last)
+		return false;
+
+	std::string data(header.size, '\0');
+	file.read(&data[0], header.size);
+	if (file.fail() || checksum(data.data(), data.size()) != header.checksum)
+		return false;
+
+	size_t pos = 0;
+	while (pos < data.size())
+	{
+		uint32_t length;
+		k2Base* key = nullptr;
+		v2Base* value = nullptr;
+		bool valid = data.size() - pos >= sizeof(length);
+		if (valid)
+		{
+			memcpy(&length, data.data() + pos, sizeof(length));
+			pos += sizeof(length);
+			valid = data.size() - pos >= length && job.DeserializeK2V2(data.data() + pos, length, key, value);
+		}
+		if (!valid)
+		{
+			// map the chunk again rather than emit part of it
+			for (auto &pair : pairs)
+			{
+				delete pair.first;
+				delete pair.second;
+			}
+			pairs.clear();
+			return false;
+		}
+
+		pairs.push_back(std::make_pair(key, value));
+		pos += length;
+	}
+	return true;
+}
+
+bool checkpointAppend(const MapReduceBase &job, const k2Base *key, const v2Base *value, std::string &buffer)
+{
+	// reserve the length and fill it in after the record
+	size_t start = buffer.size();
+	buffer.append(sizeof(uint32_t), '\0');
+	if (!job.SerializeK2V2(key, value, buffer))
+	{
+		buffer.resize(start);
+		return false;
+	}
+
+	uint32_t length = (uint32_t)(buffer.size() - start - sizeof(uint32_t));
+	memcpy(&buffer[start], &length, sizeof(length));
+	return true;
+}
+
+bool checkpointWrite(size_t first, size_t last, const std::string &buffer)
+{
+	ChunkHeader header;
+	memcpy(header.magic, CHUNK_MAGIC, CHUNK_MAGIC_LENGTH);
+	header.nItems = checkpointItems;
+	header.fingerprint = checkpointFingerprint;
+	header.first = first;
+	header.last = last;
+	header.size = buffer.size();
+	header.checksum = checksum(buffer.data(), buffer.size());
+
+	// write to a temporary file and rename it, so a crashed process never leaves a partial chunk.
+	// After a machine crash an unsynced chunk may be incomplete, its checksum fails and the chunk
+	// is mapped again; syncing every chunk prevents that at the cost of a disk flush per chunk.
+	std::string path = chunkPath(first);
+	std::string tmpPath = path + TEMP_SUFFIX;
+	int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return false;
+
+	std::string data((const char*)&header, sizeof(header));
+	data += buffer;
+	size_t written = 0;
+	while (written < data.size())
+	{
+		ssize_t count = write(fd, data.data() + written, data.size() - written);
+		if (count == -1 && errno == EINTR)
+			continue;
+		if (count == -1)
+			break;
+		written += count;
+	}
+
+	bool success = written == data.size() && (!checkpointSync || fsync(fd) == 0);
+	success = close(fd) == 0 && success;
+	if (!success)
+	{
+		unlink(tmpPath.c_str());
+		return false;
+	}
+
+	return rename(tmpPath.c_str(), path.c_str()) == 0;
+}
+
+void checkpointClear()
+{
+	DIR* dirp = opendir(checkpointDir.c_str());
+	if (dirp == NULL)
+		return;
+
+	struct dirent* dirstruct;
+	while ((dirstruct = readdir(dirp)) != NULL)
+	{
+		// leave the files of other jobs and anything that isn't a chunk file alone
+		std::string path = checkpointDir + "/" + dirstruct->d_name;
+		if (isChunkName(dirstruct->d_name) && isJobChunk(path))
+			unlink(path.c_str());
+	}
+	closedir(dirp);
+}
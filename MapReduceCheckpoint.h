@@ -0,0 +1,64 @@
+#ifndef MAPREDUCECHECKPOINT_H
+#define MAPREDUCECHECKPOINT_H
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <stdint.h>
+#include "MapReduceClient.h"
+
+/**
+ * The intermediate pairs of a chunk loaded from a checkpoint
+ */
+typedef std::vector<std::pair<k2Base*, v2Base*>> CHECKPOINT_PAIRS;
+
+/**
+ * Opens the checkpoint directory of a job, creating it if needed. Chunk files of another input
+ * size, job type or fingerprint are ignored.
+ * @param dir the checkpoint directory
+ * @param nItems number of input items of the job
+ * @param jobType name of the job's class
+ * @param fingerprint identifies the job's input and parameters, MapReduceOptions::checkpointFingerprint
+ * @param sync if true every chunk file is synced to the disk before it's renamed
+ * @return true if successful, otherwise false
+ */
+bool checkpointStart(const std::string &dir, size_t nItems, const std::string &jobType, uint64_t fingerprint,
+					 bool sync);
+
+/**
+ * Loads the intermediate pairs of a chunk that completed in an earlier run of the job
+ * @param job the job, creates the pairs with DeserializeK2V2
+ * @param first index of the first item of the chunk
+ * @param last index after the last item of the chunk
+ * @param pairs the loaded pairs
+ * @return true if the chunk has a valid checkpoint, otherwise false and pairs is empty
+ */
+bool checkpointLoad(const MapReduceBase &job, size_t first, size_t last, CHECKPOINT_PAIRS &pairs);
+
+/**
+ * Appends an intermediate pair to the checkpoint buffer of a running chunk
+ * @param job the job, serializes the pair with SerializeK2V2
+ * @param key the pair key
+ * @param value the pair value
+ * @param buffer the chunk buffer
+ * @return true if successful, false if the job can't serialize the pair
+ */
+bool checkpointAppend(const MapReduceBase &job, const k2Base *key, const v2Base *value, std::string &buffer);
+
+/**
+ * Writes the checkpoint of a completed chunk, the file is replaced atomically so a crashed
+ * process never leaves a partial chunk behind
+ * @param first index of the first item of the chunk
+ * @param last index after the last item of the chunk
+ * @param buffer the chunk buffer filled by checkpointAppend
+ * @return true if successful, otherwise false
+ */
+bool checkpointWrite(size_t first, size_t last, const std::string &buffer);
+
+/**
+ * Removes the chunk files of the current job after it completed, files of other jobs and files
+ * that aren't named like chunk files stay
+ */
+void checkpointClear();
+
+#endif //MAPREDUCECHECKPOINT_H
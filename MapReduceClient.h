@@ -2,6 +2,9 @@
 #define MAPREDUCECLIENT_H
 
 #include <vector>
+#include <string>
+#include <cstddef>
+#include <stdint.h>
 
 //input key and value.
 //the key, value for the map function and the MapReduceFramework
@@ -44,10 +47,142 @@ public:
 
 typedef std::vector<v2Base *> V2_VEC;
 
+//reduction the framework applies to the values of a job that emits with Emit2Numeric
+enum NumericReduceOp { NUMERIC_NONE, NUMERIC_SUM, NUMERIC_MIN, NUMERIC_MAX, NUMERIC_COUNT };
+
+//contiguous values of a single intermediate key, valid only during the Reduce call
+struct V2_RANGE {
+	v2Base *const *first;
+	v2Base *const *last;
+
+	V2_RANGE(v2Base *const *first, v2Base *const *last) : first(first), last(last) {}
+	explicit V2_RANGE(const V2_VEC &vals) : first(vals.data()), last(vals.data() + vals.size()) {}
+
+	v2Base *const *begin() const { return first; }
+	v2Base *const *end() const { return last; }
+	size_t size() const { return last - first; }
+	bool empty() const { return first == last; }
+};
+
 class MapReduceBase {
 public:
     virtual void Map(const k1Base *const key, const v1Base *const val) const = 0;
     virtual void Reduce(const k2Base *const key, const V2_VEC &vals) const = 0;
+
+    //called instead of Reduce when the values are grouped in place (SHUFFLE_SORT),
+    //override it to avoid copying the values to a V2_VEC
+    virtual void ReduceRange(const k2Base *const key, const V2_RANGE &vals) const
+    {
+        Reduce(key, V2_VEC(vals.begin(), vals.end()));
+    }
+
+    //reducers that can reduce a key's values in parts and then reduce the partial results
+    //return true, the framework then splits keys with many values between threads
+    virtual bool IsAssociative() const { return false; }
+
+    //reduces part of a key's values to a single new partial value, only called when
+    //IsAssociative returns true. The framework deletes the partial values after Reduce.
+    //If it returns nullptr for any part the key is reduced from its original values
+    virtual v2Base *Combine(const k2Base *const key, const V2_RANGE &vals) const
+    {
+        (void)key;
+        (void)vals;
+        return nullptr;
+    }
+
+    //jobs whose Map can run more than once for the same item, and has no effect other than its
+    //Emit2 calls, return true. MapReduceOptions::speculativeMap then runs slow chunks again
+    virtual bool IsIdempotent() const { return false; }
+
+    //jobs whose Reduce emits keys ordered like the intermediate keys, every k3 of a key is less than
+    //every k3 of a greater key, return true. With MapReduceOptions::outputLimit the framework then
+    //skips the keys that come after the first outputLimit outputs
+    virtual bool IsOrderPreserving() const { return false; }
+
+    //with MapReduceOptions::outputValueLess a reduce thread that already holds outputLimit outputs
+    //asks whether a key with nValues values can emit a value that isn't less than threshold, the
+    //worst output it holds. Returning false skips the key's Reduce call
+    virtual bool CanReachTop(const k2Base *const key, size_t nValues, const v3Base *const threshold) const
+    {
+        (void)key;
+        (void)nValues;
+        (void)threshold;
+        return true;
+    }
+
+    //returns the bytes an intermediate pair's key and value take, counted against
+    //MapReduceOptions::shuffleQueueBudget. 0, the default, counts a fixed estimate per pair
+    virtual size_t K2V2Bytes(const k2Base *const key, const v2Base *const val) const
+    {
+        (void)key;
+        (void)val;
+        return 0;
+    }
+
+    //jobs whose Map emits int64_t values with Emit2Numeric return the reduction of a key's values,
+    //the framework stores the values in flat arrays, reduces them with vector kernels and calls
+    //ReduceNumeric instead of Reduce. A numeric job doesn't call Emit2
+    virtual NumericReduceOp NumericOp() const { return NUMERIC_NONE; }
+
+    //gets the reduction of a key's values and the number of values
+    virtual void ReduceNumeric(const k2Base *const key, int64_t result, size_t count) const
+    {
+        (void)key;
+        (void)result;
+        (void)count;
+    }
+
+    //appends an intermediate pair to out, jobs that implement it and DeserializeK2V2 can
+    //resume from MapReduceOptions::checkpointDir. Returns false if the pair can't be serialized
+    virtual bool SerializeK2V2(const k2Base *const key, const v2Base *const val, std::string &out) const
+    {
+        (void)key;
+        (void)val;
+        (void)out;
+        return false;
+    }
+
+    //creates the pair serialized by SerializeK2V2 from its size bytes, false if they are invalid
+    virtual bool DeserializeK2V2(const char *data, size_t size, k2Base *&key, v2Base *&val) const
+    {
+        (void)data;
+        (void)size;
+        (void)key;
+        (void)val;
+        return false;
+    }
+};
+
+//I/O operation an asynchronous map call waits for
+enum AsyncOp { ASYNC_NONE, ASYNC_READ_FILE, ASYNC_LIST_DIR };
+
+struct AsyncRequest {
+    AsyncOp op;
+    std::string path;
+
+    AsyncRequest() : op(ASYNC_NONE) {}
+    AsyncRequest(AsyncOp op, const std::string &path) : op(op), path(path) {}
+};
+
+struct AsyncResult {
+    int error;                          //0 or the errno of the failed operation
+    std::string data;                   //ASYNC_READ_FILE file content
+    std::vector<std::string> entries;   //ASYNC_LIST_DIR entry names
+
+    AsyncResult() : error(0) {}
+};
+
+//map function split around its I/O. With MapReduceOptions::asyncMap each map thread keeps many
+//requests in flight and calls MapComplete, on the map thread, as they finish. Map performs the
+//request synchronously, so the class also works without asyncMap
+class AsyncMapReduceBase : public MapReduceBase {
+public:
+    //returns the I/O the item needs, ASYNC_NONE calls MapComplete with an empty result
+    virtual AsyncRequest MapRequest(const k1Base *const key, const v1Base *const val) const = 0;
+    virtual void MapComplete(const k1Base *const key, const v1Base *const val,
+                             const AsyncResult &result) const = 0;
+
+    virtual void Map(const k1Base *const key, const v1Base *const val) const;
 };
 
 
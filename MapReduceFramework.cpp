@@ -11,7 +11,18 @@
 #include <vector>
 #include <semaphore.h>
 #include <algorithm>
+#include <cerrno>
+#include <deque>
+#include <atomic>
+#include <typeinfo>
+#include <limits>
 #include "MapReduceFramework.h"
+#include "InternedString.h"
+#include "MapReduceTrace.h"
+#include "MapReducePerf.h"
+#include "MapReduceAsync.h"
+#include "MapReduceCheckpoint.h"
+#include "MapReduceNumeric.h"
 
 /**
  * implementation of less class for use in map with k2Base pointers as keys
@@ -55,6 +66,22 @@ namespace std {
  */
 #define USEC_TO_NS(x) ((x) * 1000)
 
+/**
+ * A chunk isn't run again before it ran this long, in nanoseconds, whatever the median chunk is
+ */
+#define SPECULATE_MIN_NS 10000000
+
+/**
+ * Estimated bytes of an intermediate pair of a job that doesn't implement K2V2Bytes
+ */
+#define PAIR_BYTES 64
+
+/**
+ * A map thread adds the bytes it emitted to intermediateBytes once they reach this, and hands a
+ * batch to the shuffle once it reaches this or a part of the shuffle queue budget
+ */
+#define COUNT_BYTES 65536
+
 //------------------------------------ Global Variables ------------------------------------------
 /**
  * The thread level of map reduce framework
@@ -66,11 +93,128 @@ int gMultiThreadLevel;
  */
 IN_ITEMS_VEC* gInItemsVec;
 
+/**
+ * The order the input items are claimed in, mapOrder[k] is the index of the k-th item claimed.
+ * Map chunks are ranges of positions in this order.
+ */
+std::vector<size_t> mapOrder;
+
+/**
+ * The cost of the item at every position of mapOrder, empty if the items have no costs
+ */
+std::vector<uint64_t> mapCosts;
+
+/**
+ * A chunk stops growing when its costs reach this, if the items have costs
+ */
+uint64_t chunkCost = 0;
+
+/**
+ * The map time of the item at every position of mapOrder in nanoseconds, filled if the job
+ * returns itemTimes
+ */
+std::vector<uint64_t> mapTimes;
+
 /**
  * pointer to map reduce object given to runMapReduceFramework as an argument
  */
 MapReduceBase* gMapReduce;
 
+/**
+ * The job options given to runMapReduceFramework
+ */
+MapReduceOptions gOptions;
+
+/**
+ * If true the framework deletes the k2 and v2 objects, given to runMapReduceFramework as an argument
+ */
+bool gAutoDeleteV2K2;
+
+/**
+ * The job if its map runs asynchronously, otherwise nullptr
+ */
+AsyncMapReduceBase* gAsyncMapReduce;
+
+/**
+ * The reduction of a numeric job, NUMERIC_NONE if the job emits v2 objects
+ */
+NumericReduceOp gNumericOp = NUMERIC_NONE;
+
+/**
+ * True while the map chunks are checkpointed, cleared if the job can't serialize a pair
+ */
+std::atomic<bool> gCheckpoint(false);
+
+/**
+ * True if the job opened its checkpoint directory, its chunk files are removed when it completes
+ * even if checkpointing was disabled meanwhile
+ */
+bool gCheckpointOpened = false;
+
+/**
+ * True if the map chunks that run far longer than the median are run again
+ */
+bool gSpeculate = false;
+
+/**
+ * Number of chunks run again and the number of them whose copy finished first
+ */
+size_t nSpeculatedChunks = 0;
+size_t nSpeculativeWins = 0;
+
+/**
+ * The pairs the calling map thread emitted in the chunk it runs when map chunks are speculated,
+ * nullptr otherwise
+ */
+thread_local std::vector<std::pair<k2Base*, v2Base*>>* speculativePairs = nullptr;
+thread_local std::vector<std::pair<k2Base*, int64_t>>* speculativeNumbers = nullptr;
+thread_local std::vector<std::pair<k3Base*, v3Base*>>* speculativeOutput = nullptr;
+
+/**
+ * Number of map chunks loaded from the checkpoint instead of mapped
+ */
+size_t nResumedChunks = 0;
+
+/**
+ * Checkpoint buffer of the chunk the calling map thread runs, nullptr if it isn't checkpointed
+ */
+thread_local std::string* chunkBuffer = nullptr;
+
+/**
+ * With outputLimit and an order preserving job, key groups after this index can't reach the output
+ */
+std::atomic<size_t> limitCutoff(0);
+
+/**
+ * Number of key groups whose Reduce call was skipped because of outputLimit
+ */
+std::atomic<size_t> nSkippedGroups(0);
+
+/**
+ * True if the job has a shuffle queue budget, Emit2 then hands the pairs to the shuffle in batches
+ * and counts their bytes
+ */
+bool gBudget = false;
+
+/**
+ * Bytes of a batch handed to the shuffle, a share of the shuffle queue budget
+ */
+size_t batchBytes = 0;
+
+/**
+ * Bytes of the pairs emitted by the map threads, the bytes waiting for the shuffle, their maximum
+ * and the number of times a map thread blocked on the budget, only counted with a budget
+ */
+std::atomic<size_t> intermediateBytes(0);
+std::atomic<size_t> pendingBytes(0);
+std::atomic<size_t> peakPendingBytes(0);
+std::atomic<size_t> nBudgetWaits(0);
+
+/**
+ * Bytes the calling map thread emitted that weren't added to intermediateBytes yet
+ */
+thread_local size_t countedBytes = 0;
+
 /**
  * log file stream
  */
@@ -81,6 +225,20 @@ std::ofstream logFile;
  */
 int nTermMapThreads = 0;
 
+/**
+ * Set once every ExecMap thread terminated, the Shuffle thread then shuffles the remaining pairs
+ * and terminates
+ */
+std::atomic<bool> shuffleDone(false);
+
+/**
+ * Index of the next input item, key group and combine task claimed by the ExecMap, ExecReduce
+ * and ExecCombine threads
+ */
+size_t mapIndex = 0;
+size_t reduceIndex = 0;
+size_t combineIndex = 0;
+
 /**
  * Used to measure the time when the map reduce framework started
  */
@@ -114,11 +272,175 @@ std::map<pthread_t, std::vector<EMIT3_PAIR>*> emit3Data;
  */
 std::map<k2Base*, std::vector<v2Base*>> shuffleData;
 
+/**
+ * Holds the data sent to Emit2 in SHUFFLE_SORT mode, pairs are stored by value
+ */
+typedef std::pair<k2Base*, v2Base*> SORT_PAIR;
+std::map<pthread_t, std::vector<SORT_PAIR>*> sortData;
+
+/**
+ * All the pairs sent to Emit2 sorted by key, SHUFFLE_SORT mode
+ */
+std::vector<SORT_PAIR> sortedPairs;
+
+/**
+ * The values of sortedPairs in the same order, each key group is a contiguous run
+ */
+std::vector<v2Base*> sortedValues;
+
+/**
+ * Holds the data sent to Emit2Numeric, the values are stored inline and never allocated
+ */
+typedef std::pair<k2Base*, int64_t> NUMERIC_PAIR;
+std::map<pthread_t, std::vector<NUMERIC_PAIR>*> numericData;
+
+/**
+ * All the pairs sent to Emit2Numeric sorted by key
+ */
+std::vector<NUMERIC_PAIR> sortedNumericPairs;
+
+/**
+ * The values of sortedNumericPairs in the same order, each key group is a contiguous run
+ */
+std::vector<int64_t> sortedNumbers;
+
+/**
+ * The vector of emit2Data, sortData, numericData or emit3Data the calling thread emits to, nullptr
+ * for the others. A thread gets its vector as its argument, so the Emit functions never look up
+ * the maps while the main thread still inserts the vectors of later threads.
+ */
+thread_local std::vector<EMIT2_PAIR>* threadPairs = nullptr;
+thread_local std::vector<SORT_PAIR>* threadSortPairs = nullptr;
+thread_local std::vector<NUMERIC_PAIR>* threadNumbers = nullptr;
+thread_local std::vector<EMIT3_PAIR>* threadOutput = nullptr;
+
+/**
+ * Pairs a map thread hands to the shuffle at once, with a shuffle queue budget
+ */
+struct EmitBatch
+{
+	std::vector<SORT_PAIR> pairs;
+	size_t bytes;
+};
+
+/**
+ * Batches waiting for the shuffle, oldest first
+ */
+std::deque<EmitBatch> shuffleBatches;
+
+/**
+ * Pairs the calling map thread emitted since its last batch and their bytes
+ */
+thread_local std::vector<SORT_PAIR> emitBatch;
+thread_local size_t emitBatchBytes = 0;
+
+/**
+ * A key and its values, handed to a single Reduce call.
+ * vals is set in SHUFFLE_MAP mode, first and last point into sortedValues in SHUFFLE_SORT mode.
+ * The values of a split group are the partial values created by Combine.
+ * The values of a numeric job are numFirst to numLast in sortedNumbers.
+ */
+struct ReduceGroup
+{
+	k2Base* key;
+	V2_VEC* vals;
+	v2Base* const* first;
+	v2Base* const* last;
+	bool split;
+	const int64_t* numFirst;
+	const int64_t* numLast;
+};
+std::vector<ReduceGroup> reduceGroups;
+
+/**
+ * A range of a hot key's values reduced to a single partial value by an ExecCombine thread.
+ * The partial value is stored in partialValues[partials][part].
+ */
+struct CombineTask
+{
+	k2Base* key;
+	v2Base* const* first;
+	v2Base* const* last;
+	size_t partials;
+	size_t part;
+};
+std::vector<CombineTask> combineTasks;
+
+/**
+ * The partial values of every split key, handed to Reduce instead of the original values
+ */
+std::vector<V2_VEC> partialValues;
+
+/**
+ * A range of pairs sorted or merged by an ExecSort or ExecMerge thread.
+ * ExecSort sorts src[first, last), ExecMerge merges src[first, mid) and src[mid, last) into dst.
+ * PAIR is SORT_PAIR or NUMERIC_PAIR.
+ */
+template <typename PAIR>
+struct SortTask
+{
+	PAIR* src;
+	PAIR* dst;
+	size_t first;
+	size_t mid;
+	size_t last;
+};
+
+/**
+ * A chunk claimed by an asynchronous map thread, keyed by its first item. Its items complete in
+ * any order, the chunk is checkpointed when the last one does.
+ */
+struct MapChunk
+{
+	size_t last;
+	size_t remaining;
+	std::string buffer;
+};
+typedef std::map<size_t, MapChunk> MAP_CHUNKS;
+
+/**
+ * A chunk mapped while speculation is on, keyed by its first item. start is the monotonic time
+ * the first copy started, copies the number of threads that ran it and done is set when a copy
+ * emitted its pairs. done is set under mut_chunks and read without it between the items of a copy.
+ */
+struct RunningChunk
+{
+	size_t last;
+	uint64_t start;
+	unsigned copies;
+	std::atomic<bool> done;
+};
+std::map<size_t, RunningChunk> runningChunks;
+
+/**
+ * Run times of the completed chunks in nanoseconds, the median decides which chunks are slow
+ */
+std::vector<uint64_t> chunkTimes;
+
 /**
  * vector of map threads
  */
 std::vector<pthread_t> mapThreads;
 
+/**
+ * A thread kept between jobs when keepThreads is set. routine is set while the thread runs a task,
+ * busy from the task's _pthread_create until its _pthread_join and done once the task returned.
+ */
+struct PoolThread
+{
+	pthread_t thread;
+	void *(*routine)(void *);
+	void* arg;
+	bool busy;
+	bool done;
+	pthread_cond_t cv_task;
+};
+
+/**
+ * The kept threads of all the jobs, never freed
+ */
+std::vector<PoolThread*> poolThreads;
+
 //----------------------------------------- mutex ---------------------------------------------------------
 /**
  * used to lock the log output
@@ -136,20 +458,41 @@ pthread_mutex_t mut_index = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t mut_counter = PTHREAD_MUTEX_INITIALIZER;
 
 /**
- * used to lock access to emit2Data during its initialization
+ * used to lock getTime function
+ */
+pthread_mutex_t mut_time = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * used to lock shuffleBatches and pendingBytes
  */
-pthread_mutex_t mut_emitData = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t mut_budget = PTHREAD_MUTEX_INITIALIZER;
 
 /**
- * used to lock getTime function
+ * used to lock runningChunks and chunkTimes
  */
-pthread_mutex_t mut_time = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t mut_chunks = PTHREAD_MUTEX_INITIALIZER;
 
 /**
  * condition variable
  */
 pthread_cond_t cv = PTHREAD_COND_INITIALIZER;
 
+/**
+ * used to lock poolThreads, signaled when a kept thread completes its task
+ */
+pthread_mutex_t mut_pool = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cv_pool = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Signaled when a speculated chunk completes
+ */
+pthread_cond_t cv_chunks = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Signaled when the shuffle takes a batch and pendingBytes drops
+ */
+pthread_cond_t cv_budget = PTHREAD_COND_INITIALIZER;
+
 // ----------------------------------------- semaphores --------------------------------------------------
 /**
  * Used by Emit2 to notify Shuffle that new data is available to shuffle
@@ -163,35 +506,80 @@ sem_t sem_shuffleDone;
 //------------------------------------- function declarations --------------------------------------------
 
 static bool OUT_ITEMS_COMP(OUT_ITEM const& rhs, OUT_ITEM const& lhs);
+static bool OUT_ITEMS_BETTER(OUT_ITEM const& lhs, OUT_ITEM const& rhs);
+static bool EMIT3_PAIR_BETTER(EMIT3_PAIR const& lhs, EMIT3_PAIR const& rhs);
+template <typename PAIR> static bool SORT_PAIR_COMP(PAIR const& rhs, PAIR const& lhs);
 static void failure(int retVal, std::string functionName);
 static void log(std::string msg);
 static void* ExecMap(void* p);
+static void orderMapItems();
+static bool claimMapChunk(size_t &first, size_t &last);
+static uint64_t mapItem(size_t position);
+static bool claimStraggler(size_t &first, size_t &last);
+static void mapChunk(size_t first, size_t last, bool speculative);
+static bool commitChunk(size_t first, bool speculative);
+static uint64_t monotonicNow();
+static void asyncMap();
+static void asyncComplete(MAP_CHUNKS &chunks, size_t item, const AsyncResult &result, uint64_t ioTime);
+static bool resumeChunk(size_t first, size_t last);
+static void saveChunk(size_t first, size_t last, const std::string &buffer);
+static size_t pairBytes(k2Base* key, v2Base* value);
+static void countBytes(size_t bytes);
+static void publishBatch();
+static void flushEmitCounts();
+static bool shuffleBatch();
+static bool shufflePair();
 static void* Shuffle(void* p);
 static void* ExecReduce(void* p);
+static bool skipGroup(size_t index, const ReduceGroup &group, const std::vector<EMIT3_PAIR> &out);
+static void limitOutput(OUT_ITEMS_VEC &reduceData);
+template <typename PAIR> static void* ExecSort(void* p);
+template <typename PAIR> static void* ExecMerge(void* p);
+static void* ExecCombine(void* p);
+static void splitHotGroups();
+static void combineHotGroups();
+template <typename PAIR>
+static void sortShuffleData(std::map<pthread_t, std::vector<PAIR>*> &data, std::vector<PAIR> &sorted);
+static void buildReduceGroups();
+static void buildNumericGroups();
+template <typename PAIR>
+static void runSortTasks(std::vector<SortTask<PAIR>> &tasks, void *(*start_routine)(void *));
 static std::string getTime();
 static std::string elapsedTime(const struct timeval &start, const struct timeval &end);
 static void freeEmit2Data(bool autoDeleteV2K2);
 static void freeEmit3Data();
+static void freeSortData();
+static void freePartialValues();
+static void freeMapOrder();
+static void releaseGroup(ReduceGroup &group);
+static void* ExecPooled(void* p);
 
 static void _gettimeofday(struct timeval *time);
 static void _pthread_mutex_lock(pthread_mutex_t *mutex);
 static void _pthread_mutex_unlock(pthread_mutex_t *mutex);
 static void _sem_init(sem_t *sem, unsigned int value);
-static void _pthread_create(pthread_t *thread, void *(*start_routine)(void *));
+static void _pthread_create(pthread_t *thread, void *(*start_routine)(void *), void *arg = nullptr);
+template <typename PAIR>
+static void createEmitThread(pthread_t &thread, void *(*start_routine)(void *),
+							 std::map<pthread_t, std::vector<PAIR>*> &data);
 static void _pthread_join(pthread_t thread);
-static void _pthread_mutex_destroy(pthread_mutex_t *mutex);
 static void _sem_destroy(sem_t *sem);
-static void _pthread_cond_destroy(pthread_cond_t *cond);
 static void _sem_wait(sem_t *sem);
 static void _sem_post(sem_t *sem);
 static void _pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
-static void _sem_getvalue(sem_t *sem, int *sval);
-static void _pthread_cancel(pthread_t thread);
+static void _pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex, uint64_t ns);
 //---------------------------------------------------------------------------------------------------
 
 
 OUT_ITEMS_VEC RunMapReduceFramework(MapReduceBase& mapReduce, IN_ITEMS_VEC& itemsVec,
 									int multiThreadLevel, bool autoDeleteV2K2)
+{
+	return RunMapReduceFramework(mapReduce, itemsVec, multiThreadLevel, autoDeleteV2K2, MapReduceOptions());
+}
+
+OUT_ITEMS_VEC RunMapReduceFramework(MapReduceBase& mapReduce, IN_ITEMS_VEC& itemsVec,
+									int multiThreadLevel, bool autoDeleteV2K2,
+									const MapReduceOptions& options)
 {
 	/// get map start time
 	_gettimeofday(&mapStartTime);
@@ -200,6 +588,29 @@ OUT_ITEMS_VEC RunMapReduceFramework(MapReduceBase& mapReduce, IN_ITEMS_VEC& item
 	gInItemsVec = &itemsVec;
 	gMapReduce = &mapReduce;
 	gMultiThreadLevel = multiThreadLevel;
+	gOptions = options;
+	gAutoDeleteV2K2 = autoDeleteV2K2;
+	gNumericOp = options.mapOnly ? NUMERIC_NONE : mapReduce.NumericOp();
+
+	// the framework can run several jobs in a process, one at a time
+	nTermMapThreads = 0;
+	shuffleDone = false;
+	mapIndex = 0;
+	reduceIndex = 0;
+	combineIndex = 0;
+	limitCutoff = std::numeric_limits<size_t>::max();
+	nSkippedGroups = 0;
+	intermediateBytes = 0;
+	pendingBytes = 0;
+	peakPendingBytes = 0;
+	nBudgetWaits = 0;
+	shuffleBatches.clear();
+
+	if (!gOptions.traceFile.empty())
+		traceStart();
+	if (gOptions.perfCounters)
+		perfStart();
+	uint64_t phaseStart = traceNow();
 
 	// open log file
 	logFile.open(LOG_FILE, std::ios::out | std::ios::app);
@@ -212,10 +623,78 @@ OUT_ITEMS_VEC RunMapReduceFramework(MapReduceBase& mapReduce, IN_ITEMS_VEC& item
 	log(ss.str());
 	_pthread_mutex_unlock(&mut_log);
 
-	// initialized shuffle semaphore
-	_sem_init(&sem_shuffle, 0);
-	// initialize shuffle done semaphore
-	_sem_init(&sem_shuffleDone, 1);
+	// numeric values are kept in flat arrays, which only the sort shuffle groups
+	if (gNumericOp != NUMERIC_NONE && gOptions.shuffleMode != SHUFFLE_SORT)
+	{
+		gOptions.shuffleMode = SHUFFLE_SORT;
+		_pthread_mutex_lock(&mut_log);
+		log("Numeric job, using SHUFFLE_SORT");
+		_pthread_mutex_unlock(&mut_log);
+	}
+	if (gNumericOp != NUMERIC_NONE && gOptions.skewThreshold > 0)
+	{
+		_pthread_mutex_lock(&mut_log);
+		log("skewThreshold ignored, numeric jobs reduce their values without Combine");
+		_pthread_mutex_unlock(&mut_log);
+	}
+
+	// the sort shuffle and a map only job have no shuffle thread to wait for
+	gBudget = gOptions.shuffleQueueBudget > 0 && gOptions.shuffleMode == SHUFFLE_MAP && !gOptions.mapOnly;
+	batchBytes = std::max((size_t)1, std::min((size_t)COUNT_BYTES, gOptions.shuffleQueueBudget / (2 * multiThreadLevel)));
+	if (gOptions.shuffleQueueBudget > 0 && !gBudget)
+	{
+		_pthread_mutex_lock(&mut_log);
+		log("Shuffle queue budget ignored, the job has no Shuffle thread");
+		_pthread_mutex_unlock(&mut_log);
+	}
+
+	// the pool performs the requests io_uring can't, shared by all the map threads
+	gAsyncMapReduce = nullptr;
+	if (gOptions.asyncMap && gOptions.asyncDepth > 0)
+		gAsyncMapReduce = dynamic_cast<AsyncMapReduceBase*>(&mapReduce);
+	if (gAsyncMapReduce != nullptr)
+		failure(!asyncPoolStart((size_t)gOptions.asyncDepth * multiThreadLevel), "pthread_create");
+
+	// an asynchronous map keeps its own requests in flight, chunks are speculated only by ExecMap
+	gSpeculate = gOptions.speculativeMap && gAsyncMapReduce == nullptr && mapReduce.IsIdempotent();
+	nSpeculatedChunks = 0;
+	nSpeculativeWins = 0;
+	runningChunks.clear();
+	chunkTimes.clear();
+	if (gOptions.speculativeMap && !gSpeculate)
+	{
+		_pthread_mutex_lock(&mut_log);
+		log("Speculative map disabled, the job isn't idempotent or its map is asynchronous");
+		_pthread_mutex_unlock(&mut_log);
+	}
+
+	// completed chunks of an earlier run are loaded instead of mapped
+	gCheckpoint = false;
+	gCheckpointOpened = false;
+	nResumedChunks = 0;
+	// the checkpoint format holds v2 objects, which numeric jobs don't emit
+	if (!gOptions.checkpointDir.empty() && !gOptions.mapOnly && gNumericOp == NUMERIC_NONE)
+	{
+		gCheckpoint = checkpointStart(gOptions.checkpointDir, itemsVec.size(), typeid(mapReduce).name(),
+									  gOptions.checkpointFingerprint, gOptions.checkpointSync);
+		gCheckpointOpened = gCheckpoint;
+		if (!gCheckpoint)
+		{
+			_pthread_mutex_lock(&mut_log);
+			log("Failed to open checkpoint directory " + gOptions.checkpointDir);
+			_pthread_mutex_unlock(&mut_log);
+		}
+	}
+
+	orderMapItems();
+
+	if (!gOptions.mapOnly)
+	{
+		// initialized shuffle semaphore
+		_sem_init(&sem_shuffle, 0);
+		// initialize shuffle done semaphore
+		_sem_init(&sem_shuffleDone, 1);
+	}
 
 	// initialize threads data structures
 	mapThreads = std::vector<pthread_t>(multiThreadLevel);
@@ -225,93 +704,202 @@ OUT_ITEMS_VEC RunMapReduceFramework(MapReduceBase& mapReduce, IN_ITEMS_VEC& item
 	// create ExecMap threads and initialize their data structures
 	for (pthread_t &thread : mapThreads)
 	{
-		_pthread_mutex_lock(&mut_emitData);
-		_pthread_create(&thread, &ExecMap);
-		emit2Data[thread] = new std::vector<EMIT2_PAIR>;	// initialize thread data structure
-		_pthread_mutex_unlock(&mut_emitData);
+		if (gOptions.mapOnly)
+			createEmitThread(thread, &ExecMap, emit3Data);
+		else if (gNumericOp != NUMERIC_NONE)
+			createEmitThread(thread, &ExecMap, numericData);
+		else if (gOptions.shuffleMode == SHUFFLE_SORT)
+			createEmitThread(thread, &ExecMap, sortData);
+		else
+			createEmitThread(thread, &ExecMap, emit2Data);
+	}
+
+	std::stringstream msg;
+	if (gOptions.mapOnly)
+	{
+		// the map threads wrote the output
+		for (pthread_t& thread : mapThreads)
+			_pthread_join(thread);
+		if (gAsyncMapReduce != nullptr)
+			asyncPoolStop();
+		perfCollect(PERF_MAP);
+	}
+	else if (gOptions.shuffleMode == SHUFFLE_SORT)
+	{
+		// nothing to shuffle until the map threads are done
+		for (pthread_t& thread : mapThreads)
+			_pthread_join(thread);
+		if (gAsyncMapReduce != nullptr)
+			asyncPoolStop();
+		perfCollect(PERF_MAP);
+
+		perfThreadBegin(PERF_SHUFFLE);
+		if (gNumericOp != NUMERIC_NONE)
+			sortShuffleData(numericData, sortedNumericPairs);
+		else
+			sortShuffleData(sortData, sortedPairs);
+	}
+	else
+	{
+		// create Shuffle thread
+		_pthread_create(&shuffle, &Shuffle);
+
+		// wait for the map threads to hand over all their pairs
+		_pthread_mutex_lock(&mut_counter);
+		while (nTermMapThreads < gMultiThreadLevel)
+			_pthread_cond_wait(&cv, &mut_counter);
+		_pthread_mutex_unlock(&mut_counter);
+
+		// wake the shuffle, it shuffles the remaining pairs and terminates
+		shuffleDone = true;
+		_sem_post(&sem_shuffle);
+		_pthread_join(shuffle);
+		for (pthread_t& thread : mapThreads)
+			_pthread_join(thread);
+		if (gAsyncMapReduce != nullptr)
+			asyncPoolStop();
+		perfCollect(PERF_MAP);
+		perfThreadBegin(PERF_SHUFFLE);
+
+		// log
+		_pthread_mutex_lock(&mut_log);
+		msg << "Thread Shuffle terminated " << getTime();
+		log(msg.str());
+		_pthread_mutex_unlock(&mut_log);
 	}
 
-	// create Shuffle thread
-	_pthread_create(&shuffle, &Shuffle);
+	traceEvent("map and shuffle", "phase", phaseStart);
 
-	// wait for shuffle to end, run shuffle as long as there are values to shuffle or not all the map
-	// threads terminated
-	_pthread_mutex_lock(&mut_counter);
-	int sval = 0;
-	while (nTermMapThreads < gMultiThreadLevel || sval > 0)
+	if (gOptions.itemTimes != nullptr)
 	{
-		_pthread_cond_wait(&cv, &mut_counter);
-		_sem_getvalue(&sem_shuffle, &sval);
+		gOptions.itemTimes->assign(itemsVec.size(), 0);
+		for (size_t k = 0; k < mapOrder.size(); ++k)
+			(*gOptions.itemTimes)[mapOrder[k]] = mapTimes[k];
 	}
-	_pthread_mutex_unlock(&mut_counter);
 
-	// cancel shuffle thread
-	_pthread_cancel(shuffle);
-	// join remaining threads to free thread data
-	_pthread_join(shuffle);
-	for (pthread_t& thread : mapThreads)
-		_pthread_join(thread);
+	if (!gOptions.mapOnly)
+	{
+		phaseStart = traceNow();
+		if (gNumericOp != NUMERIC_NONE)
+		{
+			buildNumericGroups();
+		}
+		else
+		{
+			buildReduceGroups();
+			splitHotGroups();
+		}
+		traceEvent("group keys", "phase", phaseStart);
+		perfCollect(PERF_SHUFFLE);
+	}
 
 	// log
 	_pthread_mutex_lock(&mut_log);
-	std::stringstream msg;
-	msg << "Thread Shuffle terminated " << getTime();
-	log(msg.str());
-
 	msg.str(std::string());
 	_gettimeofday(&mapEndTime);
 	msg << "Map and Shuffle took " << elapsedTime(mapStartTime, mapEndTime) << "ns";
 	log(msg.str());
+	if (gCheckpoint)
+	{
+		msg.str(std::string());
+		msg << "Resumed " << nResumedChunks << " map chunks from checkpoint " << gOptions.checkpointDir;
+		log(msg.str());
+	}
+	else if (!gOptions.checkpointDir.empty())
+	{
+		log("Checkpoint disabled, the job is map only, numeric or can't serialize its intermediate pairs");
+	}
+	if (gBudget)
+	{
+		msg.str(std::string());
+		msg << "Intermediate pairs took about " << intermediateBytes << " bytes";
+		log(msg.str());
+		msg.str(std::string());
+		msg << "At most " << peakPendingBytes << " of the " << gOptions.shuffleQueueBudget
+			<< " budget bytes waited for the shuffle, map threads blocked " << nBudgetWaits << " times";
+		log(msg.str());
+	}
+	if (nSpeculatedChunks > 0)
+	{
+		msg.str(std::string());
+		msg << "Ran " << nSpeculatedChunks << " slow map chunks again, " << nSpeculativeWins
+			<< " copies finished first";
+		log(msg.str());
+	}
 	_pthread_mutex_unlock(&mut_log);
 
-	// create ExecReduce threads
-	for (pthread_t &thread : reduceThreads)
+	if (!gOptions.mapOnly)
 	{
-		_pthread_mutex_lock(&mut_emitData);
-		_pthread_create(&thread, &ExecReduce);
-		emit3Data[thread] = new std::vector<EMIT3_PAIR>;
-		_pthread_mutex_unlock(&mut_emitData);
+		phaseStart = traceNow();
+		combineHotGroups();
+
+		// create ExecReduce threads
+		for (pthread_t &thread : reduceThreads)
+			createEmitThread(thread, &ExecReduce, emit3Data);
+
+		// wait for reduce threads to terminate before continuing
+		for (pthread_t &thread : reduceThreads)
+			_pthread_join(thread);
+		traceEvent("reduce", "phase", phaseStart);
+		perfCollect(PERF_REDUCE);
 	}
 
-	// wait for reduce threads to terminate before continuing
-	for (pthread_t &thread : reduceThreads)
-		_pthread_join(thread);
-
 	// log
 	_pthread_mutex_lock(&mut_log);
 	msg.str(std::string());
 	_gettimeofday(&reduceEndTime);
 	msg << "Reduce took " << elapsedTime(mapEndTime, reduceEndTime) << "ns";
 	log(msg.str());
+	if (nSkippedGroups > 0)
+	{
+		msg.str(std::string());
+		msg << "Skipped " << nSkippedGroups << " keys that can't reach the output limit";
+		log(msg.str());
+	}
+	for (const std::string &line : perfReport())
+		log(line);
 	_pthread_mutex_unlock(&mut_log);
 
-	// destroy mutexes
-	_pthread_mutex_destroy(&mut_log);
-	_pthread_mutex_destroy(&mut_index);
-	_pthread_mutex_destroy(&mut_counter);
-	_pthread_mutex_destroy(&mut_emitData);
-	_pthread_mutex_destroy(&mut_time);
-
-	// destroy cond
-	_pthread_cond_destroy(&cv);
+	// the mutexes and cond are statically initialized and reused by the next job
 
 	// destroy semaphores
-	_sem_destroy(&sem_shuffle);
-	_sem_destroy(&sem_shuffleDone);
-
-	logFile.close();
+	if (!gOptions.mapOnly)
+	{
+		_sem_destroy(&sem_shuffle);
+		_sem_destroy(&sem_shuffleDone);
+	}
 
 	// create out items vector
+	phaseStart = traceNow();
 	OUT_ITEMS_VEC reduceData;
 	for (auto &item : emit3Data)
 		for (auto &pair : *item.second)
 			reduceData.push_back(*pair);
 
-	std::sort(reduceData.begin(), reduceData.end(), OUT_ITEMS_COMP);
+	limitOutput(reduceData);
+	if (gOptions.sortOutput)
+		std::sort(reduceData.begin(), reduceData.end(), OUT_ITEMS_COMP);
+	traceEvent("sort output", "phase", phaseStart);
+
+	if (traceEnabled() && !traceWrite(gOptions.traceFile))
+		log("Failed to write trace file " + gOptions.traceFile);
+
+	// the job completed, a later job must not resume from its chunks
+	if (gCheckpointOpened)
+		checkpointClear();
+
+	logFile.close();
 
 	// free data
 	freeEmit2Data(autoDeleteV2K2);
 	freeEmit3Data();
+	freeSortData();
+	freePartialValues();
+	freeMapOrder();
+
+	// the string table belongs to the job, a later job starts with an empty table
+	clearInternedStrings();
+	intermediateBytes = 0;
 
 	return reduceData;
 }
@@ -325,16 +913,68 @@ void Emit2(k2Base* key, v2Base* value)
 {
 	static int ret;
 	pthread_t t = pthread_self();
+	failure(gOptions.mapOnly, "Emit2 in a map only job");
+
+	// a speculated chunk emits only if its copy finishes first
+	if (speculativePairs != nullptr)
+	{
+		speculativePairs->push_back(std::make_pair(key, value));
+		return;
+	}
+
+	// record the pair in the chunk checkpoint before the shuffle may delete it
+	if (chunkBuffer != nullptr && !checkpointAppend(*gMapReduce, key, value, *chunkBuffer))
+		gCheckpoint = false;
+
+	// sorted after the map phase, no need to synchronize with a shuffle thread
+	if (gOptions.shuffleMode == SHUFFLE_SORT)
+	{
+		threadSortPairs->push_back(std::make_pair(key, value));
+		return;
+	}
+
+	// the shuffle takes whole batches, the map thread only waits when the budget is used up
+	if (gBudget)
+	{
+		size_t bytes = pairBytes(key, value);
+		countBytes(bytes);
+		emitBatch.push_back(std::make_pair(key, value));
+		emitBatchBytes += bytes;
+		if (emitBatchBytes >= batchBytes)
+			publishBatch();
+		return;
+	}
 
 	// block until shuffle is done with the data structure
+	uint64_t waitStart = traceNow();
 	_sem_wait(&sem_shuffleDone);
+	traceEvent("wait sem_shuffleDone", "wait", waitStart);
 
-	emit2Data[pthread_self()]->push_back(new std::pair<k2Base*, v2Base*>(key, value));
+	threadPairs->push_back(new std::pair<k2Base*, v2Base*>(key, value));
 
 	// notify shuffle new data is available
 	_sem_post(&sem_shuffle);
 }
 
+/**
+ * Puts given key and numeric value in the numeric data structure, used by jobs whose NumericOp
+ * isn't NUMERIC_NONE
+ * @param key pointer to a key object
+ * @param value the value
+ */
+void Emit2Numeric(k2Base* key, int64_t value)
+{
+	failure(gOptions.mapOnly, "Emit2Numeric in a map only job");
+
+	if (speculativeNumbers != nullptr)
+	{
+		speculativeNumbers->push_back(std::make_pair(key, value));
+		return;
+	}
+
+	threadNumbers->push_back(std::make_pair(key, value));
+}
+
 /**
  * Puts the given key-value pair in the reduce data structure
  * @param key a key object
@@ -342,28 +982,768 @@ void Emit2(k2Base* key, v2Base* value)
  */
 void Emit3(k3Base* key, v3Base* value)
 {
-	emit3Data[pthread_self()]->push_back(new std::pair<k3Base*, v3Base*>(key, value));
+	// a map only job's speculated chunk emits only if its copy finishes first
+	if (speculativeOutput != nullptr)
+	{
+		speculativeOutput->push_back(std::make_pair(key, value));
+		return;
+	}
+
+	std::vector<EMIT3_PAIR>* out = threadOutput;
+	size_t limit = gOptions.outputLimit;
+	if (limit == 0)
+	{
+		out->push_back(new std::pair<k3Base*, v3Base*>(key, value));
+		return;
+	}
+
+	// keep the best limit pairs in a heap whose front is the worst of them
+	if (out->size() < limit)
+	{
+		out->push_back(new std::pair<k3Base*, v3Base*>(key, value));
+		std::push_heap(out->begin(), out->end(), EMIT3_PAIR_BETTER);
+		return;
+	}
+
+	OUT_ITEM item(key, value);
+	if (!OUT_ITEMS_BETTER(item, *out->front()))
+	{
+		delete key;
+		delete value;
+		return;
+	}
+
+	// replace the worst pair
+	std::pop_heap(out->begin(), out->end(), EMIT3_PAIR_BETTER);
+	EMIT3_PAIR worst = out->back();
+	delete worst->first;
+	delete worst->second;
+	*worst = item;
+	std::push_heap(out->begin(), out->end(), EMIT3_PAIR_BETTER);
+}
+
+MapReduceMemory MapReduceMemoryUsage()
+{
+	return MapReduceMemory{intermediateBytes, pendingBytes, peakPendingBytes, nBudgetWaits};
+}
+
+/**
+ * Thread function to execute the map method
+ * @param p the vector the thread emits to, of the type the job's mode stores its pairs in
+ * @return always returns nullptr
+ */
+static void* ExecMap(void* p)
+{
+	int ret;
+
+	// a kept thread may still point to the vectors of an earlier task
+	threadPairs = nullptr;
+	threadSortPairs = nullptr;
+	threadNumbers = nullptr;
+	threadOutput = nullptr;
+	if (gOptions.mapOnly)
+		threadOutput = (std::vector<EMIT3_PAIR>*)p;
+	else if (gNumericOp != NUMERIC_NONE)
+		threadNumbers = (std::vector<NUMERIC_PAIR>*)p;
+	else if (gOptions.shuffleMode == SHUFFLE_SORT)
+		threadSortPairs = (std::vector<SORT_PAIR>*)p;
+	else
+		threadPairs = (std::vector<EMIT2_PAIR>*)p;
+
+	traceThreadName("ExecMap");
+	emitBatch.clear();
+	emitBatchBytes = 0;
+	perfThreadBegin(PERF_MAP);
+
+	_pthread_mutex_lock(&mut_log);
+
+	std::stringstream msg;
+	msg << "Thread ExecMap created " << getTime();
+	log(msg.str());
+	msg.str(std::string());
+
+	_pthread_mutex_unlock(&mut_log);
+
+	// an asynchronous map returns once all the chunks were claimed, the loop below finds none
+	if (gAsyncMapReduce != nullptr)
+		asyncMap();
+
+	// once all the chunks were claimed an idle thread may run a slow chunk again
+	size_t first, last;
+	while (true)
+	{
+		bool claimed = claimMapChunk(first, last);
+		if (!claimed && !claimStraggler(first, last))
+			break;
+
+		if (claimed && resumeChunk(first, last))
+			continue;
+		mapChunk(first, last, !claimed);
+	}
+
+	_pthread_mutex_lock(&mut_log);
+
+	msg << "Thread ExecMap terminated " << getTime();
+	log(msg.str());
+
+	_pthread_mutex_unlock(&mut_log);
+
+	// the shuffle must have every pair before the thread counts as terminated
+	flushEmitCounts();
+
+	_pthread_mutex_lock(&mut_counter);
+	nTermMapThreads++;
+	pthread_cond_signal(&cv);
+	_pthread_mutex_unlock(&mut_counter);
+
+	return nullptr;
+}
+
+/**
+ * Sets the order the input items are claimed in, the most expensive first if the items have
+ * costs, otherwise the order of the items vector
+ */
+static void orderMapItems()
+{
+	size_t nItems = gInItemsVec->size();
+	mapOrder.resize(nItems);
+	for (size_t k = 0; k < nItems; ++k)
+		mapOrder[k] = k;
+	mapCosts.clear();
+	chunkCost = 0;
+
+	const std::vector<uint64_t> &costs = gOptions.itemCosts;
+	bool ordered = !costs.empty() && costs.size() == nItems && !gCheckpoint;
+	if (!costs.empty() && !ordered)
+	{
+		_pthread_mutex_lock(&mut_log);
+		log("Item costs ignored, their number doesn't match the items or the job is checkpointed");
+		_pthread_mutex_unlock(&mut_log);
+	}
+
+	if (ordered)
+	{
+		std::stable_sort(mapOrder.begin(), mapOrder.end(),
+						 [&costs](size_t lhs, size_t rhs) { return costs[lhs] > costs[rhs]; });
+
+		uint64_t total = 0;
+		mapCosts.resize(nItems);
+		for (size_t k = 0; k < nItems; ++k)
+		{
+			mapCosts[k] = costs[mapOrder[k]];
+			total += mapCosts[k];
+		}
+
+		// every thread claims about CHUNK chunks, an item costlier than that is a chunk of its own
+		chunkCost = total / ((uint64_t)gMultiThreadLevel * CHUNK);
+	}
+
+	// items that aren't mapped, loaded from a checkpoint, keep their estimate
+	mapTimes.assign(nItems, 0);
+	if (gOptions.itemTimes != nullptr && ordered)
+		mapTimes = mapCosts;
+	else if (gOptions.itemTimes != nullptr && costs.size() == nItems)
+		mapTimes = costs;
+}
+
+/**
+ * Calls the map function on an input item
+ * @param position the item position in mapOrder
+ * @return the map time in nanoseconds if the job returns itemTimes, otherwise 0
+ */
+static uint64_t mapItem(size_t position)
+{
+	IN_ITEM &item = (*gInItemsVec)[mapOrder[position]];
+	if (gOptions.itemTimes == nullptr)
+	{
+		gMapReduce->Map(item.first, item.second);
+		return 0;
+	}
+
+	uint64_t start = monotonicNow();
+	gMapReduce->Map(item.first, item.second);
+	return monotonicNow() - start;
+}
+
+/**
+ * Claims the next chunk of input items for the calling ExecMap thread. Chunks are CHUNK items, or
+ * less if the items have costs and the chunk's costs reached chunkCost.
+ * @param first set to the position in mapOrder of the first item of the chunk
+ * @param last set to the position after the last item of the chunk
+ * @return false if all the items were claimed, otherwise true
+ */
+static bool claimMapChunk(size_t &first, size_t &last)
+{
+	// lock
+	uint64_t waitStart = traceNow();
+	_pthread_mutex_lock(&mut_index);
+	traceEvent("wait mut_index", "wait", waitStart);
+
+	// check that the index isn't out of bounds
+	if (mapIndex >= gInItemsVec->size())
+	{
+		_pthread_mutex_unlock(&mut_index);
+		return false;
+	}
+
+	// get the chunk and increment index
+	first = mapIndex;
+	if (mapCosts.empty())
+	{
+		mapIndex = std::min(mapIndex + CHUNK, gInItemsVec->size());
+	}
+	else
+	{
+		uint64_t cost = 0;
+		do
+		{
+			cost += mapCosts[mapIndex++];
+		} while (mapIndex < mapCosts.size() && mapIndex - first < CHUNK && cost + mapCosts[mapIndex] <= chunkCost);
+	}
+	last = mapIndex;
+
+	// unlock
+	_pthread_mutex_unlock(&mut_index);
+	return true;
+}
+
+/**
+ * Runs the map function on a chunk and emits its pairs. With speculation the pairs are emitted
+ * only if this copy of the chunk finishes first, otherwise they are deleted.
+ * @param first index of the first item of the chunk
+ * @param last index after the last item of the chunk
+ * @param speculative true if another thread runs the chunk too
+ */
+static void mapChunk(size_t first, size_t last, bool speculative)
+{
+	uint64_t chunkStart = traceNow();
+	std::string buffer;
+	if (!gSpeculate)
+	{
+		chunkBuffer = gCheckpoint ? &buffer : nullptr;
+		for (size_t j = first; j < last; ++j)
+			mapTimes[j] = mapItem(j);
+		chunkBuffer = nullptr;
+		traceEvent("map chunk", "map", chunkStart, (long)first);
+
+		saveChunk(first, last, buffer);
+		return;
+	}
+
+	// map nodes don't move, the copies check done through the pointer without the lock
+	_pthread_mutex_lock(&mut_chunks);
+	RunningChunk* chunk = &runningChunks[first];
+	if (!speculative)
+	{
+		chunk->last = last;
+		chunk->start = monotonicNow();
+		chunk->copies = 1;
+		chunk->done = false;
+	}
+	_pthread_mutex_unlock(&mut_chunks);
+
+	// stop early if the other copy already finished
+	std::vector<SORT_PAIR> pairs;
+	std::vector<NUMERIC_PAIR> numbers;
+	std::vector<OUT_ITEM> output;
+	std::vector<uint64_t> times(last - first, 0);
+	speculativePairs = &pairs;
+	speculativeNumbers = &numbers;
+	speculativeOutput = &output;
+	for (size_t j = first; j < last && !chunk->done.load(std::memory_order_relaxed); ++j)
+		times[j - first] = mapItem(j);
+	speculativePairs = nullptr;
+	speculativeNumbers = nullptr;
+	speculativeOutput = nullptr;
+	traceEvent(speculative ? "speculative map chunk" : "map chunk", "map", chunkStart, (long)first);
+
+	if (!commitChunk(first, speculative))
+	{
+		// the losing copy's pairs never reach the job, they are deleted like the other pairs the
+		// framework discards
+		if (gAutoDeleteV2K2)
+		{
+			for (SORT_PAIR &pair : pairs)
+			{
+				delete pair.first;
+				delete pair.second;
+			}
+			for (NUMERIC_PAIR &pair : numbers)
+				delete pair.first;
+			for (OUT_ITEM &pair : output)
+			{
+				delete pair.first;
+				delete pair.second;
+			}
+		}
+		return;
+	}
+
+	std::copy(times.begin(), times.end(), mapTimes.begin() + first);
+	chunkBuffer = gCheckpoint ? &buffer : nullptr;
+	for (SORT_PAIR &pair : pairs)
+		Emit2(pair.first, pair.second);
+	for (NUMERIC_PAIR &pair : numbers)
+		Emit2Numeric(pair.first, pair.second);
+	for (OUT_ITEM &pair : output)
+		Emit3(pair.first, pair.second);
+	chunkBuffer = nullptr;
+
+	saveChunk(first, last, buffer);
+}
+
+/**
+ * Waits until a running chunk is slow enough to run again, the calling thread then runs a copy
+ * @param first set to the index of the first item of the chunk
+ * @param last set to the index after the last item of the chunk
+ * @return false if speculation is off or all the chunks completed, otherwise true
+ */
+static bool claimStraggler(size_t &first, size_t &last)
+{
+	if (!gSpeculate)
+		return false;
+
+	_pthread_mutex_lock(&mut_chunks);
+	while (true)
+	{
+		uint64_t median = 0;
+		if (!chunkTimes.empty())
+		{
+			std::vector<uint64_t> times(chunkTimes);
+			std::nth_element(times.begin(), times.begin() + times.size() / 2, times.end());
+			median = times[times.size() / 2];
+		}
+		uint64_t threshold = std::max<uint64_t>(median * gOptions.speculativeFactor, SPECULATE_MIN_NS);
+
+		// a chunk is copied once, and only after some chunk completed to compare it with
+		uint64_t now = monotonicNow();
+		uint64_t wait = 0;
+		bool running = false;
+		for (auto &chunk : runningChunks)
+		{
+			if (chunk.second.done)
+				continue;
+			running = true;
+			if (chunk.second.copies > 1 || chunkTimes.empty())
+				continue;
+
+			uint64_t elapsed = now - chunk.second.start;
+			if (elapsed >= threshold)
+			{
+				chunk.second.copies++;
+				first = chunk.first;
+				last = chunk.second.last;
+				nSpeculatedChunks++;
+				_pthread_mutex_unlock(&mut_chunks);
+				return true;
+			}
+			if (wait == 0 || threshold - elapsed < wait)
+				wait = threshold - elapsed;
+		}
+
+		if (!running)
+		{
+			_pthread_mutex_unlock(&mut_chunks);
+			return false;
+		}
+
+		// wake up when a chunk becomes slow or another one completes
+		uint64_t waitStart = traceNow();
+		if (wait == 0)
+			_pthread_cond_wait(&cv_chunks, &mut_chunks);
+		else
+			_pthread_cond_timedwait(&cv_chunks, &mut_chunks, wait);
+		traceEvent("wait cv_chunks", "wait", waitStart);
+	}
+}
+
+/**
+ * Marks a chunk done if no other copy finished before
+ * @param first index of the first item of the chunk
+ * @param speculative true if the calling thread ran a copy of the chunk
+ * @return true if the calling thread's pairs are the chunk's pairs, otherwise false
+ */
+static bool commitChunk(size_t first, bool speculative)
+{
+	_pthread_mutex_lock(&mut_chunks);
+	RunningChunk &chunk = runningChunks[first];
+	if (chunk.done)
+	{
+		_pthread_mutex_unlock(&mut_chunks);
+		return false;
+	}
+
+	chunk.done = true;
+	chunkTimes.push_back(monotonicNow() - chunk.start);
+	if (speculative)
+		nSpeculativeWins++;
+	pthread_cond_broadcast(&cv_chunks);
+	_pthread_mutex_unlock(&mut_chunks);
+	return true;
+}
+
+/**
+ * Map loop of an ExecMap thread when the job is an AsyncMapReduceBase. Keeps up to asyncDepth
+ * requests in flight and calls MapComplete on this thread as they finish, so Emit2 works as usual.
+ */
+static void asyncMap()
+{
+	AsyncEngine* engine = AsyncEngine::create(gOptions.asyncDepth, gOptions.asyncPool);
+
+	_pthread_mutex_lock(&mut_log);
+	log(std::string("Thread ExecMap uses ") + engine->name() + " for asynchronous map");
+	_pthread_mutex_unlock(&mut_log);
+
+	std::deque<size_t> claimed;
+	MAP_CHUNKS chunks;
+	size_t first, last;
+	unsigned inFlight = 0;
+	bool more = true;
+	while (true)
+	{
+		// fill the engine, claiming chunks as needed
+		while (inFlight < gOptions.asyncDepth)
+		{
+			if (claimed.empty())
+			{
+				if (!more || !claimMapChunk(first, last))
+				{
+					more = false;
+					break;
+				}
+				if (resumeChunk(first, last))
+					continue;
+
+				chunks[first] = MapChunk{last, last - first, std::string()};
+				for (size_t j = first; j < last; ++j)
+					claimed.push_back(j);
+			}
+
+			size_t j = claimed.front();
+			claimed.pop_front();
+			IN_ITEM &item = (*gInItemsVec)[mapOrder[j]];
+			uint64_t requestStart = (gOptions.itemTimes != nullptr) ? monotonicNow() : 0;
+			AsyncRequest request = gAsyncMapReduce->MapRequest(item.first, item.second);
+			if (gOptions.itemTimes != nullptr)
+				mapTimes[j] = monotonicNow() - requestStart;
+			if (request.op == ASYNC_NONE)
+			{
+				asyncComplete(chunks, j, AsyncResult(), 0);
+				continue;
+			}
+			engine->submit(request, j);
+			inFlight++;
+		}
+
+		if (inFlight == 0)
+			break;
+
+		// complete a single request, then refill
+		AsyncResult result;
+		uint64_t ioTime;
+		uint64_t waitStart = traceNow();
+		size_t j = engine->wait(result, ioTime);
+		traceEvent("wait async", "wait", waitStart);
+		inFlight--;
+
+		uint64_t completeStart = traceNow();
+		asyncComplete(chunks, j, result, ioTime);
+		traceEvent("map complete", "map", completeStart, (long)j);
+	}
+
+	delete engine;
+}
+
+/**
+ * Calls MapComplete for an item of an asynchronous map and checkpoints its chunk if it was the
+ * chunk's last item
+ * @param chunks the chunks claimed by the calling thread
+ * @param item the item position in mapOrder
+ * @param result the item's request result
+ * @param ioTime nanoseconds the item's request was performed
+ */
+static void asyncComplete(MAP_CHUNKS &chunks, size_t item, const AsyncResult &result, uint64_t ioTime)
+{
+	auto chunk = --chunks.upper_bound(item);
+
+	chunkBuffer = gCheckpoint ? &chunk->second.buffer : nullptr;
+	IN_ITEM &inItem = (*gInItemsVec)[mapOrder[item]];
+	uint64_t completeStart = (gOptions.itemTimes != nullptr) ? monotonicNow() : 0;
+	gAsyncMapReduce->MapComplete(inItem.first, inItem.second, result);
+	chunkBuffer = nullptr;
+
+	// the MapRequest time was stored when the request was made, the time the request waited for a
+	// pool thread or in the engine isn't the item's cost
+	if (gOptions.itemTimes != nullptr)
+		mapTimes[item] += ioTime + monotonicNow() - completeStart;
+
+	if (--chunk->second.remaining == 0)
+	{
+		saveChunk(chunk->first, chunk->second.last, chunk->second.buffer);
+		chunks.erase(chunk);
+	}
+}
+
+/**
+ * Emits the pairs of a chunk that completed in an earlier run of the job
+ * @param first index of the first item of the chunk
+ * @param last index after the last item of the chunk
+ * @return true if the chunk was loaded from the checkpoint, false if it must be mapped
+ */
+static bool resumeChunk(size_t first, size_t last)
+{
+	if (!gCheckpoint)
+		return false;
+
+	uint64_t start = traceNow();
+	CHECKPOINT_PAIRS pairs;
+	if (!checkpointLoad(*gMapReduce, first, last, pairs))
+		return false;
+
+	for (auto &pair : pairs)
+		Emit2(pair.first, pair.second);
+	traceEvent("resume chunk", "map", start, (long)first);
+
+	_pthread_mutex_lock(&mut_counter);
+	nResumedChunks++;
+	_pthread_mutex_unlock(&mut_counter);
+	return true;
+}
+
+/**
+ * Writes the checkpoint of a mapped chunk
+ * @param first index of the first item of the chunk
+ * @param last index after the last item of the chunk
+ * @param buffer the pairs the chunk emitted, serialized by Emit2
+ */
+static void saveChunk(size_t first, size_t last, const std::string &buffer)
+{
+	if (!gCheckpoint)
+		return;
+
+	uint64_t start = traceNow();
+	if (!checkpointWrite(first, last, buffer))
+	{
+		_pthread_mutex_lock(&mut_log);
+		std::stringstream msg;
+		msg << "Failed to checkpoint map chunk " << first;
+		log(msg.str());
+		_pthread_mutex_unlock(&mut_log);
+	}
+	traceEvent("checkpoint chunk", "map", start, (long)first);
+}
+
+/**
+ * Returns the bytes a pair counts against the shuffle queue budget
+ * @param key the pair's key
+ * @param value the pair's value
+ * @return K2V2Bytes, or PAIR_BYTES if the job doesn't implement it
+ */
+static size_t pairBytes(k2Base* key, v2Base* value)
+{
+	size_t bytes = gMapReduce->K2V2Bytes(key, value);
+	return (bytes == 0) ? PAIR_BYTES : bytes;
+}
+
+/**
+ * Counts bytes emitted by the calling map thread, intermediateBytes is updated every COUNT_BYTES
+ * @param bytes the number of bytes
+ */
+static void countBytes(size_t bytes)
+{
+	countedBytes += bytes;
+	if (countedBytes >= COUNT_BYTES)
+	{
+		intermediateBytes += countedBytes;
+		countedBytes = 0;
+	}
+}
+
+/**
+ * Hands the calling map thread's batch to the shuffle. Blocks while the waiting batches and this
+ * one exceed the shuffle queue budget, a batch is never held back when no other batch waits.
+ */
+static void publishBatch()
+{
+	if (emitBatch.empty())
+		return;
+
+	_pthread_mutex_lock(&mut_budget);
+	if (pendingBytes > 0 && pendingBytes + emitBatchBytes > gOptions.shuffleQueueBudget)
+	{
+		nBudgetWaits++;
+		uint64_t waitStart = traceNow();
+		while (pendingBytes > 0 && pendingBytes + emitBatchBytes > gOptions.shuffleQueueBudget)
+			_pthread_cond_wait(&cv_budget, &mut_budget);
+		traceEvent("wait shuffle queue budget", "wait", waitStart);
+	}
+
+	shuffleBatches.push_back(EmitBatch{std::vector<SORT_PAIR>(), emitBatchBytes});
+	shuffleBatches.back().pairs.swap(emitBatch);
+	pendingBytes += emitBatchBytes;
+	if (pendingBytes > peakPendingBytes)
+		peakPendingBytes = pendingBytes.load();
+	_pthread_mutex_unlock(&mut_budget);
+	emitBatchBytes = 0;
+
+	// notify shuffle a batch is available
+	_sem_post(&sem_shuffle);
+}
+
+/**
+ * Hands the rest of the calling map thread's pairs to the shuffle and adds its byte count when the
+ * job has a shuffle queue budget, called when the thread terminates
+ */
+static void flushEmitCounts()
+{
+	if (!gBudget)
+		return;
+	publishBatch();
+	intermediateBytes += countedBytes;
+	countedBytes = 0;
+}
+
+/**
+ * Inserts a pair into the shuffle data
+ * @param key pointer to a key object, deleted if the key is already in the shuffle data
+ * @param value pointer to a value object
+ */
+static void shuffleInsert(k2Base* key, v2Base* value)
+{
+	// a key that is already in the map is a duplicate and isn't needed anymore
+	auto found = shuffleData.find(key);
+	if (found == shuffleData.end())
+	{
+		shuffleData[key].push_back(value);
+	}
+	else
+	{
+		found->second.push_back(value);
+		if (gAutoDeleteV2K2)
+			delete key;
+	}
+}
+
+/**
+ * Inserts the oldest waiting batch into the shuffle data and wakes the map threads waiting for the
+ * shuffle queue budget
+ * @return false if no batch was waiting, otherwise true
+ */
+static bool shuffleBatch()
+{
+	_pthread_mutex_lock(&mut_budget);
+	if (shuffleBatches.empty())
+	{
+		_pthread_mutex_unlock(&mut_budget);
+		return false;
+	}
+	EmitBatch batch{std::vector<SORT_PAIR>(), shuffleBatches.front().bytes};
+	batch.pairs.swap(shuffleBatches.front().pairs);
+	shuffleBatches.pop_front();
+	_pthread_mutex_unlock(&mut_budget);
+
+	for (SORT_PAIR &pair : batch.pairs)
+		shuffleInsert(pair.first, pair.second);
+
+	_pthread_mutex_lock(&mut_budget);
+	pendingBytes -= batch.bytes;
+	pthread_cond_broadcast(&cv_budget);
+	_pthread_mutex_unlock(&mut_budget);
+	return true;
+}
+
+/**
+ * Inserts the pair a map thread put in emit2Data into the shuffle data and lets the map threads
+ * emit the next one
+ * @return false if no pair was waiting, otherwise true
+ */
+static bool shufflePair()
+{
+	for (auto &item : emit2Data)
+	{
+		if (item.second->empty())
+			continue;
+
+		auto iter = item.second->begin();
+		EMIT2_PAIR pair = *iter;
+		shuffleInsert(pair->first, pair->second);
+		delete pair;
+		(item.second)->erase(iter);
+		_sem_post(&sem_shuffleDone);
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Shuffle the map data
+ * @param p ignored parameter, needed for pthread_init argument signature
+ * @return always returns null
+ */
+static void* Shuffle(void* p)
+{
+	int ret;
+	_pthread_mutex_lock(&mut_log);
+
+	std::stringstream msg;
+	msg << "Thread Shuffle created " << getTime();
+	log(msg.str());
+	msg.str(std::string());
+
+	_pthread_mutex_unlock(&mut_log);
+
+	std::map<pthread_t, int> threadIndexMap;
+	for (auto &thread : mapThreads)
+		threadIndexMap[thread] = 0;
+
+	traceThreadName("Shuffle");
+	perfThreadBegin(PERF_SHUFFLE);
+
+	while (true) {
+		uint64_t waitStart = traceNow();
+		_sem_wait(&sem_shuffle);
+		traceEvent("wait sem_shuffle", "wait", waitStart);
+
+		uint64_t batchStart = traceNow();
+		if (gBudget)
+			shuffleBatch();
+		else
+			shufflePair();
+		traceEvent("shuffle batch", "shuffle", batchStart);
+
+		// the map threads terminated, nothing is added anymore
+		if (shuffleDone)
+		{
+			while (gBudget ? shuffleBatch() : shufflePair());
+			break;
+		}
+	}
+
+	return nullptr;
 }
 
 /**
- * Thread function to execute the map method
- * @param p ignored parameter, needed for pthread_init argument signature
- * @return always returns nullptr
+ * Reduce the shuffle data
+ * @param p the vector of EMIT3_PAIR the thread emits to
+ * @return always returns null
  */
-static void* ExecMap(void* p)
+static void* ExecReduce(void* p)
 {
-	static size_t i = 0;
 	int ret;
+	size_t j;
 
-	_pthread_mutex_lock(&mut_emitData);
-	_pthread_mutex_unlock(&mut_emitData);
-
-	//emit2Data[pthread_self()] = (std::vector<EMIT2_PAIR>*)p;
+	threadPairs = nullptr;
+	threadSortPairs = nullptr;
+	threadNumbers = nullptr;
+	threadOutput = (std::vector<EMIT3_PAIR>*)p;
+	std::vector<EMIT3_PAIR>* out = threadOutput;
+	traceThreadName("ExecReduce");
+	perfThreadBegin(PERF_REDUCE);
 
 	_pthread_mutex_lock(&mut_log);
 
 	std::stringstream msg;
-	msg << "Thread ExecMap created " << getTime();
+	msg << "Thread ExecReduce created " << getTime();
 	log(msg.str());
 	msg.str(std::string());
 
@@ -372,144 +1752,469 @@ static void* ExecMap(void* p)
 	while (true)
 	{
 		// lock
+		uint64_t waitStart = traceNow();
 		_pthread_mutex_lock(&mut_index);
+		traceEvent("wait mut_index", "wait", waitStart);
 
-		// check that i isn't out of bounds
-		if (i >= gInItemsVec->size())
+		if (reduceIndex >= reduceGroups.size())
 		{
+
 			_pthread_mutex_unlock(&mut_index);
+
 			break;
 		}
 
-		// get iterator and increment index
-		auto iter = gInItemsVec->begin() + i;
-		i = i + CHUNK;
+		// get index and increment it
+		size_t first = reduceIndex;
+		reduceIndex = reduceIndex + CHUNK;
 
 		// unlock
 		_pthread_mutex_unlock(&mut_index);
 
-		// perform the map function
-		for (int j = 0; j < CHUNK && iter != gInItemsVec->end(); ++iter, ++j)
-			gMapReduce->Map((*iter).first, (*iter).second);
+		// perform the reduce function
+		uint64_t chunkStart = traceNow();
+		for (j = first; j < first + CHUNK && j < reduceGroups.size(); ++j)
+		{
+			ReduceGroup &group = reduceGroups[j];
+			if (skipGroup(j, group, *out))
+			{
+				releaseGroup(group);
+				nSkippedGroups++;
+				continue;
+			}
+
+			if (group.numFirst != nullptr)
+				gMapReduce->ReduceNumeric(group.key, numericReduce(gNumericOp, group.numFirst, group.numLast),
+										  group.numLast - group.numFirst);
+			else if (group.vals != nullptr)
+				gMapReduce->Reduce(group.key, *group.vals);
+			else
+				gMapReduce->ReduceRange(group.key, V2_RANGE(group.first, group.last));
+
+			// free the group now instead of after the whole reduce phase
+			releaseGroup(group);
+
+			// this thread holds limit outputs from groups up to j, an order preserving job's later
+			// groups only emit greater keys
+			if (gOptions.outputLimit > 0 && gOptions.outputValueLess == nullptr &&
+				out->size() >= gOptions.outputLimit && gMapReduce->IsOrderPreserving())
+			{
+				size_t cutoff = limitCutoff;
+				while (j < cutoff && !limitCutoff.compare_exchange_weak(cutoff, j));
+			}
+		}
+		traceEvent("reduce chunk", "reduce", chunkStart, (long)first);
 	}
 
 	_pthread_mutex_lock(&mut_log);
 
-	msg << "Thread ExecMap terminated " << getTime();
+	msg << "Thread ExecReduce terminated " << getTime();
 	log(msg.str());
 
 	_pthread_mutex_unlock(&mut_log);
 
-	_pthread_mutex_lock(&mut_counter);
-	nTermMapThreads++;
-	pthread_cond_signal(&cv);
-	_pthread_mutex_unlock(&mut_counter);
+	return nullptr;
+}
 
-	pthread_exit(nullptr);
+/**
+ * Decides whether a key group can be skipped because none of its outputs can pass outputLimit
+ * @param index the group index in reduceGroups
+ * @param group the group
+ * @param out the outputs of the calling ExecReduce thread
+ * @return true if the group's Reduce call isn't needed, otherwise false
+ */
+static bool skipGroup(size_t index, const ReduceGroup &group, const std::vector<EMIT3_PAIR> &out)
+{
+	if (gOptions.outputLimit == 0)
+		return false;
+	if (gOptions.outputValueLess == nullptr)
+		return index > limitCutoff;
+
+	// the number of values of a split group is only known before Combine
+	if (out.size() < gOptions.outputLimit || group.split)
+		return false;
+
+	size_t nValues;
+	if (group.numFirst != nullptr)
+		nValues = group.numLast - group.numFirst;
+	else if (group.vals != nullptr)
+		nValues = group.vals->size();
+	else
+		nValues = group.last - group.first;
+	return !gMapReduce->CanReachTop(group.key, nValues, out.front()->second);
 }
 
 /**
- * Shuffle the map data
- * @param p ignored parameter, needed for pthread_init argument signature
- * @return always returns null
+ * Keeps the best outputLimit pairs of the ExecReduce threads' outputs and deletes the rest
+ * @param reduceData the outputs of all the ExecReduce threads
  */
-static void* Shuffle(void* p)
+static void limitOutput(OUT_ITEMS_VEC &reduceData)
 {
-	int ret;
-	_pthread_mutex_lock(&mut_log);
+	size_t limit = gOptions.outputLimit;
+	if (limit == 0 || reduceData.size() <= limit)
+		return;
 
-	std::stringstream msg;
-	msg << "Thread Shuffle created " << getTime();
-	log(msg.str());
-	msg.str(std::string());
+	std::nth_element(reduceData.begin(), reduceData.begin() + limit, reduceData.end(), OUT_ITEMS_BETTER);
+	for (auto pair = reduceData.begin() + limit; pair != reduceData.end(); ++pair)
+	{
+		delete pair->first;
+		delete pair->second;
+	}
+	reduceData.resize(limit);
+}
 
-	_pthread_mutex_unlock(&mut_log);
+/**
+ * Sorts a range of pairs
+ * @param p pointer to a SortTask
+ * @return always returns nullptr
+ */
+template <typename PAIR>
+static void* ExecSort(void* p)
+{
+	SortTask<PAIR>* task = (SortTask<PAIR>*)p;
+	traceThreadName("ExecSort");
+	perfThreadBegin(PERF_SHUFFLE);
+	uint64_t start = traceNow();
+	std::sort(task->src + task->first, task->src + task->last, SORT_PAIR_COMP<PAIR>);
+	traceEvent("sort slice", "shuffle", start, (long)task->first);
+	return nullptr;
+}
 
-	std::map<pthread_t, int> threadIndexMap;
-	for (auto &thread : mapThreads)
-		threadIndexMap[thread] = 0;
+/**
+ * Merges two adjacent sorted ranges of pairs
+ * @param p pointer to a SortTask
+ * @return always returns nullptr
+ */
+template <typename PAIR>
+static void* ExecMerge(void* p)
+{
+	SortTask<PAIR>* task = (SortTask<PAIR>*)p;
+	traceThreadName("ExecMerge");
+	perfThreadBegin(PERF_SHUFFLE);
+	uint64_t start = traceNow();
+	std::merge(task->src + task->first, task->src + task->mid, task->src + task->mid,
+			   task->src + task->last, task->dst + task->first, SORT_PAIR_COMP<PAIR>);
+	traceEvent("merge runs", "shuffle", start, (long)task->first);
+	return nullptr;
+}
 
-	while (true) {
-		_sem_wait(&sem_shuffle);
+/**
+ * Runs a thread for every task and waits for all of them to terminate
+ * @param tasks the tasks, each thread gets a pointer to its task
+ * @param start_routine ExecSort or ExecMerge
+ */
+template <typename PAIR>
+static void runSortTasks(std::vector<SortTask<PAIR>> &tasks, void *(*start_routine)(void *))
+{
+	std::vector<pthread_t> threads(tasks.size());
+	for (size_t k = 0; k < tasks.size(); ++k)
+		_pthread_create(&threads[k], start_routine, &tasks[k]);
+	for (pthread_t &thread : threads)
+		_pthread_join(thread);
+}
+
+/**
+ * Collects the pairs sent to Emit2 in SHUFFLE_SORT mode, or to Emit2Numeric, and sorts them by key.
+ * Slices are sorted in parallel and then merged pairwise, the merges of each round run in parallel.
+ * @param data the pairs of every map thread, freed
+ * @param sorted the sorted pairs
+ */
+template <typename PAIR>
+static void sortShuffleData(std::map<pthread_t, std::vector<PAIR>*> &data, std::vector<PAIR> &sorted)
+{
+	size_t total = 0;
+	for (auto &item : data)
+		total += item.second->size();
 
-		for (auto &item : emit2Data)
+	sorted.reserve(total);
+	for (auto &item : data)
+	{
+		sorted.insert(sorted.end(), item.second->begin(), item.second->end());
+		delete item.second;
+	}
+	data.clear();
+
+	if (total == 0)
+		return;
+
+	// sort a slice per thread
+	size_t nRuns = std::max<size_t>(1, std::min<size_t>(gMultiThreadLevel, total));
+	std::vector<size_t> bounds;
+	for (size_t k = 0; k <= nRuns; ++k)
+		bounds.push_back(total * k / nRuns);
+
+	std::vector<SortTask<PAIR>> tasks;
+	for (size_t k = 0; k < nRuns; ++k)
+		tasks.push_back(SortTask<PAIR>{sorted.data(), nullptr, bounds[k], bounds[k], bounds[k + 1]});
+	runSortTasks(tasks, &ExecSort<PAIR>);
+
+	// merge adjacent runs until a single run remains
+	std::vector<PAIR> buffer(total);
+	PAIR* src = sorted.data();
+	PAIR* dst = buffer.data();
+	while (bounds.size() > 2)
+	{
+		std::vector<size_t> merged;
+		tasks.clear();
+		for (size_t k = 0; k + 1 < bounds.size(); k += 2)
 		{
-			if (item.second->empty())
-				continue;
+			// an odd run out is merged with an empty run, which copies it
+			size_t last = (k + 2 < bounds.size()) ? bounds[k + 2] : bounds[k + 1];
+			tasks.push_back(SortTask<PAIR>{src, dst, bounds[k], bounds[k + 1], last});
+			merged.push_back(bounds[k]);
+		}
+		merged.push_back(total);
+		runSortTasks(tasks, &ExecMerge<PAIR>);
 
+		std::swap(src, dst);
+		bounds.swap(merged);
+	}
 
-			auto iter = item.second->begin();
-			if (iter == item.second->end())
-				continue;
+	if (src != sorted.data())
+		sorted.swap(buffer);
+}
 
-			shuffleData[(*iter)->first].push_back((*iter)->second);
-			(item.second)->erase(iter);
-			_sem_post(&sem_shuffleDone);
-			break;
+/**
+ * Creates the list of key groups handed to the ExecReduce threads
+ */
+static void buildReduceGroups()
+{
+	if (gOptions.shuffleMode == SHUFFLE_MAP)
+	{
+		for (auto &item : shuffleData)
+			reduceGroups.push_back(ReduceGroup{item.first, &item.second, nullptr, nullptr, false, nullptr,
+											   nullptr});
+		return;
+	}
+
+	sortedValues.resize(sortedPairs.size());
+	for (size_t i = 0; i < sortedPairs.size(); ++i)
+		sortedValues[i] = sortedPairs[i].second;
+
+	// equal keys are adjacent, a group ends where the next key is greater
+	v2Base* const* values = sortedValues.data();
+	size_t first = 0;
+	for (size_t i = 1; i <= sortedPairs.size(); ++i)
+	{
+		if (i == sortedPairs.size() || *(sortedPairs[first].first) < *(sortedPairs[i].first))
+		{
+			reduceGroups.push_back(ReduceGroup{sortedPairs[first].first, nullptr, values + first, values + i,
+											   false, nullptr, nullptr});
+			first = i;
+		}
+		else if (gAutoDeleteV2K2)
+		{
+			// the group is represented by its first key, duplicates aren't needed anymore
+			delete sortedPairs[i].first;
 		}
-		pthread_cond_signal(&cv);
 	}
+
+	// the keys and values now live in reduceGroups and sortedValues
+	std::vector<SORT_PAIR>().swap(sortedPairs);
 }
 
 /**
- * Reduce the shuffle data
- * @param p ignored parameter, needed for pthread_init argument signature
- * @return always returns null
+ * Creates the key groups of a numeric job, the values of each group are a contiguous run of
+ * sortedNumbers that ExecReduce reduces with the vector kernels
  */
-static void* ExecReduce(void* p)
+static void buildNumericGroups()
 {
-	static size_t i = 0;
-	int ret;
-	size_t j;
+	sortedNumbers.resize(sortedNumericPairs.size());
+	for (size_t i = 0; i < sortedNumericPairs.size(); ++i)
+		sortedNumbers[i] = sortedNumericPairs[i].second;
 
-	_pthread_mutex_lock(&mut_emitData);
+	const int64_t* values = sortedNumbers.data();
+	size_t first = 0;
+	for (size_t i = 1; i <= sortedNumericPairs.size(); ++i)
+	{
+		if (i == sortedNumericPairs.size() || *(sortedNumericPairs[first].first) < *(sortedNumericPairs[i].first))
+		{
+			reduceGroups.push_back(ReduceGroup{sortedNumericPairs[first].first, nullptr, nullptr, nullptr, false,
+											   values + first, values + i});
+			first = i;
+		}
+		else if (gAutoDeleteV2K2)
+		{
+			delete sortedNumericPairs[i].first;
+		}
+	}
 
-	_pthread_mutex_unlock(&mut_emitData);
+	std::vector<NUMERIC_PAIR>().swap(sortedNumericPairs);
+}
 
-	_pthread_mutex_lock(&mut_log);
+/**
+ * Deletes the objects of a key group after its Reduce call returned.
+ * The partial values of a split group are always deleted, the key and the values only if
+ * autoDeleteV2K2, the values of a split group were already deleted by combineHotGroups.
+ * @param group the reduced group
+ */
+static void releaseGroup(ReduceGroup &group)
+{
+	if (group.split)
+	{
+		for (v2Base* value : *group.vals)
+			delete value;
+		V2_VEC().swap(*group.vals);
+	}
+	else if (gAutoDeleteV2K2)
+	{
+		if (group.vals != nullptr)
+		{
+			for (v2Base* value : *group.vals)
+				delete value;
+			V2_VEC().swap(*group.vals);
+		}
+		else
+		{
+			for (v2Base* const* value = group.first; value != group.last; ++value)
+				delete *value;
+		}
+	}
 
-	std::stringstream msg;
-	msg << "Thread ExecReduce created " << getTime();
-	log(msg.str());
-	msg.str(std::string());
+	if (gAutoDeleteV2K2)
+		delete group.key;
+	group.key = nullptr;
+}
 
-	_pthread_mutex_unlock(&mut_log);
+/**
+ * Combines ranges of hot keys values
+ * @param p ignored parameter, needed for pthread_init argument signature
+ * @return always returns nullptr
+ */
+static void* ExecCombine(void* p)
+{
+	(void)p;
+	traceThreadName("ExecCombine");
+	perfThreadBegin(PERF_REDUCE);
 
 	while (true)
 	{
 		// lock
+		uint64_t waitStart = traceNow();
 		_pthread_mutex_lock(&mut_index);
+		traceEvent("wait mut_index", "wait", waitStart);
 
-		if (i >= shuffleData.size())
+		if (combineIndex >= combineTasks.size())
 		{
-
 			_pthread_mutex_unlock(&mut_index);
-
 			break;
 		}
 
-		// get iterator and increment index
-		auto iter = shuffleData.begin();
-		for(j = 0; j < i; ++iter, ++j)	// increment in a loop because iter is bidirectional iterator
-			;
-		i = i + CHUNK;
+		// ranges are large, take one at a time
+		CombineTask &task = combineTasks[combineIndex];
+		combineIndex++;
 
 		// unlock
 		_pthread_mutex_unlock(&mut_index);
 
-		// perform the map function
-		for (j = 0; j < CHUNK && iter != shuffleData.end(); ++iter, ++j)
-			gMapReduce->Reduce((*iter).first, (*iter).second);
+		uint64_t start = traceNow();
+		partialValues[task.partials][task.part] = gMapReduce->Combine(task.key, V2_RANGE(task.first, task.last));
+		traceEvent("combine range", "reduce", start, (long)task.partials);
 	}
 
-	_pthread_mutex_lock(&mut_log);
+	return nullptr;
+}
 
-	msg << "Thread ExecReduce terminated " << getTime();
-	log(msg.str());
+/**
+ * Splits the values of keys with more than skewThreshold values into combine tasks
+ */
+static void splitHotGroups()
+{
+	size_t threshold = gOptions.skewThreshold;
+	if (threshold == 0 || !gMapReduce->IsAssociative())
+		return;
 
-	_pthread_mutex_unlock(&mut_log);
+	for (ReduceGroup &group : reduceGroups)
+	{
+		v2Base* const* first = (group.vals != nullptr) ? group.vals->data() : group.first;
+		v2Base* const* last = (group.vals != nullptr) ? group.vals->data() + group.vals->size() : group.last;
+		if ((size_t)(last - first) <= threshold)
+			continue;
+
+		size_t nParts = ((last - first) + threshold - 1) / threshold;
+		for (size_t part = 0; part < nParts; ++part)
+		{
+			v2Base* const* partLast = (part + 1 < nParts) ? first + (part + 1) * threshold : last;
+			combineTasks.push_back(CombineTask{group.key, first + part * threshold, partLast,
+											   partialValues.size(), part});
+		}
+		partialValues.push_back(V2_VEC(nParts, nullptr));
+
+		// reduce the partial values instead, partialValues may still grow so point to it later
+		group.split = true;
+	}
+
+	if (!combineTasks.empty())
+	{
+		_pthread_mutex_lock(&mut_log);
+		std::stringstream msg;
+		msg << "Split " << partialValues.size() << " hot keys into " << combineTasks.size() << " ranges";
+		log(msg.str());
+		_pthread_mutex_unlock(&mut_log);
+	}
+}
+
+/**
+ * Runs the combine tasks in parallel and points the split groups at their partial values.
+ * A group with a range Combine returned no value for is reduced from its original values instead,
+ * its partial values are deleted. The original values of the other split groups are deleted if
+ * autoDeleteV2K2.
+ */
+static void combineHotGroups()
+{
+	if (combineTasks.empty())
+		return;
+
+	std::vector<pthread_t> combineThreads(gMultiThreadLevel);
+	for (pthread_t &thread : combineThreads)
+		_pthread_create(&thread, &ExecCombine);
+	for (pthread_t &thread : combineThreads)
+		_pthread_join(thread);
+
+	// split groups are in the same order as partialValues
+	size_t partials = 0;
+	size_t unsplit = 0;
+	for (ReduceGroup &group : reduceGroups)
+	{
+		if (!group.split)
+			continue;
+
+		V2_VEC &vals = partialValues[partials++];
+		if (std::find(vals.begin(), vals.end(), (v2Base*)nullptr) != vals.end())
+		{
+			for (v2Base* value : vals)
+				delete value;
+			V2_VEC().swap(vals);
+			group.split = false;
+			unsplit++;
+			continue;
+		}
+
+		if (gAutoDeleteV2K2)
+		{
+			if (group.vals != nullptr)
+			{
+				for (v2Base* value : *group.vals)
+					delete value;
+				V2_VEC().swap(*group.vals);
+			}
+			else
+			{
+				for (v2Base* const* value = group.first; value != group.last; ++value)
+					delete *value;
+			}
+		}
+		group.vals = &vals;
+	}
 
-	pthread_exit(nullptr);
+	if (unsplit > 0)
+	{
+		_pthread_mutex_lock(&mut_log);
+		std::stringstream msg;
+		msg << "Combine returned no value, " << unsplit << " hot keys reduced from their values";
+		log(msg.str());
+		_pthread_mutex_unlock(&mut_log);
+	}
 }
 
 /**
@@ -573,6 +2278,59 @@ static bool OUT_ITEMS_COMP(OUT_ITEM const& rhs, OUT_ITEM const& lhs)
 	return (*(rhs.first) < *(lhs.first));
 }
 
+/**
+ * Orders the output pairs by how they rank for outputLimit, by the larger value if outputValueLess
+ * is set and then by the smaller key
+ * @param lhs OUT_ITEM object
+ * @param rhs OUT_ITEM object
+ * @return true if lhs ranks before rhs, otherwise false
+ */
+static bool OUT_ITEMS_BETTER(OUT_ITEM const& lhs, OUT_ITEM const& rhs)
+{
+	if (gOptions.outputValueLess != nullptr)
+	{
+		if (gOptions.outputValueLess(rhs.second, lhs.second))
+			return true;
+		if (gOptions.outputValueLess(lhs.second, rhs.second))
+			return false;
+	}
+	return (*(lhs.first) < *(rhs.first));
+}
+
+/**
+ * OUT_ITEMS_BETTER for the pairs of emit3Data, a heap ordered by it has the worst pair in front
+ * @param lhs EMIT3_PAIR object
+ * @param rhs EMIT3_PAIR object
+ * @return true if lhs ranks before rhs, otherwise false
+ */
+static bool EMIT3_PAIR_BETTER(EMIT3_PAIR const& lhs, EMIT3_PAIR const& rhs)
+{
+	return OUT_ITEMS_BETTER(*lhs, *rhs);
+}
+
+/**
+ * Sort pairs comperator
+ * @param rhs SORT_PAIR or NUMERIC_PAIR object
+ * @param lhs SORT_PAIR or NUMERIC_PAIR object
+ * @return true if rhs.first < lhs.first, otherwise false
+ */
+template <typename PAIR>
+static bool SORT_PAIR_COMP(PAIR const& rhs, PAIR const& lhs)
+{
+	return (*(rhs.first) < *(lhs.first));
+}
+
+/**
+ * @return the monotonic clock time in nanoseconds
+ */
+static uint64_t monotonicNow()
+{
+	struct timespec now;
+	int ret = clock_gettime(CLOCK_MONOTONIC, &now);
+	failure(ret, "clock_gettime");
+	return SEC_TO_NS((uint64_t)now.tv_sec) + now.tv_nsec;
+}
+
 /**
  * Calculates and retuns the difference of time in nanoseconds between 2 given timeval structs
  * @param start start time
@@ -636,41 +2394,117 @@ static void _sem_init(sem_t *sem, unsigned int value)
  * Wraps pthread_create for error handling
  * @param thread pointer to a pthread_t object
  * @param start_routine the thread start  execution by invoking start_routine
+ * @param arg the argument passed to start_routine
  */
-static void _pthread_create(pthread_t *thread, void *(*start_routine)(void *))
+static void _pthread_create(pthread_t *thread, void *(*start_routine)(void *), void *arg)
 {
-	int ret = pthread_create(thread, nullptr, start_routine, nullptr);
-	failure(ret, "pthread_create");
+	int ret;
+	if (!gOptions.keepThreads)
+	{
+		ret = pthread_create(thread, nullptr, start_routine, arg);
+		failure(ret, "pthread_create");
+		return;
+	}
+
+	// hand the task to an idle kept thread, a new one is only created when all of them are busy
+	_pthread_mutex_lock(&mut_pool);
+	PoolThread* worker = nullptr;
+	for (PoolThread* idle : poolThreads)
+	{
+		if (!idle->busy)
+		{
+			worker = idle;
+			break;
+		}
+	}
+	if (worker == nullptr)
+	{
+		worker = new PoolThread();
+		ret = pthread_cond_init(&worker->cv_task, nullptr);
+		failure(ret, "pthread_cond_init");
+		ret = pthread_create(&worker->thread, nullptr, &ExecPooled, worker);
+		failure(ret, "pthread_create");
+		poolThreads.push_back(worker);
+	}
+	worker->routine = start_routine;
+	worker->arg = arg;
+	worker->busy = true;
+	worker->done = false;
+	pthread_cond_signal(&worker->cv_task);
+	*thread = worker->thread;
+	_pthread_mutex_unlock(&mut_pool);
 }
 
 /**
- * Wraps pthread_join for error handling
- * @param thread thread to join with
+ * Creates a thread that emits to a new vector, the thread gets the vector as its argument and
+ * data keeps it by the thread's id
+ * @param thread set to the created thread
+ * @param start_routine ExecMap or ExecReduce
+ * @param data the vectors of the job's threads
  */
-static void _pthread_join(pthread_t thread)
+template <typename PAIR>
+static void createEmitThread(pthread_t &thread, void *(*start_routine)(void *),
+							 std::map<pthread_t, std::vector<PAIR>*> &data)
 {
-	int ret = pthread_join(thread, nullptr);
-	failure(ret, "pthread_join");
+	std::vector<PAIR>* pairs = new std::vector<PAIR>;
+	_pthread_create(&thread, start_routine, pairs);
+	data[thread] = pairs;
 }
 
 /**
- * Wraps pthread_mutex_destroy for error handling
- * @param mutex mutex to destroy
+ * Wraps pthread_join for error handling
+ * @param thread thread to join with
  */
-static void _pthread_mutex_destroy(pthread_mutex_t *mutex)
+static void _pthread_join(pthread_t thread)
 {
-	int ret = pthread_mutex_destroy(mutex);
-	failure(ret, "pthread_mutex_destroy");
+	int ret;
+	if (!gOptions.keepThreads)
+	{
+		ret = pthread_join(thread, nullptr);
+		failure(ret, "pthread_join");
+		return;
+	}
+
+	// a kept thread is joined once its task returned, it's then idle until the next _pthread_create
+	_pthread_mutex_lock(&mut_pool);
+	for (PoolThread* worker : poolThreads)
+	{
+		if (worker->busy && pthread_equal(worker->thread, thread))
+		{
+			while (!worker->done)
+				_pthread_cond_wait(&cv_pool, &mut_pool);
+			worker->busy = false;
+			break;
+		}
+	}
+	_pthread_mutex_unlock(&mut_pool);
 }
 
 /**
- * Wraps pthread_cond_destroy for error handling
- * @param cond condition object to destroy
+ * Runs the tasks _pthread_create hands to a kept thread, the thread is never terminated. A task
+ * is keyed by the kept thread's id, which _pthread_create returns like pthread_create does.
+ * @param p pointer to the thread's PoolThread
+ * @return never returns
  */
-static void _pthread_cond_destroy(pthread_cond_t *cond)
+static void* ExecPooled(void* p)
 {
-	int ret = pthread_cond_destroy(cond);
-	failure(ret, "pthread_cond_destroy");
+	PoolThread* worker = (PoolThread*)p;
+	_pthread_mutex_lock(&mut_pool);
+	while (true)
+	{
+		while (worker->routine == nullptr)
+			_pthread_cond_wait(&worker->cv_task, &mut_pool);
+		void *(*routine)(void *) = worker->routine;
+		void* arg = worker->arg;
+		_pthread_mutex_unlock(&mut_pool);
+
+		routine(arg);
+
+		_pthread_mutex_lock(&mut_pool);
+		worker->routine = nullptr;
+		worker->done = true;
+		pthread_cond_broadcast(&cv_pool);
+	}
 }
 
 /**
@@ -715,24 +2549,21 @@ static void _pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
 }
 
 /**
- * Wraps sem_getvalue for error handling
- * @param sem semaphore object
- * @param sval pointer to an integer
- */
-static void _sem_getvalue(sem_t *sem, int *sval)
-{
-	int ret = sem_getvalue(sem, sval);
-	failure(ret, "sem_getvalue");
-}
-
-/**
- * Wraps pthread_cancel for error handling
- * @param thread thread to cancel
+ * Wraps pthread_cond_timedwait for error handling, a timeout isn't a failure
+ * @param cond pthread condition object
+ * @param mutex mutex object
+ * @param ns the longest time to wait in nanoseconds
  */
-static void _pthread_cancel(pthread_t thread)
+static void _pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex, uint64_t ns)
 {
-	int ret = pthread_cancel(thread);
-	failure(ret, "pthread_cancel");
+	struct timespec deadline;
+	failure(clock_gettime(CLOCK_REALTIME, &deadline), "clock_gettime");
+	ns += deadline.tv_nsec;
+	deadline.tv_sec += ns / SEC_TO_NS(1);
+	deadline.tv_nsec = ns % SEC_TO_NS(1);
+
+	int ret = pthread_cond_timedwait(cond, mutex, &deadline);
+	failure(ret != 0 && ret != ETIMEDOUT, "pthread_cond_timedwait");
 }
 
 /**
@@ -750,9 +2581,12 @@ static void freeEmit2Data(bool autoDeleteV2K2)
 				delete pair->first;
 				delete pair->second;
 			}
+			delete pair;
 		}
 		delete elem.second;
 	}
+	emit2Data.clear();
+	shuffleData.clear();
 
 }
 
@@ -767,4 +2601,38 @@ static void freeEmit3Data()
 
 		delete elem.second;
 	}
+	emit3Data.clear();
+}
+
+/**
+ * Free data allocated for the SHUFFLE_SORT mode, the k2 and v2 objects were released by the
+ * ExecReduce threads
+ */
+static void freeSortData()
+{
+	sortedPairs.clear();
+	sortedValues.clear();
+	sortedNumericPairs.clear();
+	sortedNumbers.clear();
+	reduceGroups.clear();
+}
+
+/**
+ * Free the partial values vectors, the values were released by the ExecReduce threads
+ */
+static void freePartialValues()
+{
+	partialValues.clear();
+	combineTasks.clear();
+}
+
+/**
+ * Free the claim order of the input items
+ */
+static void freeMapOrder()
+{
+	std::vector<size_t>().swap(mapOrder);
+	std::vector<uint64_t>().swap(mapCosts);
+	std::vector<uint64_t>().swap(mapTimes);
+	std::vector<uint64_t>().swap(gOptions.itemCosts);
 }
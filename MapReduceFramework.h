@@ -3,6 +3,7 @@
 
 #include "MapReduceClient.h"
 #include <utility>
+#include <string>
 
 typedef std::pair<k1Base*, v1Base*> IN_ITEM;
 typedef std::pair<k3Base*, v3Base*> OUT_ITEM;
@@ -10,10 +11,180 @@ typedef std::pair<k3Base*, v3Base*> OUT_ITEM;
 typedef std::vector<IN_ITEM> IN_ITEMS_VEC; 
 typedef std::vector<OUT_ITEM> OUT_ITEMS_VEC;
 
+/**
+ * How the intermediate pairs are grouped by key
+ * SHUFFLE_MAP - a Shuffle thread inserts the pairs into a map while the map threads run
+ * SHUFFLE_SORT - the map threads append the pairs to flat arrays that are sorted in parallel after
+ *                the map phase, each key group is a contiguous run handed to ReduceRange
+ */
+enum ShuffleMode { SHUFFLE_MAP, SHUFFLE_SORT };
+
+/**
+ * Optional job settings, the defaults behave like the four argument RunMapReduceFramework
+ */
+struct MapReduceOptions
+{
+	ShuffleMode shuffleMode;
+
+	/**
+	 * Keys with more values than this are split into ranges of this size that are combined in
+	 * parallel before Reduce, if the reducer IsAssociative. 0 disables splitting. Numeric jobs
+	 * ignore it.
+	 */
+	size_t skewThreshold;
+
+	/**
+	 * If not empty, thread activity is written to this path as Chrome trace events
+	 */
+	std::string traceFile;
+
+	/**
+	 * If true, cycles, instructions, LLC misses and branch misses are counted per phase with
+	 * perf_event_open and written to the log. Phases without permitted counters are skipped.
+	 */
+	bool perfCounters;
+
+	/**
+	 * If true and the job is an AsyncMapReduceBase, every map thread keeps up to asyncDepth
+	 * requests in flight on an io_uring ring, with directories listed by a shared thread pool of up
+	 * to asyncDepth threads per map thread, or on the pool alone where io_uring is unavailable, and
+	 * calls MapComplete as they finish
+	 */
+	bool asyncMap;
+	unsigned asyncDepth;
+
+	/**
+	 * If true the asynchronous map performs every request on the thread pool, also where io_uring
+	 * is available
+	 */
+	bool asyncPool;
+
+	/**
+	 * If not empty, the intermediate pairs of every completed map chunk are written to this
+	 * directory with SerializeK2V2. A job that dies can be run again over the same input items and
+	 * loads the completed chunks instead of mapping them. The job's chunk files are removed when it
+	 * completes, other files in the directory are kept. Jobs that don't implement SerializeK2V2 and
+	 * numeric jobs aren't checkpointed.
+	 * Resumed pairs are created by DeserializeK2V2, so they are deleted by the framework only with
+	 * autoDeleteV2K2.
+	 */
+	std::string checkpointDir;
+
+	/**
+	 * Identifies the job's input items and parameters, chunk files written with another fingerprint
+	 * or by another job class are ignored. Clients hash whatever the items' k2/v2 pairs depend on.
+	 */
+	uint64_t checkpointFingerprint;
+
+	/**
+	 * If true every chunk file is synced to the disk before it's renamed, so the completed chunks
+	 * also survive a machine crash. Otherwise a chunk the machine lost fails its checksum and is
+	 * mapped again.
+	 */
+	bool checkpointSync;
+
+	/**
+	 * If true, the framework's threads wait for the next job that sets keepThreads when this one
+	 * ends instead of terminating, so a process that runs many jobs creates its threads once
+	 */
+	bool keepThreads;
+
+	/**
+	 * If not 0, only outputLimit output pairs are returned: the ones with the smallest keys, or if
+	 * outputValueLess is set the ones with the largest values, ties broken by the smaller key. The
+	 * output is still sorted by key. Every reduce thread keeps its best outputLimit pairs in a heap
+	 * and the framework deletes the pairs that don't make it. Whole keys are skipped if the job
+	 * IsOrderPreserving, or with outputValueLess if CanReachTop returns false.
+	 */
+	size_t outputLimit;
+	bool (*outputValueLess)(const v3Base *lhs, const v3Base *rhs);
+
+	/**
+	 * If true and the job IsIdempotent, a map thread that finds no chunk left to claim runs a chunk
+	 * again once it has been running speculativeFactor times longer than the median chunk. Every copy
+	 * buffers its Emit2 pairs and only the first copy to finish emits them, the other copy stops at
+	 * its next item and deletes its pairs if autoDeleteV2K2. The job still waits for a Map call in
+	 * progress to return, so only chunks that are slow for a while finish sooner, an item that never
+	 * returns holds the job up. Not used with asyncMap.
+	 */
+	bool speculativeMap;
+	unsigned speculativeFactor;
+
+	/**
+	 * If not empty, the estimated cost of every input item in the order of the items vector. The
+	 * items are mapped most expensive first, and a chunk holds items until their costs reach a
+	 * fraction of the total, so expensive items are claimed alone. Ignored when checkpointing, since
+	 * checkpointed chunks are identified by their item ranges.
+	 */
+	std::vector<uint64_t> itemCosts;
+
+	/**
+	 * If not nullptr, set to the map time of every input item in nanoseconds, in the order of the
+	 * items vector, to be given as itemCosts to later runs. An asynchronous map item's time is its
+	 * MapRequest, its request and its MapComplete, the time the request was queued isn't counted.
+	 * Items loaded from a checkpoint keep their itemCosts estimate, or 0.
+	 */
+	std::vector<uint64_t>* itemTimes;
+
+	/**
+	 * If true, Map calls Emit3 directly and its pairs are the output. No Shuffle thread, semaphores,
+	 * key groups or ExecReduce threads are set up, Emit2 fails and Reduce is never called. Map only
+	 * jobs aren't checkpointed.
+	 */
+	bool mapOnly;
+
+	/**
+	 * If false, the output pairs are returned in no particular order instead of sorted by key
+	 */
+	bool sortOutput;
+
+	/**
+	 * Bytes the intermediate pairs queued for the Shuffle thread may take, 0 for no budget. With a
+	 * budget the map threads hand their pairs to the shuffle in batches instead of one at a time and
+	 * block while the queued pairs exceed it. Pairs are measured by MapReduceBase::K2V2Bytes. This
+	 * bounds the queue only, the pairs the shuffle took are held until the reduce whatever the
+	 * budget. SHUFFLE_MAP only, SHUFFLE_SORT and map only jobs have no queue and ignore it.
+	 */
+	size_t shuffleQueueBudget;
+
+	MapReduceOptions() : shuffleMode(SHUFFLE_MAP), skewThreshold(0), perfCounters(false), asyncMap(false),
+						 asyncDepth(32), asyncPool(false), checkpointFingerprint(0), checkpointSync(false),
+						 keepThreads(false), outputLimit(0), outputValueLess(nullptr),
+						 speculativeMap(false), speculativeFactor(4), itemTimes(nullptr), mapOnly(false),
+						 sortOutput(true), shuffleQueueBudget(0) {}
+};
+
+/**
+ * Intermediate pair bytes of the running job, measured by MapReduceBase::K2V2Bytes
+ */
+struct MapReduceMemory
+{
+	size_t intermediateBytes;	// pairs emitted by the map threads so far with a shuffleQueueBudget,
+								// 0 after the job
+	size_t pendingBytes;		// pairs waiting for the Shuffle thread, with a shuffleQueueBudget
+	size_t peakPendingBytes;	// most pendingBytes of the job
+	size_t nBudgetWaits;		// number of times a map thread blocked on the shuffleQueueBudget
+};
+
+/**
+ * Runs the job. If autoDeleteV2K2 is true the framework deletes the k2 and v2 objects, duplicate
+ * keys as soon as the shuffle merges them and every key group as soon as its Reduce call returns.
+ */
 OUT_ITEMS_VEC RunMapReduceFramework(MapReduceBase& mapReduce, IN_ITEMS_VEC& itemsVec, 
 									int multiThreadLevel, bool autoDeleteV2K2);
 
+OUT_ITEMS_VEC RunMapReduceFramework(MapReduceBase& mapReduce, IN_ITEMS_VEC& itemsVec,
+									int multiThreadLevel, bool autoDeleteV2K2,
+									const MapReduceOptions& options);
+
 void Emit2 (k2Base*, v2Base*);
+void Emit2Numeric (k2Base*, int64_t);
 void Emit3 (k3Base*, v3Base*);
 
+/**
+ * Safe to call from any thread while a job runs, the map threads add their counts in batches so the
+ * intermediate bytes lag behind by a few KB per thread
+ */
+MapReduceMemory MapReduceMemoryUsage();
+
 #endif //MAPREDUCEFRAMEWORK_H
@@ -0,0 +1,120 @@
+#include <cstring>
+#include "MapReduceNumeric.h"
+
+//--------------------------------------- Definitions ----------------------------------------------
+#if defined(__GNUC__)
+/**
+ * Values per vector, a 32 byte vector is a single AVX2 register or two SSE2 registers
+ */
+#define LANES 4
+
+/**
+ * Vector of values, sums use the unsigned type so overflow wraps instead of being undefined
+ */
+typedef int64_t NUMERIC_VECTOR __attribute__((vector_size(LANES * sizeof(int64_t))));
+typedef uint64_t UNSIGNED_VECTOR __attribute__((vector_size(LANES * sizeof(uint64_t))));
+#endif
+
+//---------------------------------------------------------------------------------------------------
+
+#if defined(__GNUC__)
+/**
+ * @param first the first value
+ * @param last after the last value
+ * @return the wrapping sum of the values
+ */
+static int64_t sum(const int64_t *first, const int64_t *last)
+{
+	// the values may not be aligned to the vector size, memcpy compiles to an unaligned load
+	UNSIGNED_VECTOR acc = {0, 0, 0, 0};
+	UNSIGNED_VECTOR values;
+	for (; last - first >= LANES; first += LANES)
+	{
+		memcpy(&values, first, sizeof(values));
+		acc += values;
+	}
+
+	uint64_t result = acc[0] + acc[1] + acc[2] + acc[3];
+	for (; first != last; ++first)
+		result += (uint64_t)*first;
+	return (int64_t)result;
+}
+
+/**
+ * @param first the first value
+ * @param last after the last value, the run isn't empty
+ * @return the minimum or maximum of the values, the maximum if MAX
+ */
+template <bool MAX>
+static int64_t extreme(const int64_t *first, const int64_t *last)
+{
+	int64_t result = *first;
+	if (last - first >= LANES)
+	{
+		NUMERIC_VECTOR acc;
+		NUMERIC_VECTOR values;
+		memcpy(&acc, first, sizeof(acc));
+		for (first += LANES; last - first >= LANES; first += LANES)
+		{
+			// lanes where the new value wins are all ones, select without a branch
+			memcpy(&values, first, sizeof(values));
+			NUMERIC_VECTOR wins = MAX ? (values > acc) : (values < acc);
+			acc = (values & wins) | (acc & ~wins);
+		}
+		result = acc[0];
+		for (int lane = 1; lane < LANES; ++lane)
+			if (MAX ? acc[lane] > result : acc[lane] < result)
+				result = acc[lane];
+	}
+
+	for (; first != last; ++first)
+		if (MAX ? *first > result : *first < result)
+			result = *first;
+	return result;
+}
+#else
+/**
+ * @param first the first value
+ * @param last after the last value
+ * @return the wrapping sum of the values
+ */
+static int64_t sum(const int64_t *first, const int64_t *last)
+{
+	uint64_t result = 0;
+	for (; first != last; ++first)
+		result += (uint64_t)*first;
+	return (int64_t)result;
+}
+
+/**
+ * @param first the first value
+ * @param last after the last value, the run isn't empty
+ * @return the minimum or maximum of the values, the maximum if MAX
+ */
+template <bool MAX>
+static int64_t extreme(const int64_t *first, const int64_t *last)
+{
+	int64_t result = *first;
+	for (; first != last; ++first)
+		if (MAX ? *first > result : *first < result)
+			result = *first;
+	return result;
+}
+#endif
+
+int64_t numericReduce(NumericReduceOp op, const int64_t *first, const int64_t *last)
+{
+	switch (op)
+	{
+		case NUMERIC_SUM:
+			return sum(first, last);
+		case NUMERIC_MIN:
+			return (first == last) ? 0 : extreme<false>(first, last);
+		case NUMERIC_MAX:
+			return (first == last) ? 0 : extreme<true>(first, last);
+		case NUMERIC_COUNT:
+			return last - first;
+		default:
+			return 0;
+	}
+}
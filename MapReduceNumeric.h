@@ -0,0 +1,18 @@
+#ifndef MAPREDUCENUMERIC_H
+#define MAPREDUCENUMERIC_H
+
+#include <cstddef>
+#include <stdint.h>
+#include "MapReduceClient.h"
+
+/**
+ * Reduces a contiguous run of numeric values. The runs are scanned in blocks of vector lanes with
+ * GCC vector extensions, or one value at a time by compilers without them.
+ * @param op the reduction, NUMERIC_COUNT returns the number of values
+ * @param first the first value
+ * @param last after the last value
+ * @return the result, 0 for an empty run of NUMERIC_MIN or NUMERIC_MAX values
+ */
+int64_t numericReduce(NumericReduceOp op, const int64_t *first, const int64_t *last);
+
+#endif //MAPREDUCENUMERIC_H
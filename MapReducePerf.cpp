@@ -0,0 +1,210 @@
+#include <pthread.h>
+#include <unistd.h>
+#include <cstring>
+#include <cerrno>
+#include <sstream>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "MapReducePerf.h"
+
+//--------------------------------------- Definitions ----------------------------------------------
+/**
+ * Number of counters opened for every thread
+ */
+#define N_COUNTERS 4
+
+/**
+ * Marks a counter that couldn't be opened
+ */
+#define NO_FD (-1)
+
+//-------------------------------------- Data structures --------------------------------------------------
+/**
+ * The counters, in report order
+ */
+static const unsigned long long counterConfigs[N_COUNTERS] = {
+	PERF_COUNT_HW_CPU_CYCLES,
+	PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_CACHE_MISSES,
+	PERF_COUNT_HW_BRANCH_MISSES
+};
+
+static const char* const counterNames[N_COUNTERS] = {"cycles", "instructions", "LLC misses", "branch misses"};
+
+static const char* const phaseNames[N_PERF_PHASES] = {"Map", "Shuffle", "Reduce"};
+
+/**
+ * The counters of a single thread
+ */
+struct PerfThread
+{
+	PerfPhase phase;
+	int fds[N_COUNTERS];
+};
+
+/**
+ * Counters opened since the last collection
+ */
+static std::vector<PerfThread> threads;
+
+/**
+ * Used to lock threads
+ */
+static pthread_mutex_t mut_threads = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * True while a job with counters runs
+ */
+static bool enabled = false;
+
+/**
+ * The errno of the first counter that failed to open, 0 if none failed
+ */
+static int openError = 0;
+
+/**
+ * Phase totals, and whether any thread of the phase had the counter
+ */
+static unsigned long long totals[N_PERF_PHASES][N_COUNTERS];
+static bool counted[N_PERF_PHASES][N_COUNTERS];
+
+//---------------------------------------------------------------------------------------------------
+
+/**
+ * Opens a user space counter for the calling thread on any cpu
+ * @param config PERF_COUNT_HW_* counter
+ * @return the counter file descriptor or NO_FD
+ */
+static int openCounter(unsigned long long config)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config;
+	attr.exclude_kernel = 1;	// allowed with the default perf_event_paranoid setting
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	int fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	if (fd == -1)
+	{
+		pthread_mutex_lock(&mut_threads);
+		if (openError == 0)
+			openError = errno;
+		pthread_mutex_unlock(&mut_threads);
+		return NO_FD;
+	}
+	return fd;
+}
+
+/**
+ * Reads a counter, scaled up if the kernel multiplexed it with other counters
+ * @param fd counter file descriptor
+ * @param value the counter value
+ * @return true if successful, otherwise false
+ */
+static bool readCounter(int fd, unsigned long long &value)
+{
+	// value, time enabled, time running
+	unsigned long long data[3];
+	if (read(fd, data, sizeof(data)) != (ssize_t)sizeof(data))
+		return false;
+
+	value = data[0];
+	if (data[2] != 0 && data[2] < data[1])
+		value = (unsigned long long)((double)data[0] * data[1] / data[2]);
+	return true;
+}
+
+void perfStart()
+{
+	memset(totals, 0, sizeof(totals));
+	memset(counted, 0, sizeof(counted));
+	openError = 0;
+	enabled = true;
+}
+
+void perfThreadBegin(PerfPhase phase)
+{
+	if (!enabled)
+		return;
+
+	PerfThread thread;
+	thread.phase = phase;
+	for (int c = 0; c < N_COUNTERS; ++c)
+		thread.fds[c] = openCounter(counterConfigs[c]);
+
+	pthread_mutex_lock(&mut_threads);
+	threads.push_back(thread);
+	pthread_mutex_unlock(&mut_threads);
+}
+
+void perfCollect(PerfPhase phase)
+{
+	if (!enabled)
+		return;
+
+	pthread_mutex_lock(&mut_threads);
+	std::vector<PerfThread> remaining;
+	for (PerfThread &thread : threads)
+	{
+		if (thread.phase != phase)
+		{
+			remaining.push_back(thread);
+			continue;
+		}
+
+		for (int c = 0; c < N_COUNTERS; ++c)
+		{
+			unsigned long long value;
+			if (thread.fds[c] == NO_FD)
+				continue;
+			if (readCounter(thread.fds[c], value))
+			{
+				totals[phase][c] += value;
+				counted[phase][c] = true;
+			}
+			close(thread.fds[c]);
+		}
+	}
+	threads.swap(remaining);
+	pthread_mutex_unlock(&mut_threads);
+}
+
+std::vector<std::string> perfReport()
+{
+	std::vector<std::string> lines;
+	if (!enabled)
+		return lines;
+
+	// close the counters of phases that were never collected
+	for (int phase = 0; phase < N_PERF_PHASES; ++phase)
+		perfCollect((PerfPhase)phase);
+	enabled = false;
+
+	if (openError != 0)
+		lines.push_back(std::string("Some perf counters are unavailable: ") + strerror(openError));
+
+	for (int phase = 0; phase < N_PERF_PHASES; ++phase)
+	{
+		std::stringstream line;
+		line << phaseNames[phase] << " counters:";
+
+		bool any = false;
+		for (int c = 0; c < N_COUNTERS; ++c)
+		{
+			if (!counted[phase][c])
+				continue;
+			line << " " << counterNames[c] << "=" << totals[phase][c];
+			any = true;
+		}
+		if (!any)
+			continue;
+
+		if (counted[phase][0] && counted[phase][1] && totals[phase][0] != 0)
+			line << " IPC=" << (double)totals[phase][1] / totals[phase][0];
+		lines.push_back(line.str());
+	}
+	return lines;
+}
@@ -0,0 +1,39 @@
+#ifndef MAPREDUCEPERF_H
+#define MAPREDUCEPERF_H
+
+#include <string>
+#include <vector>
+
+/**
+ * The job phases the hardware counters are reported for
+ */
+enum PerfPhase { PERF_MAP, PERF_SHUFFLE, PERF_REDUCE, N_PERF_PHASES };
+
+/**
+ * Enables the counters for the current job and resets the phase totals
+ */
+void perfStart();
+
+/**
+ * Opens cycles, instructions, LLC misses and branch misses counters for the calling thread and
+ * charges them to the given phase. Does nothing if the counters are disabled or not permitted.
+ * @param phase the phase the thread belongs to
+ */
+void perfThreadBegin(PerfPhase phase);
+
+/**
+ * Reads and closes the counters of every thread of the given phase and adds them to the phase
+ * totals. Counters of threads that already terminated keep their final values, so this is
+ * called by the main thread after it joined the phase threads.
+ * @param phase the phase to collect
+ */
+void perfCollect(PerfPhase phase);
+
+/**
+ * Returns a line per phase with its totals, or a line explaining why there are no counters.
+ * Disables the counters.
+ * @return the report lines
+ */
+std::vector<std::string> perfReport();
+
+#endif //MAPREDUCEPERF_H
@@ -0,0 +1,1625 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "MapReduceFramework.h"
+#include "TrigramIndex.h"
+#include "AhoCorasick.h"
+#include "InternedString.h"
+#include "MapReducePerf.h"
+#include "MapReduceAsync.h"
+#include "SearchServer.h"
+
+//--------------------------------------- Definitions ----------------------------------------------
+/**
+ * Template of the temporary directories the tests write their files to
+ */
+#define TEMP_DIR_TEMPLATE "/tmp/MapReduceTest.XXXXXX"
+
+/**
+ * Number of input items of the test jobs
+ */
+#define N_ITEMS 400
+
+/**
+ * Number of pairs an input item emits
+ */
+#define PAIRS_PER_ITEM 30
+
+/**
+ * Number of distinct intermediate keys, small so every key has many values
+ */
+#define N_KEYS 37
+
+/**
+ * Number of threads the test jobs run with
+ */
+#define N_THREADS 4
+
+/**
+ * Byte offsets in an index file header of the magic, the file table offset, the names offset and
+ * the names size, and the header size where the file table starts
+ */
+#define INDEX_MAGIC_AT 0
+#define INDEX_FILES_AT 16
+#define INDEX_NAMES_AT 40
+#define INDEX_NAMES_SIZE_AT 48
+#define INDEX_HEADER_SIZE 56
+
+/**
+ * Seconds after the last change of a directory before DirectoryCache caches its listing
+ */
+#define CACHE_TRUST_SECONDS 2
+
+/**
+ * Number of files the asynchronous engine test reads
+ */
+#define N_ASYNC_REQUESTS 64
+
+/**
+ * The framework log, appended to by every job
+ */
+#define LOG_FILE ".MapReduceFramework.log"
+
+/**
+ * Microseconds the first Map call of a SlowJob's slow item takes
+ */
+#define SLOW_MAP_US 300000
+
+/**
+ * Microseconds every Map call of an OrderJob's slow items takes
+ */
+#define SLOW_ITEM_US 20000
+
+//-------------------------------------- Data structures --------------------------------------------------
+
+struct IntKey1 : public k1Base
+{
+	int key;
+	explicit IntKey1(int key) : key(key) {}
+	virtual bool operator<(const k1Base &other) const { return key < ((IntKey1*)(&other))->key; }
+};
+
+struct IntKey2 : public k2Base
+{
+	int key;
+	explicit IntKey2(int key) : key(key) {}
+	virtual bool operator<(const k2Base &other) const { return key < ((IntKey2*)(&other))->key; }
+};
+
+struct IntValue2 : public v2Base
+{
+	long value;
+	explicit IntValue2(long value) : value(value) {}
+};
+
+struct IntKey3 : public k3Base
+{
+	int key;
+	explicit IntKey3(int key) : key(key) {}
+	virtual bool operator<(const k3Base &other) const { return key < ((IntKey3*)(&other))->key; }
+};
+
+struct IntValue3 : public v3Base
+{
+	long value;
+	explicit IntValue3(long value) : value(value) {}
+};
+
+/**
+ * @brief Sums the item numbers emitted for every key.
+ * Item i emits i for the keys (i * 7 + r) % N_KEYS, r < PAIRS_PER_ITEM.
+ */
+class SumJob : public MapReduceBase
+{
+public:
+	virtual void Map(const k1Base *const key, const v1Base *const val) const
+	{
+		(void)val;
+		int item = ((IntKey1*)key)->key;
+		for (int r = 0; r < PAIRS_PER_ITEM; ++r)
+			Emit2(new IntKey2((item * 7 + r) % N_KEYS), new IntValue2(item));
+	}
+
+	virtual void Reduce(const k2Base *const key, const V2_VEC &vals) const
+	{
+		long sum = 0;
+		for (v2Base *val : vals)
+			sum += ((IntValue2*)val)->value;
+		Emit3(new IntKey3(((IntKey2*)key)->key), new IntValue3(sum));
+	}
+
+	virtual bool IsAssociative() const { return true; }
+
+	virtual v2Base *Combine(const k2Base *const key, const V2_RANGE &vals) const
+	{
+		(void)key;
+		long sum = 0;
+		for (v2Base *val : vals)
+			sum += ((IntValue2*)val)->value;
+		return new IntValue2(sum);
+	}
+};
+
+/**
+ * @brief SumJob whose keys are interned strings, key k is "key-" and k in two digits so the
+ * strings sort like the numbers
+ */
+class StringJob : public SumJob
+{
+public:
+	virtual void Map(const k1Base *const key, const v1Base *const val) const
+	{
+		(void)val;
+		int item = ((IntKey1*)key)->key;
+		char name[16];
+		for (int r = 0; r < PAIRS_PER_ITEM; ++r)
+		{
+			snprintf(name, sizeof(name), "key-%02d", (item * 7 + r) % N_KEYS);
+			Emit2(new StringKey2(std::string(name)), new IntValue2(item));
+		}
+	}
+
+	virtual void Reduce(const k2Base *const key, const V2_VEC &vals) const
+	{
+		long sum = 0;
+		for (v2Base *val : vals)
+			sum += ((IntValue2*)val)->value;
+		int k = atoi(((StringKey2*)key)->key.c_str() + 4);
+		Emit3(new IntKey3(k), new IntValue3(sum));
+	}
+};
+
+/**
+ * @brief SumJob whose Combine gives up on the ranges of even keys that start with an odd value,
+ * those keys must be reduced from their original values
+ */
+class NullCombineJob : public SumJob
+{
+public:
+	virtual v2Base *Combine(const k2Base *const key, const V2_RANGE &vals) const
+	{
+		if (((IntKey2*)key)->key % 2 == 0 && ((IntValue2*)*vals.begin())->value % 2 == 1)
+			return nullptr;
+		return SumJob::Combine(key, vals);
+	}
+};
+
+/**
+ * Number of CountedKey2 and CountedValue2 objects that weren't deleted
+ */
+static std::atomic<int> nLiveKeys(0);
+static std::atomic<int> nLiveValues(0);
+
+/**
+ * Most CountedKey2 objects alive during a Reduce call
+ */
+static std::atomic<int> maxLiveKeys(0);
+
+struct CountedKey2 : public IntKey2
+{
+	explicit CountedKey2(int key) : IntKey2(key) { nLiveKeys++; }
+	~CountedKey2() { nLiveKeys--; }
+};
+
+struct CountedValue2 : public IntValue2
+{
+	explicit CountedValue2(long value) : IntValue2(value) { nLiveValues++; }
+	~CountedValue2() { nLiveValues--; }
+};
+
+/**
+ * @brief SumJob that counts its intermediate objects, Reduce records how many keys are alive
+ */
+class CountedJob : public SumJob
+{
+public:
+	virtual void Map(const k1Base *const key, const v1Base *const val) const
+	{
+		(void)val;
+		int item = ((IntKey1*)key)->key;
+		for (int r = 0; r < PAIRS_PER_ITEM; ++r)
+			Emit2(new CountedKey2((item * 7 + r) % N_KEYS), new CountedValue2(item));
+	}
+
+	virtual void Reduce(const k2Base *const key, const V2_VEC &vals) const
+	{
+		int live = nLiveKeys;
+		int max = maxLiveKeys;
+		while (live > max && !maxLiveKeys.compare_exchange_weak(max, live));
+		SumJob::Reduce(key, vals);
+	}
+};
+
+/**
+ * @brief SumJob whose items are read from files, item i reads the file item-i of dir which
+ * holds i. Completions with an error are counted and emit nothing.
+ */
+class AsyncSumJob : public AsyncMapReduceBase
+{
+public:
+	AsyncSumJob() : nErrors(0) {}
+
+	virtual AsyncRequest MapRequest(const k1Base *const key, const v1Base *const val) const
+	{
+		(void)val;
+		return AsyncRequest(ASYNC_READ_FILE, dir + "/item-" + std::to_string(((IntKey1*)key)->key));
+	}
+
+	virtual void MapComplete(const k1Base *const key, const v1Base *const val, const AsyncResult &result) const
+	{
+		(void)key;
+		(void)val;
+		if (result.error != 0)
+		{
+			nErrors++;
+			return;
+		}
+		int item = atoi(result.data.c_str());
+		for (int r = 0; r < PAIRS_PER_ITEM; ++r)
+			Emit2(new IntKey2((item * 7 + r) % N_KEYS), new IntValue2(item));
+	}
+
+	virtual void Reduce(const k2Base *const key, const V2_VEC &vals) const
+	{
+		job.Reduce(key, vals);
+	}
+
+	std::string dir;
+	SumJob job;
+	mutable std::atomic<int> nErrors;
+};
+
+/**
+ * @brief SumJob whose values are summed by the framework
+ */
+class NumericJob : public SumJob
+{
+public:
+	virtual void Map(const k1Base *const key, const v1Base *const val) const
+	{
+		(void)val;
+		int item = ((IntKey1*)key)->key;
+		for (int r = 0; r < PAIRS_PER_ITEM; ++r)
+			Emit2Numeric(new IntKey2((item * 7 + r) % N_KEYS), item);
+	}
+
+	virtual NumericReduceOp NumericOp() const { return NUMERIC_SUM; }
+
+	virtual void ReduceNumeric(const k2Base *const key, int64_t result, size_t count) const
+	{
+		(void)count;
+		Emit3(new IntKey3(((IntKey2*)key)->key), new IntValue3(result));
+	}
+};
+
+/**
+ * @brief SumJob that lets the framework skip keys when only part of the output is kept
+ */
+class TopJob : public SumJob
+{
+public:
+	virtual bool IsOrderPreserving() const { return true; }
+
+	virtual bool CanReachTop(const k2Base *const key, size_t nValues, const v3Base *const threshold) const
+	{
+		(void)key;
+		return (long)nValues * (N_ITEMS - 1) >= ((IntValue3*)threshold)->value;
+	}
+};
+
+/**
+ * @param lhs an IntValue3
+ * @param rhs an IntValue3
+ * @return true if lhs is less than rhs
+ */
+static bool intValue3Less(const v3Base *lhs, const v3Base *rhs)
+{
+	return ((IntValue3*)lhs)->value < ((IntValue3*)rhs)->value;
+}
+
+/**
+ * Number of Map calls of the checkpoint and slow jobs
+ */
+static std::atomic<int> nMapCalls(0);
+
+/**
+ * @brief SumJob that can resume from a checkpoint.
+ * exitAfter ends the process after that many Map calls, as if it crashed. serializeLimit makes
+ * SerializeK2V2 fail after that many pairs, which disables checkpointing during the job.
+ */
+class CheckpointJob : public SumJob
+{
+public:
+	CheckpointJob() : exitAfter(-1), serializeLimit(-1), nSerialized(0) {}
+
+	virtual void Map(const k1Base *const key, const v1Base *const val) const
+	{
+		if (++nMapCalls == exitAfter)
+			_exit(0);
+		SumJob::Map(key, val);
+	}
+
+	virtual bool SerializeK2V2(const k2Base *const key, const v2Base *const val, std::string &out) const
+	{
+		if (serializeLimit >= 0 && nSerialized++ >= serializeLimit)
+			return false;
+		out.append((const char*)&((IntKey2*)key)->key, sizeof(int));
+		out.append((const char*)&((IntValue2*)val)->value, sizeof(long));
+		return true;
+	}
+
+	virtual bool DeserializeK2V2(const char *data, size_t size, k2Base *&key, v2Base *&val) const
+	{
+		if (size != sizeof(int) + sizeof(long))
+			return false;
+		int k;
+		long v;
+		memcpy(&k, data, sizeof(int));
+		memcpy(&v, data + sizeof(int), sizeof(long));
+		key = new IntKey2(k);
+		val = new IntValue2(v);
+		return true;
+	}
+
+	int exitAfter;
+	int serializeLimit;
+	mutable std::atomic<int> nSerialized;
+};
+
+/**
+ * @brief SumJob whose first Map call of one item is slow, so speculation runs its chunk again.
+ * Later calls of the item are fast, like a folder that was slow to read once.
+ */
+class SlowJob : public SumJob
+{
+public:
+	SlowJob() : slowItem(N_ITEMS / 2), slowed(false) {}
+
+	virtual void Map(const k1Base *const key, const v1Base *const val) const
+	{
+		nMapCalls++;
+		if (((IntKey1*)key)->key == slowItem && !slowed.exchange(true))
+			usleep(SLOW_MAP_US);
+		SumJob::Map(key, val);
+	}
+
+	virtual bool IsIdempotent() const { return true; }
+
+	int slowItem;
+	mutable std::atomic<bool> slowed;
+};
+
+/**
+ * @brief SumJob that records the order of its Map calls, run with a single map thread.
+ * The Map calls of the slow items take SLOW_ITEM_US.
+ */
+class OrderJob : public SumJob
+{
+public:
+	virtual void Map(const k1Base *const key, const v1Base *const val) const
+	{
+		int item = ((IntKey1*)key)->key;
+		order.push_back(item);
+		if (std::find(slowItems.begin(), slowItems.end(), item) != slowItems.end())
+			usleep(SLOW_ITEM_US);
+		SumJob::Map(key, val);
+	}
+
+	std::vector<int> slowItems;
+	mutable std::vector<int> order;
+};
+
+/**
+ * @brief SumJob that counts its K2V2Bytes calls
+ */
+class MeasuredJob : public SumJob
+{
+public:
+	MeasuredJob() : nMeasured(0) {}
+
+	virtual size_t K2V2Bytes(const k2Base *const key, const v2Base *const val) const
+	{
+		(void)key;
+		(void)val;
+		nMeasured++;
+		return 32;
+	}
+
+	mutable std::atomic<int> nMeasured;
+};
+
+/**
+ * @brief Map only job, item i emits (i, 2 * i) from Map. The first Map call of slowItem is slow
+ * when it's set, so speculation runs its chunk again.
+ */
+class MapOnlyJob : public MapReduceBase
+{
+public:
+	MapOnlyJob() : slowItem(-1), slowed(false) {}
+
+	virtual void Map(const k1Base *const key, const v1Base *const val) const
+	{
+		(void)val;
+		nMapCalls++;
+		int item = ((IntKey1*)key)->key;
+		if (item == slowItem && !slowed.exchange(true))
+			usleep(SLOW_MAP_US);
+		Emit3(new IntKey3(item), new IntValue3(2 * item));
+	}
+
+	virtual void Reduce(const k2Base *const key, const V2_VEC &vals) const
+	{
+		(void)key;
+		(void)vals;
+	}
+
+	virtual bool IsIdempotent() const { return true; }
+
+	int slowItem;
+	mutable std::atomic<bool> slowed;
+};
+
+//------------------------------------- Helpers ----------------------------------------------------
+
+/**
+ * Number of failed checks
+ */
+static int nFailures = 0;
+
+/**
+ * Prints a failed check
+ * @param ok the check result
+ * @param name the check name
+ */
+static void check(bool ok, const std::string &name)
+{
+	if (!ok)
+	{
+		std::cerr << "FAILED: " << name << std::endl;
+		nFailures++;
+	}
+}
+
+/**
+ * Creates an empty temporary directory, the test removes it
+ * @return the directory path
+ */
+static std::string makeTempDir()
+{
+	char dirTemplate[] = TEMP_DIR_TEMPLATE;
+	check(mkdtemp(dirTemplate) != nullptr, "temporary directory");
+	return std::string(dirTemplate);
+}
+
+/**
+ * Deletes the output pairs
+ * @param out the job output
+ */
+static void freeOutput(OUT_ITEMS_VEC &out)
+{
+	for (OUT_ITEM &item : out)
+	{
+		delete item.first;
+		delete item.second;
+	}
+	out.clear();
+}
+
+/**
+ * @param nItems number of items
+ * @return input items numbered from 0
+ */
+static IN_ITEMS_VEC makeItems(int nItems = N_ITEMS)
+{
+	IN_ITEMS_VEC items;
+	for (int i = 0; i < nItems; ++i)
+		items.push_back(IN_ITEM(new IntKey1(i), nullptr));
+	return items;
+}
+
+/**
+ * Deletes the input items
+ * @param items the items
+ */
+static void freeItems(IN_ITEMS_VEC &items)
+{
+	for (IN_ITEM &item : items)
+		delete item.first;
+	items.clear();
+}
+
+/**
+ * @param nItems number of input items
+ * @return the SumJob output of every key
+ */
+static std::vector<long> expectedSums(int nItems)
+{
+	std::vector<long> sums(N_KEYS, 0);
+	for (int i = 0; i < nItems; ++i)
+		for (int r = 0; r < PAIRS_PER_ITEM; ++r)
+			sums[(i * 7 + r) % N_KEYS] += i;
+	return sums;
+}
+
+/**
+ * Checks a SumJob output and deletes it
+ * @param out the job output
+ * @param name the check name
+ * @param nItems number of input items, at least 6 so every key has a value
+ */
+static void checkSums(OUT_ITEMS_VEC &out, const std::string &name, int nItems = N_ITEMS)
+{
+	std::vector<long> sums = expectedSums(nItems);
+	bool ok = out.size() == N_KEYS;
+	for (size_t j = 0; ok && j < out.size(); ++j)
+	{
+		int key = ((IntKey3*)out[j].first)->key;
+		ok = key == (int)j && ((IntValue3*)out[j].second)->value == sums[key];
+	}
+	check(ok, name);
+	freeOutput(out);
+}
+
+/**
+ * Checks a MapOnlyJob output and deletes it
+ * @param out the job output
+ * @param name the check name
+ * @param limit the outputLimit, 0 for every item
+ * @param sorted true if the output must be sorted by key
+ */
+static void checkMapOnly(OUT_ITEMS_VEC &out, const std::string &name, size_t limit, bool sorted)
+{
+	size_t expected = (limit > 0) ? limit : N_ITEMS;
+	std::vector<int> keys;
+	bool ok = out.size() == expected;
+	for (OUT_ITEM &item : out)
+	{
+		int key = ((IntKey3*)item.first)->key;
+		ok = ok && ((IntValue3*)item.second)->value == 2 * key;
+		keys.push_back(key);
+	}
+	if (sorted)
+		ok = ok && std::is_sorted(keys.begin(), keys.end());
+	// every item once, and the smallest keys when limited
+	std::sort(keys.begin(), keys.end());
+	for (size_t j = 0; ok && j < keys.size(); ++j)
+		ok = keys[j] == (int)j;
+	check(ok, name);
+	freeOutput(out);
+}
+
+/**
+ * Checks a SumJob output with an outputLimit and deletes it
+ * @param out the job output
+ * @param name the check name
+ * @param limit the outputLimit
+ * @param byValue true if the largest sums were kept, false if the smallest keys were
+ */
+static void checkTop(OUT_ITEMS_VEC &out, const std::string &name, size_t limit, bool byValue)
+{
+	std::vector<long> sums = expectedSums(N_ITEMS);
+	std::vector<int> keys;
+	for (int key = 0; key < N_KEYS; ++key)
+		keys.push_back(key);
+	if (byValue)
+		std::stable_sort(keys.begin(), keys.end(), [&sums](int lhs, int rhs) { return sums[lhs] > sums[rhs]; });
+	keys.resize(limit);
+	std::sort(keys.begin(), keys.end());
+
+	bool ok = out.size() == limit;
+	for (size_t j = 0; ok && j < out.size(); ++j)
+	{
+		int key = ((IntKey3*)out[j].first)->key;
+		ok = key == keys[j] && ((IntValue3*)out[j].second)->value == sums[key];
+	}
+	check(ok, name);
+	freeOutput(out);
+}
+
+/**
+ * @param path a file path
+ * @return the file content, empty if it can't be read
+ */
+static std::string readFile(const std::string &path)
+{
+	std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+	return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+/**
+ * Skips a JSON value and the whitespace around it
+ * @param text the JSON text
+ * @param pos the value position, set to the position after it
+ * @return false if the text at pos isn't a valid value, otherwise true
+ */
+static bool skipJson(const std::string &text, size_t &pos)
+{
+	pos = text.find_first_not_of(" \t\r\n", pos);
+	if (pos == std::string::npos)
+		return false;
+
+	char c = text[pos];
+	if (c == '{' || c == '[')
+	{
+		char close = (c == '{') ? '}' : ']';
+		pos = text.find_first_not_of(" \t\r\n", pos + 1);
+		if (pos != std::string::npos && text[pos] == close)
+		{
+			pos++;
+		}
+		else
+		{
+			while (true)
+			{
+				// an object member is a string, a colon and a value
+				if (c == '{')
+				{
+					size_t key = text.find_first_not_of(" \t\r\n", pos);
+					if (key == std::string::npos || text[key] != '"' || !skipJson(text, pos) ||
+						pos >= text.size() || text[pos] != ':')
+						return false;
+					pos++;
+				}
+				if (!skipJson(text, pos) || pos >= text.size())
+					return false;
+				if (text[pos] == close)
+					break;
+				if (text[pos] != ',')
+					return false;
+				pos++;
+			}
+			pos++;
+		}
+	}
+	else if (c == '"')
+	{
+		for (pos++; pos < text.size() && text[pos] != '"'; ++pos)
+		{
+			if ((unsigned char)text[pos] < 0x20)
+				return false;
+			if (text[pos] == '\\' && ++pos < text.size() && strchr("\"\\/bfnrtu", text[pos]) == nullptr)
+				return false;
+		}
+		if (pos++ >= text.size())
+			return false;
+	}
+	else if (c == '-' || (c >= '0' && c <= '9'))
+	{
+		size_t end = text.find_first_not_of("+-.0123456789eE", pos);
+		if (end == std::string::npos)
+			end = text.size();
+		char* parsed;
+		std::string number = text.substr(pos, end - pos);
+		strtod(number.c_str(), &parsed);
+		if (*parsed != '\0')
+			return false;
+		pos = end;
+	}
+	else if (text.compare(pos, 4, "true") == 0 || text.compare(pos, 4, "null") == 0)
+	{
+		pos += 4;
+	}
+	else if (text.compare(pos, 5, "false") == 0)
+	{
+		pos += 5;
+	}
+	else
+	{
+		return false;
+	}
+
+	pos = text.find_first_not_of(" \t\r\n", pos);
+	if (pos == std::string::npos)
+		pos = text.size();
+	return true;
+}
+
+/**
+ * @param text a JSON text
+ * @return true if the text is a single valid JSON value, otherwise false
+ */
+static bool isJson(const std::string &text)
+{
+	size_t pos = 0;
+	return skipJson(text, pos) && pos == text.size();
+}
+
+/**
+ * @param trace a trace file written by the framework, one event per line
+ * @param name an event name
+ * @return the arguments of the events with the given name, in the order of the file
+ */
+static std::vector<long> traceArgs(const std::string &trace, const std::string &name)
+{
+	std::vector<long> args;
+	std::string event = "{\"name\":\"" + name + "\",";
+	for (size_t pos = trace.find(event); pos != std::string::npos; pos = trace.find(event, pos + 1))
+	{
+		size_t end = trace.find('\n', pos);
+		size_t arg = trace.find("\"arg\":", pos);
+		if (arg != std::string::npos && arg < end)
+			args.push_back(atol(trace.c_str() + arg + 6));
+	}
+	return args;
+}
+
+/**
+ * @param dir a directory
+ * @return the number of chunk files in the directory
+ */
+static int countChunkFiles(const std::string &dir)
+{
+	int count = 0;
+	DIR* dirp = opendir(dir.c_str());
+	if (dirp == NULL)
+		return 0;
+	struct dirent* dirstruct;
+	while ((dirstruct = readdir(dirp)) != NULL)
+		if (strncmp(dirstruct->d_name, "chunk-", 6) == 0)
+			count++;
+	closedir(dirp);
+	return count;
+}
+
+/**
+ * Renames the chunk files of a directory past the last input item, so a job that writes its own
+ * chunks to the directory doesn't replace them
+ * @param dir a directory
+ * @return the number of renamed files
+ */
+static int renameChunkFiles(const std::string &dir)
+{
+	std::vector<std::string> names;
+	DIR* dirp = opendir(dir.c_str());
+	if (dirp == NULL)
+		return 0;
+	struct dirent* dirstruct;
+	while ((dirstruct = readdir(dirp)) != NULL)
+		if (strncmp(dirstruct->d_name, "chunk-", 6) == 0)
+			names.push_back(dirstruct->d_name);
+	closedir(dirp);
+
+	for (const std::string &name : names)
+	{
+		std::string moved = "chunk-" + std::to_string(N_ITEMS + atoi(name.c_str() + 6)) +
+							name.substr(name.find('.'));
+		rename((dir + "/" + name).c_str(), (dir + "/" + moved).c_str());
+	}
+	return (int)names.size();
+}
+
+/**
+ * Removes the files in a directory
+ * @param dir a directory
+ */
+static void removeFiles(const std::string &dir)
+{
+	DIR* dirp = opendir(dir.c_str());
+	if (dirp == NULL)
+		return;
+	struct dirent* dirstruct;
+	while ((dirstruct = readdir(dirp)) != NULL)
+		if (dirstruct->d_type == DT_REG)
+			unlink((dir + "/" + dirstruct->d_name).c_str());
+	closedir(dirp);
+}
+
+/**
+ * Runs a checkpointed job in a child process that exits after half the Map calls
+ * @param dir the checkpoint directory
+ * @param fingerprint the job's checkpoint fingerprint
+ * @return true if the child exited and left chunk files, otherwise false
+ */
+static bool crashCheckpointedJob(const std::string &dir, uint64_t fingerprint)
+{
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		CheckpointJob job;
+		job.exitAfter = N_ITEMS / 2;
+		nMapCalls = 0;
+		IN_ITEMS_VEC items = makeItems();
+		MapReduceOptions options;
+		options.checkpointDir = dir;
+		options.checkpointFingerprint = fingerprint;
+		RunMapReduceFramework(job, items, N_THREADS, true, options);
+		_exit(1);
+	}
+
+	int status;
+	return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+		   countChunkFiles(dir) > 0;
+}
+
+/**
+ * Writes a copy of an index file with a 64 bit value replaced and checks that it can't be opened
+ * @param source valid index file
+ * @param path path of the copy
+ * @param offset byte offset of the replaced value, one of the INDEX_*_AT definitions
+ * @param value the value written there
+ * @param length length the copy is truncated to, 0 keeps the whole file
+ * @param name the check name
+ */
+static void checkMalformedIndex(const std::string &source, const std::string &path, size_t offset,
+								uint64_t value, size_t length, const std::string &name)
+{
+	std::string bytes = readFile(source);
+	memcpy(&bytes[offset], &value, sizeof(value));
+	if (length != 0)
+		bytes.resize(length);
+	std::ofstream(path.c_str(), std::ios::binary | std::ios::trunc) << bytes;
+
+	TrigramIndex index;
+	check(!index.open(path), name);
+	unlink(path.c_str());
+}
+
+//------------------------------------- Tests ------------------------------------------------------
+
+/**
+ * Builds an index of a few file names and queries it, a name that has all the trigrams of a
+ * pattern but doesn't contain it must be dropped by the verification
+ */
+static void testTrigramIndex()
+{
+	std::string dir = makeTempDir();
+	std::string path = dir + "/index";
+
+	// added in ascending order, the count of a name is its position plus one
+	std::vector<std::string> names = {"abc_bcd", "abcd.txt", "readme", "xabcdx"};
+	TrigramIndexWriter writer;
+	std::vector<TRIGRAM> trigrams;
+	for (size_t i = 0; i < names.size(); ++i)
+	{
+		extractTrigrams(names[i], trigrams);
+		writer.add(names[i], (int)i + 1, trigrams);
+	}
+	check(writer.write(path), "trigram index write");
+
+	TrigramIndex index;
+	check(index.open(path), "trigram index open");
+	std::vector<INDEX_MATCH> matches;
+	index.query("abcd", matches);
+	check(matches == std::vector<INDEX_MATCH>({INDEX_MATCH("abcd.txt", 2), INDEX_MATCH("xabcdx", 4)}),
+		  "trigram index query verifies the candidates");
+
+	// shorter than a trigram, every name is verified
+	matches.clear();
+	index.query("me", matches);
+	check(matches == std::vector<INDEX_MATCH>({INDEX_MATCH("readme", 3)}), "trigram index short pattern");
+
+	matches.clear();
+	index.query("zzz", matches);
+	check(matches.empty(), "trigram index missing trigram");
+
+	TrigramIndex missing;
+	check(!missing.open(dir + "/missing"), "trigram index open missing file");
+
+	// headers that don't describe the file must be rejected before any table is read
+	std::string bad = dir + "/bad";
+	uint64_t magic;
+	memcpy(&magic, "MRTRIGR0", sizeof(magic));
+	checkMalformedIndex(path, bad, INDEX_MAGIC_AT, magic, 0, "trigram index rejects a bad magic");
+	checkMalformedIndex(path, bad, INDEX_MAGIC_AT, magic, INDEX_HEADER_SIZE - 1,
+						"trigram index rejects a truncated header");
+	std::string valid = readFile(path);
+	checkMalformedIndex(path, bad, INDEX_MAGIC_AT, *(const uint64_t*)valid.data(), valid.size() - 1,
+						"trigram index rejects truncated names");
+	checkMalformedIndex(path, bad, INDEX_NAMES_AT, valid.size() + 1, 0,
+						"trigram index rejects names past the end");
+	checkMalformedIndex(path, bad, INDEX_NAMES_SIZE_AT, UINT64_MAX, 0,
+						"trigram index rejects an overflowing names size");
+	checkMalformedIndex(path, bad, INDEX_FILES_AT, UINT64_MAX - 7, 0,
+						"trigram index rejects an overflowing file table offset");
+	checkMalformedIndex(path, bad, INDEX_FILES_AT, INDEX_HEADER_SIZE + 2, 0,
+						"trigram index rejects a misaligned file table");
+
+	// a file entry whose name lies outside the names is skipped, the others still match
+	std::string corrupt = valid;
+	uint32_t nameOffset = UINT32_MAX - 2;
+	memcpy(&corrupt[INDEX_HEADER_SIZE], &nameOffset, sizeof(nameOffset));
+	std::ofstream(bad.c_str(), std::ios::binary | std::ios::trunc) << corrupt;
+	TrigramIndex corrupted;
+	check(corrupted.open(bad), "trigram index open with a corrupt file entry");
+	matches.clear();
+	corrupted.query("b", matches);
+	check(matches == std::vector<INDEX_MATCH>({INDEX_MATCH("abcd.txt", 2), INDEX_MATCH("xabcdx", 4)}),
+		  "trigram index skips a corrupt file entry");
+	unlink(bad.c_str());
+
+	unlink(path.c_str());
+	rmdir(dir.c_str());
+}
+
+/**
+ * Matches overlapping patterns, a pattern that is a prefix of another and duplicate patterns
+ */
+static void testAhoCorasick()
+{
+	AhoCorasick matcher;
+	std::vector<int> ids;
+
+	matcher.build({"he", "she", "his", "hers"});
+	matcher.match("ushers", ids);
+	check(ids == std::vector<int>({0, 1, 3}), "aho corasick overlapping patterns");
+	matcher.match("ahisz", ids);
+	check(ids == std::vector<int>({2}), "aho corasick single pattern");
+	matcher.match("zzz", ids);
+	check(ids.empty(), "aho corasick no match");
+
+	matcher.build({"ab", "abc", "b"});
+	matcher.match("xabx", ids);
+	check(ids == std::vector<int>({0, 2}), "aho corasick prefix of another pattern");
+	matcher.match("abc", ids);
+	check(ids == std::vector<int>({0, 1, 2}), "aho corasick pattern and its prefix");
+
+	// every id of a duplicate pattern is reported, once per text
+	matcher.build({"x", "y", "x"});
+	matcher.match("xax", ids);
+	check(ids == std::vector<int>({0, 2}), "aho corasick duplicate patterns");
+	matcher.match("", ids);
+	check(ids.empty(), "aho corasick empty text");
+}
+
+/**
+ * Interns equal strings once and orders them like std::string, then runs jobs with string keys that
+ * must leave the string table empty
+ */
+static void testInternedStrings()
+{
+	InternedString a(std::string("abcdefgh-one"));
+	InternedString b("abcdefgh-one", 12);
+	InternedString c(std::string("abcdefgh-two"));
+	InternedString d(std::string("ab"));
+	check(a == b && a.hash() == b.hash() && a.str() == "abcdefgh-one", "interned equal strings");
+	check(a != c && a < c && !(c < a), "interned strings with a shared prefix");
+	check(d < a && !(a < d) && d.size() == 2, "interned prefix orders first");
+	check(InternedString() < d && InternedString().size() == 0, "interned empty string");
+	check(internedStringCount() == 3, "interned strings are stored once");
+	clearInternedStrings();
+
+	// the table belongs to the job whether or not the framework deletes the keys, the keys the
+	// framework doesn't delete are leaked by the test
+	StringJob job;
+	IN_ITEMS_VEC items = makeItems();
+	for (int run = 0; run < 2; ++run)
+	{
+		std::string name = "interned string keys, run " + std::to_string(run);
+		OUT_ITEMS_VEC out = RunMapReduceFramework(job, items, N_THREADS, run == 0);
+		checkSums(out, name);
+		check(internedStringCount() == 0, name + " clears the table");
+	}
+	freeItems(items);
+}
+
+/**
+ * Runs several jobs in one process, every job must reset the framework state of the previous one
+ */
+static void testSeveralJobs()
+{
+	SumJob job;
+	IN_ITEMS_VEC items = makeItems();
+	for (int run = 0; run < 6; ++run)
+	{
+		MapReduceOptions options;
+		options.shuffleMode = (run % 2 == 0) ? SHUFFLE_MAP : SHUFFLE_SORT;
+		// split every key so the combine threads run in every job
+		options.skewThreshold = (run < 2) ? 0 : 50;
+		OUT_ITEMS_VEC out = RunMapReduceFramework(job, items, N_THREADS, true, options);
+		checkSums(out, "several jobs, run " + std::to_string(run));
+	}
+	freeItems(items);
+}
+
+/**
+ * Splits hot keys with a Combine that returns no value for some of their ranges, no value may be
+ * lost or deleted twice
+ */
+static void testCombineFallback()
+{
+	NullCombineJob job;
+	IN_ITEMS_VEC items = makeItems();
+	for (int run = 0; run < 2; ++run)
+	{
+		MapReduceOptions options;
+		options.shuffleMode = (run == 0) ? SHUFFLE_MAP : SHUFFLE_SORT;
+		options.skewThreshold = 50;
+		OUT_ITEMS_VEC out = RunMapReduceFramework(job, items, N_THREADS, true, options);
+		checkSums(out, "combine fallback, run " + std::to_string(run));
+	}
+	freeItems(items);
+}
+
+/**
+ * Traces a job, the file must be valid JSON with the threads and their chunks
+ */
+static void testTrace()
+{
+	std::string dir = makeTempDir();
+	SumJob job;
+	IN_ITEMS_VEC items = makeItems();
+	for (int run = 0; run < 2; ++run)
+	{
+		MapReduceOptions options;
+		options.shuffleMode = (run == 0) ? SHUFFLE_MAP : SHUFFLE_SORT;
+		options.traceFile = dir + "/trace.json";
+		std::string name = "trace, run " + std::to_string(run);
+		OUT_ITEMS_VEC out = RunMapReduceFramework(job, items, N_THREADS, true, options);
+		checkSums(out, name);
+
+		std::string trace = readFile(options.traceFile);
+		check(isJson(trace), name + " is valid JSON");
+		check(trace.find("\"args\":{\"name\":\"ExecMap\"}") != std::string::npos &&
+			  trace.find("\"args\":{\"name\":\"ExecReduce\"}") != std::string::npos,
+			  name + " names the threads");
+
+		// every item is in one map chunk, the chunks are identified by their first item
+		std::vector<long> chunks = traceArgs(trace, "map chunk");
+		std::sort(chunks.begin(), chunks.end());
+		check(!chunks.empty() && chunks.front() == 0 && chunks.back() < N_ITEMS &&
+			  std::adjacent_find(chunks.begin(), chunks.end()) == chunks.end(), name + " has the map chunks");
+		check(traceArgs(trace, "reduce chunk").size() > 0, name + " has the reduce chunks");
+		unlink(options.traceFile.c_str());
+	}
+	freeItems(items);
+	rmdir(dir.c_str());
+}
+
+/**
+ * Counts a job's hardware events where the machine permits it, and reports why there are no
+ * counters in a process that can't open them
+ */
+static void testPerfCounters()
+{
+	SumJob job;
+	IN_ITEMS_VEC items = makeItems();
+	MapReduceOptions options;
+	options.perfCounters = true;
+	OUT_ITEMS_VEC out = RunMapReduceFramework(job, items, N_THREADS, true, options);
+	checkSums(out, "perf counters");
+	freeItems(items);
+
+	// a child that can't open any file descriptor
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		struct rlimit limit = {0, 0};
+		setrlimit(RLIMIT_NOFILE, &limit);
+		perfStart();
+		perfThreadBegin(PERF_MAP);
+		perfCollect(PERF_MAP);
+		std::vector<std::string> lines = perfReport();
+		_exit((lines.size() == 1 && lines[0].find("unavailable") != std::string::npos) ? 0 : 1);
+	}
+
+	int status;
+	check(pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0,
+		  "perf counters unavailable");
+}
+
+/**
+ * Deletes every intermediate object, and with the map shuffle the duplicate keys before the reduce
+ */
+static void testAutoDelete()
+{
+	CountedJob job;
+	IN_ITEMS_VEC items = makeItems();
+	for (int run = 0; run < 2; ++run)
+	{
+		MapReduceOptions options;
+		options.shuffleMode = (run == 0) ? SHUFFLE_MAP : SHUFFLE_SORT;
+		maxLiveKeys = 0;
+		std::string name = "auto delete, run " + std::to_string(run);
+		OUT_ITEMS_VEC out = RunMapReduceFramework(job, items, N_THREADS, true, options);
+		checkSums(out, name);
+		check(nLiveKeys == 0 && nLiveValues == 0, name + " deletes every key and value");
+		if (run == 0)
+			check(maxLiveKeys <= N_KEYS, name + " deletes the duplicate keys while shuffling");
+	}
+	freeItems(items);
+}
+
+/**
+ * Keeps up to depth requests in flight on the io_uring and the thread pool engines: file reads,
+ * a directory listing and a missing file, each request's result must reach its tag
+ */
+static void testAsyncEngines()
+{
+	std::string dir = makeTempDir();
+	for (int i = 0; i < N_ASYNC_REQUESTS; ++i)
+	{
+		std::ofstream file((dir + "/item-" + std::to_string(i)).c_str());
+		file << i;
+	}
+
+	// the last two requests list the directory and read a missing file
+	std::vector<AsyncRequest> requests;
+	for (int i = 0; i < N_ASYNC_REQUESTS; ++i)
+		requests.push_back(AsyncRequest(ASYNC_READ_FILE, dir + "/item-" + std::to_string(i)));
+	requests.push_back(AsyncRequest(ASYNC_LIST_DIR, dir));
+	requests.push_back(AsyncRequest(ASYNC_READ_FILE, dir + "/missing"));
+
+	unsigned depths[] = {1, 4, 32};
+	for (int run = 0; run < 2; ++run)
+	{
+		for (unsigned depth : depths)
+		{
+			std::string name = std::string(run == 0 ? "io_uring" : "thread pool") + " engine, depth " +
+							   std::to_string(depth);
+			check(asyncPoolStart(depth), name + " starts the pool");
+			AsyncEngine* engine = AsyncEngine::create(depth, run == 1);
+			if (strcmp(engine->name(), run == 0 ? "io_uring" : "thread pool") != 0)
+			{
+				// the kernel or a seccomp filter may refuse io_uring, the pool was tested anyway
+				check(run == 0, name + " is created");
+				std::cerr << "io_uring unavailable, skipped: " << name << std::endl;
+			}
+
+			std::vector<AsyncResult> results(requests.size());
+			std::vector<int> nCompleted(requests.size(), 0);
+			size_t next = 0;
+			size_t inFlight = 0;
+			while (next < requests.size() || inFlight > 0)
+			{
+				for (; next < requests.size() && inFlight < depth; ++next, ++inFlight)
+					engine->submit(requests[next], next);
+
+				AsyncResult result;
+				uint64_t ioTime;
+				size_t tag = engine->wait(result, ioTime);
+				if (tag < requests.size())
+				{
+					results[tag] = result;
+					nCompleted[tag]++;
+				}
+				inFlight--;
+			}
+			delete engine;
+			asyncPoolStop();
+
+			bool ok = std::count(nCompleted.begin(), nCompleted.end(), 1) == (long)requests.size();
+			for (int i = 0; ok && i < N_ASYNC_REQUESTS; ++i)
+				ok = results[i].error == 0 && results[i].data == std::to_string(i);
+			check(ok, name + " reads every file once");
+
+			const std::vector<std::string> &entries = results[N_ASYNC_REQUESTS].entries;
+			check(results[N_ASYNC_REQUESTS].error == 0 && entries.size() == N_ASYNC_REQUESTS + 2 &&
+				  std::count(entries.begin(), entries.end(), "item-0") == 1, name + " lists the directory");
+			check(results[N_ASYNC_REQUESTS + 1].error == ENOENT, name + " reports a missing file");
+		}
+	}
+
+	for (int i = 0; i < N_ASYNC_REQUESTS; ++i)
+		unlink((dir + "/item-" + std::to_string(i)).c_str());
+	rmdir(dir.c_str());
+}
+
+/**
+ * Reads the items asynchronously with several depths on both engines, and completes the reads of
+ * missing files with their error
+ */
+static void testAsyncMap()
+{
+	std::string dir = makeTempDir();
+	for (int i = 0; i < N_ITEMS; ++i)
+	{
+		std::ofstream file((dir + "/item-" + std::to_string(i)).c_str());
+		file << i;
+	}
+
+	IN_ITEMS_VEC items = makeItems();
+	unsigned depths[] = {1, 4, 32};
+	for (int run = 0; run < 2; ++run)
+	{
+		for (unsigned depth : depths)
+		{
+			std::string name = "async map, " + std::string(run == 0 ? "io_uring" : "pool") + " depth " +
+							   std::to_string(depth);
+			AsyncSumJob job;
+			job.dir = dir;
+			MapReduceOptions options;
+			options.asyncMap = true;
+			options.asyncDepth = depth;
+			options.asyncPool = run == 1;
+			size_t logStart = readFile(LOG_FILE).size();
+			OUT_ITEMS_VEC out = RunMapReduceFramework(job, items, N_THREADS, true, options);
+			checkSums(out, name);
+			check(job.nErrors == 0, name + " reads every file");
+
+			// every map thread logs its engine
+			std::string log = readFile(LOG_FILE).substr(logStart);
+			bool pool = log.find("uses thread pool") != std::string::npos;
+			bool uring = log.find("uses io_uring") != std::string::npos;
+			if (options.asyncPool)
+				check(pool && !uring, name + " uses only the pool");
+		}
+	}
+
+	for (int run = 0; run < 2; ++run)
+	{
+		AsyncSumJob missing;
+		missing.dir = dir + "/missing";
+		MapReduceOptions options;
+		options.asyncMap = true;
+		options.asyncPool = run == 1;
+		OUT_ITEMS_VEC out = RunMapReduceFramework(missing, items, N_THREADS, true, options);
+		check(out.empty() && missing.nErrors == N_ITEMS,
+			  "async map missing files, run " + std::to_string(run));
+	}
+	freeItems(items);
+
+	for (int i = 0; i < N_ITEMS; ++i)
+		unlink((dir + "/item-" + std::to_string(i)).c_str());
+	rmdir(dir.c_str());
+}
+
+/**
+ * Resumes a job from the chunks of a crashed run, ignores the chunks of another job and removes
+ * the chunk files of a job whose checkpointing was disabled while it ran
+ */
+static void testCheckpoint()
+{
+	std::string dir = makeTempDir();
+	IN_ITEMS_VEC items = makeItems();
+	MapReduceOptions options;
+	options.checkpointDir = dir;
+
+	// the rerun maps only the chunks the crashed run didn't complete
+	options.checkpointFingerprint = 1;
+	check(crashCheckpointedJob(dir, 1), "checkpoint crash");
+	CheckpointJob job;
+	nMapCalls = 0;
+	OUT_ITEMS_VEC out = RunMapReduceFramework(job, items, N_THREADS, true, options);
+	checkSums(out, "checkpoint resume");
+	check(nMapCalls < N_ITEMS, "checkpoint resume maps less items");
+	check(countChunkFiles(dir) == 0, "checkpoint resume removes the chunks");
+
+	// chunks of another fingerprint aren't loaded or removed, nor are files that aren't chunk files
+	check(crashCheckpointedJob(dir, 2), "checkpoint crash");
+	int nForeign = renameChunkFiles(dir);
+	std::vector<std::string> others = {"chunk-1.ckpt.bak", "chunk-.ckpt", "chunk-x1.ckpt", "notes"};
+	for (const std::string &name : others)
+		std::ofstream((dir + "/" + name).c_str()) << "not a chunk";
+	nMapCalls = 0;
+	out = RunMapReduceFramework(job, items, N_THREADS, true, options);
+	checkSums(out, "checkpoint fingerprint");
+	check(nMapCalls == N_ITEMS, "checkpoint fingerprint maps every item");
+	check(countChunkFiles(dir) == nForeign + 3, "checkpoint fingerprint keeps the other files");
+	for (const std::string &name : others)
+		check(access((dir + "/" + name).c_str(), F_OK) == 0, "checkpoint keeps " + name);
+	removeFiles(dir);
+
+	// synced chunks are resumed the same way
+	options.checkpointSync = true;
+	check(crashCheckpointedJob(dir, 1), "checkpoint crash");
+	nMapCalls = 0;
+	out = RunMapReduceFramework(job, items, N_THREADS, true, options);
+	checkSums(out, "checkpoint sync");
+	check(nMapCalls < N_ITEMS, "checkpoint sync maps less items");
+	check(countChunkFiles(dir) == 0, "checkpoint sync removes the chunks");
+
+	// chunks written before checkpointing failed are removed too
+	CheckpointJob failing;
+	failing.serializeLimit = N_ITEMS * PAIRS_PER_ITEM / 4;
+	out = RunMapReduceFramework(failing, items, N_THREADS, true, options);
+	checkSums(out, "checkpoint disabled");
+	check(countChunkFiles(dir) == 0, "checkpoint disabled removes the chunks");
+
+	freeItems(items);
+	rmdir(dir.c_str());
+}
+
+/**
+ * Runs jobs on kept threads, every kind of framework thread runs a task of several jobs
+ */
+static void testKeepThreads()
+{
+	SumJob job;
+	IN_ITEMS_VEC items = makeItems();
+	for (int run = 0; run < 8; ++run)
+	{
+		MapReduceOptions options;
+		options.keepThreads = true;
+		options.shuffleMode = (run % 2 == 0) ? SHUFFLE_MAP : SHUFFLE_SORT;
+		options.skewThreshold = 50;
+		options.shuffleQueueBudget = (run % 4 == 0) ? 8192 : 0;
+		OUT_ITEMS_VEC out = RunMapReduceFramework(job, items, N_THREADS, true, options);
+		checkSums(out, "keep threads, run " + std::to_string(run));
+	}
+	freeItems(items);
+}
+
+/**
+ * Caches directory listings, answers from the cache until the directory's mtime or ctime changes
+ * and drops the least recently used listings when the names don't fit
+ */
+static void testDirectoryCache()
+{
+	// every directory has a single file, so its listing has 3 names with . and ..
+	std::string dir = makeTempDir();
+	std::vector<std::string> dirs = {dir + "/first", dir + "/second", dir + "/third"};
+	for (const std::string &path : dirs)
+	{
+		mkdir(path.c_str(), 0755);
+		std::ofstream((path + "/file").c_str());
+	}
+
+	// listings taken within a second of a change aren't cached
+	sleep(CACHE_TRUST_SECONDS);
+	DirectoryCache cache(100);
+	size_t hits, misses;
+	DIRECTORY_LISTING listing = cache.get(dirs[0]);
+	check(listing != nullptr && std::count(listing->begin(), listing->end(), "file") == 1,
+		  "directory cache lists the directory");
+	cache.get(dirs[0]);
+	cache.get(dirs[1]);
+	cache.get(dirs[1]);
+	cache.takeStats(hits, misses);
+	check(hits == 2 && misses == 2, "directory cache hits");
+	check(cache.get(dir + "/missing") == nullptr, "directory cache missing directory");
+
+	// room for two listings, the least recently used one is dropped
+	DirectoryCache lru(6);
+	lru.get(dirs[0]);
+	lru.get(dirs[1]);
+	lru.get(dirs[0]);
+	lru.get(dirs[2]);
+	lru.get(dirs[0]);
+	lru.get(dirs[1]);
+	lru.takeStats(hits, misses);
+	check(hits == 2 && misses == 4, "directory cache drops the least recently used listing");
+
+	DirectoryCache small(2);
+	small.get(dirs[0]);
+	small.get(dirs[0]);
+	small.takeStats(hits, misses);
+	check(hits == 0 && misses == 2, "directory cache skips a listing larger than the cache");
+
+	// a new entry changes mtime, a mode change only ctime
+	std::ofstream((dirs[0] + "/new").c_str());
+	chmod(dirs[1].c_str(), 0700);
+	listing = cache.get(dirs[0]);
+	check(listing != nullptr && std::count(listing->begin(), listing->end(), "new") == 1,
+		  "directory cache lists a changed directory again");
+	cache.get(dirs[1]);
+	cache.takeStats(hits, misses);
+	check(hits == 0 && misses == 2, "directory cache mtime and ctime invalidation");
+
+	unlink((dirs[0] + "/new").c_str());
+	for (const std::string &path : dirs)
+	{
+		unlink((path + "/file").c_str());
+		rmdir(path.c_str());
+	}
+	rmdir(dir.c_str());
+}
+
+/**
+ * Runs a numeric job with options it must override, its pairs are never checkpointed
+ */
+static void testNumeric()
+{
+	std::string dir = makeTempDir();
+	NumericJob job;
+	IN_ITEMS_VEC items = makeItems();
+	MapReduceOptions options;
+	options.checkpointDir = dir;
+	options.skewThreshold = 50;
+	OUT_ITEMS_VEC out = RunMapReduceFramework(job, items, N_THREADS, true, options);
+	checkSums(out, "numeric");
+	check(countChunkFiles(dir) == 0, "numeric job isn't checkpointed");
+
+	freeItems(items);
+	rmdir(dir.c_str());
+}
+
+/**
+ * Keeps the smallest keys or the largest values, with and without skipping keys
+ */
+static void testTopK()
+{
+	SumJob job;
+	TopJob topJob;
+	IN_ITEMS_VEC items = makeItems();
+	for (int run = 0; run < 8; ++run)
+	{
+		MapReduceOptions options;
+		options.shuffleMode = (run % 2 == 0) ? SHUFFLE_MAP : SHUFFLE_SORT;
+		options.outputLimit = (run < 4) ? 5 : 1;
+		bool byValue = (run / 2) % 2 == 1;
+		if (byValue)
+			options.outputValueLess = &intValue3Less;
+		OUT_ITEMS_VEC out = RunMapReduceFramework(job, items, N_THREADS, true, options);
+		checkTop(out, "top k, run " + std::to_string(run), options.outputLimit, byValue);
+		out = RunMapReduceFramework(topJob, items, N_THREADS, true, options);
+		checkTop(out, "top k skipping keys, run " + std::to_string(run), options.outputLimit, byValue);
+	}
+	freeItems(items);
+}
+
+/**
+ * Runs a slow chunk again on an idle thread, only the copy that finishes first emits its pairs
+ */
+static void testSpeculativeMap()
+{
+	IN_ITEMS_VEC items = makeItems();
+	for (int run = 0; run < 2; ++run)
+	{
+		SlowJob job;
+		MapReduceOptions options;
+		options.speculativeMap = true;
+		options.shuffleMode = (run == 0) ? SHUFFLE_MAP : SHUFFLE_SORT;
+		nMapCalls = 0;
+		OUT_ITEMS_VEC out = RunMapReduceFramework(job, items, N_THREADS, true, options);
+		checkSums(out, "speculative map, run " + std::to_string(run));
+		check(nMapCalls > N_ITEMS, "speculative map, run " + std::to_string(run) + " runs a chunk again");
+	}
+	freeItems(items);
+}
+
+/**
+ * Claims the items in decreasing cost order, an item whose cost reaches a chunk's share of the
+ * total alone and the cheap items in full chunks, and returns the map times in item order
+ */
+static void testItemCosts()
+{
+	std::string dir = makeTempDir();
+	IN_ITEMS_VEC items = makeItems(40);
+	OrderJob job;
+	job.slowItems = {5, 30};
+	std::vector<uint64_t> times;
+	MapReduceOptions options;
+	options.traceFile = dir + "/trace.json";
+	options.itemTimes = &times;
+
+	// items 0 to 3 cost more than a tenth of the total, the share of a chunk of the single thread
+	options.itemCosts.assign(items.size(), 1);
+	for (uint64_t i = 0; i < 4; ++i)
+		options.itemCosts[i] = 1000 + i;
+	OUT_ITEMS_VEC out = RunMapReduceFramework(job, items, 1, true, options);
+	checkSums(out, "item costs", 40);
+
+	std::vector<int> order = {3, 2, 1, 0};
+	for (int i = 4; i < 40; ++i)
+		order.push_back(i);
+	check(job.order == order, "item costs claims the expensive items first");
+
+	// chunks are identified by their first position in the claim order
+	std::vector<long> chunks = traceArgs(readFile(options.traceFile), "map chunk");
+	std::sort(chunks.begin(), chunks.end());
+	check(chunks == std::vector<long>({0, 1, 2, 3, 4, 14, 24, 34}), "item costs chunks stop at the cost share");
+
+	bool ok = times.size() == items.size();
+	for (size_t i = 0; ok && i < times.size(); ++i)
+	{
+		bool slow = i == 5 || i == 30;
+		ok = (times[i] >= SLOW_ITEM_US * 1000ULL) == slow;
+	}
+	check(ok, "item costs returns the map times in item order");
+
+	freeItems(items);
+	unlink(options.traceFile.c_str());
+	rmdir(dir.c_str());
+}
+
+/**
+ * Runs map only jobs whose Map calls Emit3, unsorted, limited and with a speculated chunk whose
+ * pairs are kept only from the copy that finishes first
+ */
+static void testMapOnly()
+{
+	IN_ITEMS_VEC items = makeItems();
+	for (int run = 0; run < 6; ++run)
+	{
+		MapOnlyJob job;
+		MapReduceOptions options;
+		options.mapOnly = true;
+		options.sortOutput = run % 2 == 0;
+		options.outputLimit = (run / 2 == 1) ? 5 : 0;
+		if (run / 2 == 2)
+		{
+			options.speculativeMap = true;
+			job.slowItem = N_ITEMS / 2;
+		}
+		nMapCalls = 0;
+		std::string name = "map only, run " + std::to_string(run);
+		OUT_ITEMS_VEC out = RunMapReduceFramework(job, items, N_THREADS, true, options);
+		checkMapOnly(out, name, options.outputLimit, options.sortOutput);
+		if (options.speculativeMap)
+			check(nMapCalls > N_ITEMS, name + " runs a chunk again");
+	}
+	freeItems(items);
+}
+
+/**
+ * Runs jobs with a shuffle queue budget, the pairs waiting for the shuffle must stay within the
+ * budget and the shuffle must terminate however the map threads finish. Without a budget nothing
+ * is counted.
+ */
+static void testShuffleQueueBudget()
+{
+	SumJob job;
+	IN_ITEMS_VEC items = makeItems();
+	for (int run = 0; run < 20; ++run)
+	{
+		// a small budget blocks the map threads, a large one never does
+		MapReduceOptions options;
+		options.shuffleQueueBudget = (run % 2 == 0) ? 8192 : 1024 * 1024 * 1024;
+		OUT_ITEMS_VEC out = RunMapReduceFramework(job, items, N_THREADS, true, options);
+		checkSums(out, "shuffle queue budget, run " + std::to_string(run));
+		check(MapReduceMemoryUsage().peakPendingBytes <= options.shuffleQueueBudget,
+			  "shuffle queue budget, run " + std::to_string(run) + " stays within the budget");
+	}
+	freeItems(items);
+
+	// the map threads of a small job may terminate before the main thread waits for them
+	items = makeItems(8);
+	for (int run = 0; run < 200; ++run)
+	{
+		MapReduceOptions options;
+		options.shuffleQueueBudget = 1024 * 1024;
+		OUT_ITEMS_VEC out = RunMapReduceFramework(job, items, N_THREADS, true, options);
+		checkSums(out, "shuffle queue budget, small run " + std::to_string(run), 8);
+	}
+	freeItems(items);
+
+	// only a job with a Shuffle thread measures its pairs
+	MeasuredJob measured;
+	items = makeItems();
+	for (int run = 0; run < 3; ++run)
+	{
+		MapReduceOptions options;
+		options.shuffleQueueBudget = (run == 0) ? 0 : 8192;
+		options.shuffleMode = (run == 2) ? SHUFFLE_SORT : SHUFFLE_MAP;
+		measured.nMeasured = 0;
+		OUT_ITEMS_VEC out = RunMapReduceFramework(measured, items, N_THREADS, true, options);
+		checkSums(out, "shuffle queue budget, measured run " + std::to_string(run));
+		bool counted = run == 1;
+		check(measured.nMeasured == (counted ? N_ITEMS * PAIRS_PER_ITEM : 0),
+			  "shuffle queue budget, measured run " + std::to_string(run) + " measures its pairs");
+		check((MapReduceMemoryUsage().peakPendingBytes > 0) == counted,
+			  "shuffle queue budget, measured run " + std::to_string(run) + " counts its pairs");
+	}
+	freeItems(items);
+}
+
+int main()
+{
+	testTrigramIndex();
+	testAhoCorasick();
+	testInternedStrings();
+	testSeveralJobs();
+	testCombineFallback();
+	testTrace();
+	testPerfCounters();
+	testAutoDelete();
+	testAsyncEngines();
+	testAsyncMap();
+	testCheckpoint();
+	testKeepThreads();
+	testDirectoryCache();
+	testNumeric();
+	testTopK();
+	testSpeculativeMap();
+	testItemCosts();
+	testMapOnly();
+	testShuffleQueueBudget();
+
+	if (nFailures > 0)
+		return 1;
+	std::cout << "All tests passed" << std::endl;
+	return 0;
+}
@@ -0,0 +1,178 @@
+#include <pthread.h>
+#include <ctime>
+#include <fstream>
+#include <vector>
+#include "MapReduceTrace.h"
+
+//--------------------------------------- Definitions ----------------------------------------------
+/**
+ * Convert seconds to nanoseconds
+ */
+#define SEC_TO_NS(x) ((x) * 1000000000ULL)
+
+/**
+ * Nanoseconds in a microsecond, trace event timestamps are in microseconds
+ */
+#define NS_PER_US 1000.0
+
+//-------------------------------------- Data structures --------------------------------------------------
+/**
+ * A complete event, ph "X" in the trace event format
+ */
+struct TraceEvent
+{
+	const char* name;
+	const char* category;
+	uint64_t start;
+	uint64_t end;
+	long arg;
+};
+
+/**
+ * The events of a single thread
+ */
+struct TraceBuffer
+{
+	int tid;
+	const char* name;
+	std::vector<TraceEvent> events;
+};
+
+/**
+ * The buffers of all the threads of the current job
+ */
+static std::vector<TraceBuffer*> buffers;
+
+/**
+ * Used to lock buffers when a thread registers its buffer
+ */
+static pthread_mutex_t mut_buffers = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * True while a traced job runs
+ */
+static bool enabled = false;
+
+/**
+ * Incremented for every traced job, a thread buffer of an older job is never reused
+ */
+static unsigned generation = 0;
+
+/**
+ * Time the job started, event times are relative to it
+ */
+static uint64_t startTime = 0;
+
+/**
+ * The buffer of the calling thread and the job it belongs to
+ */
+static thread_local TraceBuffer* threadBuffer = nullptr;
+static thread_local unsigned threadGeneration = 0;
+
+//---------------------------------------------------------------------------------------------------
+
+/**
+ * Returns the calling thread buffer, registering a new buffer on the thread's first event
+ * @return the calling thread buffer
+ */
+static TraceBuffer* getBuffer()
+{
+	if (threadBuffer != nullptr && threadGeneration == generation)
+		return threadBuffer;
+
+	pthread_mutex_lock(&mut_buffers);
+	threadBuffer = new TraceBuffer;
+	threadBuffer->tid = (int)buffers.size() + 1;
+	threadBuffer->name = "main";
+	buffers.push_back(threadBuffer);
+	threadGeneration = generation;
+	pthread_mutex_unlock(&mut_buffers);
+
+	return threadBuffer;
+}
+
+/**
+ * Frees all the buffers
+ */
+static void freeBuffers()
+{
+	pthread_mutex_lock(&mut_buffers);
+	for (TraceBuffer* buffer : buffers)
+		delete buffer;
+	buffers.clear();
+	pthread_mutex_unlock(&mut_buffers);
+}
+
+void traceStart()
+{
+	freeBuffers();
+	generation++;
+	enabled = true;
+	startTime = traceNow();
+}
+
+bool traceEnabled()
+{
+	return enabled;
+}
+
+uint64_t traceNow()
+{
+	if (!enabled)
+		return 0;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return SEC_TO_NS((uint64_t)now.tv_sec) + now.tv_nsec;
+}
+
+void traceThreadName(const char *name)
+{
+	if (enabled)
+		getBuffer()->name = name;
+}
+
+void traceEvent(const char *name, const char *category, uint64_t start, long arg)
+{
+	if (!enabled)
+		return;
+
+	TraceEvent event = {name, category, start, traceNow(), arg};
+	getBuffer()->events.push_back(event);
+}
+
+bool traceWrite(const std::string &path)
+{
+	enabled = false;
+
+	std::ofstream file(path.c_str(), std::ios::out | std::ios::trunc);
+	if (!file.fail())
+	{
+		file.setf(std::ios::fixed);
+		file.precision(3);
+		file << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+		bool first = true;
+		for (TraceBuffer* buffer : buffers)
+		{
+			file << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+				 << buffer->tid << ",\"args\":{\"name\":\"" << buffer->name << "\"}}";
+			first = false;
+
+			for (const TraceEvent &event : buffer->events)
+			{
+				file << ",\n{\"name\":\"" << event.name << "\",\"cat\":\"" << event.category
+					 << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->tid
+					 << ",\"ts\":" << (event.start - startTime) / NS_PER_US
+					 << ",\"dur\":" << (event.end - event.start) / NS_PER_US;
+				if (event.arg != TRACE_NO_ARG)
+					file << ",\"args\":{\"arg\":" << event.arg << "}";
+				file << "}";
+			}
+		}
+		file << "\n]}\n";
+		file.close();
+	}
+
+	freeBuffers();
+	return !file.fail();
+}
@@ -0,0 +1,53 @@
+#ifndef MAPREDUCETRACE_H
+#define MAPREDUCETRACE_H
+
+#include <string>
+#include <stdint.h>
+
+/**
+ * Marks an event without an argument
+ */
+#define TRACE_NO_ARG (-1)
+
+/**
+ * Enables tracing for the current job and discards the events of the previous job
+ */
+void traceStart();
+
+/**
+ * @return true if the current job is traced, otherwise false
+ */
+bool traceEnabled();
+
+/**
+ * Returns the monotonic time in nanoseconds, or 0 when tracing is disabled so untraced jobs
+ * don't pay for reading the clock
+ * @return the time in nanoseconds
+ */
+uint64_t traceNow();
+
+/**
+ * Names the calling thread in the trace
+ * @param name the thread name, must be a string literal
+ */
+void traceThreadName(const char *name);
+
+/**
+ * Records an event of the calling thread that started at the given time and ends now.
+ * Events are kept in a per thread buffer, no lock is taken after the thread's first event.
+ * @param name the event name, must be a string literal
+ * @param category the event category, must be a string literal
+ * @param start the event start time returned by traceNow
+ * @param arg optional event argument, TRACE_NO_ARG if none
+ */
+void traceEvent(const char *name, const char *category, uint64_t start, long arg = TRACE_NO_ARG);
+
+/**
+ * Writes the recorded events in the Chrome trace event JSON format, the file can be loaded in
+ * chrome://tracing or Perfetto. Disables tracing and frees the events.
+ * @param path the trace file path
+ * @return true if successful, otherwise false
+ */
+bool traceWrite(const std::string &path);
+
+#endif //MAPREDUCETRACE_H
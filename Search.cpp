@@ -1,67 +1,345 @@
 #include <iostream>
 #include <algorithm>
-#include <dirent.h>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "Search.h"
+#include "AhoCorasick.h"
+#include "SearchServer.h"
 #include "MapReduceFramework.h"
 
 /**
  * @brief program usage message
  */
-#define MSG_USAGE "Usage: <substring to search> <folders, separated by space>"
+#define MSG_USAGE "Usage: <substring to search> <folders, separated by space>\n" \
+				  "       -e <substring> [-e <substring> ...] <folders, separated by space>\n" \
+				  "       -b <index file> <folders, separated by space>\n" \
+				  "       -i <index file> <substring to search>\n" \
+				  "       -d <socket>  serve searches on a Unix domain socket, caching the folder listings\n" \
+				  "       -s <socket> [options] <substring or -e substrings> <folders>  search through a -d server\n" \
+				  "Options, before the arguments above. -- ends them, a substring starting with -- follows it:\n" \
+				  "       --trace <file>       write a Chrome trace of the map reduce job\n" \
+				  "       --perf               log hardware performance counters per phase\n" \
+				  "       --async              list the folders asynchronously, io_uring or a thread pool\n" \
+				  "       --checkpoint <dir>   checkpoint the listed folders, a rerun resumes from it\n" \
+				  "       --top <count>        print only the count file names found in the most folders\n" \
+				  "       --speculate          list the folders of slow map chunks again on idle threads\n" \
+				  "       --costs <file>       list the slowest folders first, learning their times in the file\n" \
+				  "       --sort               group the file names by sorting instead of a shuffle thread\n" \
+				  "       --numeric            count the matches with the numeric reduce, implies --sort"
 
 /**
- * The substring the program searches for
+ * File names that appear in more folders than this are counted by several threads
  */
-std::string gSubString;
+#define SKEW_THRESHOLD 4096
+
+/**
+ * Number of file names the server keeps in its folder listing cache
+ */
+#define CACHE_NAMES (4 * 1024 * 1024)
+
+/**
+ * @brief pattern flag, may be repeated to search for several substrings in one pass
+ */
+#define FLAG_PATTERN "-e"
+
+/**
+ * @brief trace flag, followed by the trace file path
+ */
+#define FLAG_TRACE "--trace"
+
+/**
+ * @brief performance counters flag
+ */
+#define FLAG_PERF "--perf"
+
+/**
+ * @brief asynchronous map flag
+ */
+#define FLAG_ASYNC "--async"
+
+/**
+ * @brief cost file flag, followed by the cost file path
+ */
+#define FLAG_COSTS "--costs"
+
+/**
+ * @brief speculative map flag
+ */
+#define FLAG_SPECULATE "--speculate"
+
+/**
+ * @brief checkpoint flag, followed by the checkpoint directory
+ */
+#define FLAG_CHECKPOINT "--checkpoint"
+
+/**
+ * @brief top file names flag, followed by the number of file names to print
+ */
+#define FLAG_TOP "--top"
+
+/**
+ * @brief sort shuffle flag
+ */
+#define FLAG_SORT "--sort"
+
+/**
+ * @brief numeric reduce flag
+ */
+#define FLAG_NUMERIC "--numeric"
+
+/**
+ * @brief ends the options, the next argument is read as a substring or a mode flag
+ */
+#define FLAG_END_OPTIONS "--"
+
+/**
+ * @brief prefix of the options, arguments starting with it before FLAG_END_OPTIONS are options
+ */
+#define OPTION_PREFIX "--"
+
+/**
+ * @brief server mode flag, followed by the socket path
+ */
+#define FLAG_SERVER "-d"
+
+/**
+ * @brief client mode flag, followed by the server socket path and the search arguments
+ */
+#define FLAG_CLIENT "-s"
+
+/**
+ * @brief build index mode flag
+ */
+#define FLAG_BUILD_INDEX "-b"
+
+/**
+ * @brief query index mode flag
+ */
+#define FLAG_QUERY_INDEX "-i"
+
+/**
+ * FNV-1a 64 bit parameters
+ */
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+/**
+ * The substrings the program searches for
+ */
+std::vector<std::string> gPatterns;
+
+/**
+ * Matches all the patterns in a file name in a single pass
+ */
+AhoCorasick gMatcher;
+
+/**
+ * Map reduce framework options shared by all the modes
+ */
+MapReduceOptions gFrameworkOptions;
+
+/**
+ * Number of file names a search prints, the ones found in the most folders, 0 prints all
+ */
+size_t gTopFiles = 0;
+
+/**
+ * If true the matches are counted by the framework's numeric reduce instead of Value2 objects
+ */
+bool gNumeric = false;
+
+/**
+ * File of the folder listing times measured by earlier searches, empty if not used
+ */
+std::string gCostFile;
+
+/**
+ * Folder listings kept by the server between queries
+ */
+DirectoryCache gDirectoryCache(CACHE_NAMES);
 
 /**
  * Vector of k1Base*, v1Base pairs that are sent to the map reduce framework function
  */
 IN_ITEMS_VEC inItemsVector;
 
+/**
+ * Parses a positive decimal count
+ * @param arg the argument
+ * @param count set to the count
+ * @return true if the argument is a positive count, otherwise false
+ */
+static bool parseCount(const char *arg, size_t &count)
+{
+	if (*arg < '0' || *arg > '9')
+		return false;
+
+	char* end;
+	errno = 0;
+	unsigned long value = strtoul(arg, &end, 10);
+	if (errno != 0 || *end != '\0' || value == 0)
+		return false;
+	count = value;
+	return true;
+}
+
+/**
+ * Sums the given Value2 objects
+ * @param vals the values to sum
+ * @return the sum
+ */
+static int sumValues(const V2_RANGE &vals)
+{
+	int sum = 0;
+
+	for (auto b = vals.begin(); b != vals.end(); ++b)
+		sum += ((Value2*)(*b))->value;
+
+	return sum;
+}
+
+/**
+ * Orders the search output by the number of folders a file name was found in
+ * @param lhs a Value3 object
+ * @param rhs a Value3 object
+ * @return true if lhs is less than rhs, otherwise false
+ */
+static bool value3Less(const v3Base *lhs, const v3Base *rhs)
+{
+	return ((Value3*)lhs)->value < ((Value3*)rhs)->value;
+}
 
 /**
- * Map method
+ * Serializes a Key2, Value2 pair as the pattern index, the value and the file name
  * @param key
  * @param val
+ * @param out the bytes are appended to it
  */
-void MapReduce::Map(const k1Base *const key, const v1Base *const val) const
+static void serializePair(const k2Base *const key, const v2Base *const val, std::string &out)
 {
+	const Key2* key2 = (Key2*)key;
+	int header[2] = {key2->pattern, ((Value2*)val)->value};
 
-	// open directory
-	DIR* dirp = opendir(((Key1*)key)->key.c_str());
-	struct dirent* dirstruct;
+	out.append((const char*)header, sizeof(header));
+	out.append(key2->key.c_str(), key2->key.size());
+}
 
+/**
+ * Creates a Key2, Value2 pair serialized by serializePair
+ * @param data the serialized pair
+ * @param size number of bytes
+ * @param key the new key
+ * @param val the new value
+ * @return true if successful, otherwise false
+ */
+static bool deserializePair(const char *data, size_t size, k2Base *&key, v2Base *&val)
+{
+	int header[2];
+	if (size < sizeof(header))
+		return false;
+
+	memcpy(header, data, sizeof(header));
+	key = new Key2(InternedString(data + sizeof(header), size - sizeof(header)), header[0]);
+	val = new Value2(header[1]);
+	return true;
+}
+
+static void emitMatches(const MapReduce &job, const std::vector<std::string> &entries);
+
+/**
+ * Map method, lists the folder
+ * @param key
+ * @param val
+ * @return the folder listing request
+ */
+AsyncRequest MapReduce::MapRequest(const k1Base *const key, const v1Base *const val) const
+{
+	(void)val;
+	return AsyncRequest(ASYNC_LIST_DIR, ((Key1*)key)->key);
+}
+
+/**
+ * Map method, emits the file names of the listed folder that contain a substring
+ * @param key
+ * @param val
+ * @param result the folder listing
+ */
+void MapReduce::MapComplete(const k1Base *const key, const v1Base *const val, const AsyncResult &result) const
+{
+	(void)key;
+	(void)val;
 	// return if directory doesn't exists
-	if (dirp == NULL)
+	if (result.error != 0)
 		return;
 
-	// iterate over directory files
-	dirstruct = readdir(dirp);
-	while (dirstruct != NULL)
-	{
+	emitMatches(*this, result.entries);
+}
 
-		std::string filename = dirstruct->d_name;
-		Key2* key2 = new Key2(std::string(filename));
-		Value2* value2;
+/**
+ * Server map method, the listing comes from the cache
+ * @param key
+ * @param val
+ * @return no request
+ */
+AsyncRequest CachedMapReduce::MapRequest(const k1Base *const key, const v1Base *const val) const
+{
+	(void)key;
+	(void)val;
+	return AsyncRequest();
+}
 
-		// search for substring in file names
-		std::size_t found = (filename).find(gSubString);
-		if (found != std::string::npos)
-		{
-			value2 = new Value2(1);
-			Emit2(key2, value2);	// found substring
-		}
-		else
+/**
+ * Server map method, emits the file names of the cached folder listing that contain a substring
+ * @param key
+ * @param val
+ * @param result empty
+ */
+void CachedMapReduce::MapComplete(const k1Base *const key, const v1Base *const val, const AsyncResult &result) const
+{
+	(void)val;
+	(void)result;
+	DIRECTORY_LISTING listing = gDirectoryCache.get(((Key1*)key)->key);
+
+	// return if directory doesn't exists
+	if (listing == nullptr)
+		return;
+
+	emitMatches(*this, *listing);
+}
+
+/**
+ * Emits the file names that contain a substring
+ * @param job the job, emits numeric values if it is numeric
+ * @param entries the file names of a folder
+ */
+static void emitMatches(const MapReduce &job, const std::vector<std::string> &entries)
+{
+	std::vector<int> matched;
+
+	// iterate over directory files
+	for (const std::string &filename : entries)
+	{
+		// search for all the substrings in the file name, only matches are emitted
+		gMatcher.match(filename, matched);
+		if (!matched.empty())
 		{
-			value2 = new Value2(0);
-			Emit2(key2, value2);	// didn't find substring
+			InternedString name(filename);
+			for (int pattern : matched)
+			{
+				if (job.numeric)
+					Emit2Numeric(new Key2(name, pattern), 1);
+				else
+					Emit2(new Key2(name, pattern), new Value2(1));
+			}
 		}
-		// get next file
-		dirstruct = readdir(dirp);
 	}
-	// close directory
-	closedir(dirp);
 }
 
 /**
@@ -71,32 +349,226 @@ void MapReduce::Map(const k1Base *const key, const v1Base *const val) const
  */
 void MapReduce::Reduce(const k2Base *const key, const V2_VEC &vals) const
 {
-	int sum = 0;
+	ReduceRange(key, V2_RANGE(vals));
+}
 
-	for (auto b = vals.begin(); b != vals.end(); ++b)
-		sum += ((Value2*)(*b))->value;
+/**
+ * Reduce method for values grouped in place
+ * @param key
+ * @param vals
+ */
+void MapReduce::ReduceRange(const k2Base *const key, const V2_RANGE &vals) const
+{
+	int sum = sumValues(vals);
 
-	std::string filename = (((Key2*)key)->key);
+	std::string filename = (((Key2*)key)->key).str();
 
-	Key3* key3 = new Key3(std::string(filename));
+	Key3* key3 = new Key3(filename, ((Key2*)key)->pattern);
 	Value3* value3 = new Value3(sum);
 
 	Emit3(key3, value3);
 }
 
 /**
- * Print the given vector
+ * The matches of a numeric job are summed by the framework
+ * @return NUMERIC_SUM or NUMERIC_NONE
+ */
+NumericReduceOp MapReduce::NumericOp() const
+{
+	return numeric ? NUMERIC_SUM : NUMERIC_NONE;
+}
+
+/**
+ * Reduce method of the numeric job
+ * @param key
+ * @param result the number of matches
+ * @param count
+ */
+void MapReduce::ReduceNumeric(const k2Base *const key, int64_t result, size_t count) const
+{
+	// every value is 1, the sum is the count and is kept in an int like the other reduce methods
+	(void)count;
+	int sum = (result > INT_MAX) ? INT_MAX : (int)result;
+
+	std::string filename = (((Key2*)key)->key).str();
+
+	Emit3(new Key3(filename, ((Key2*)key)->pattern), new Value3(sum));
+}
+
+/**
+ * Every value of a file name is 1, so its count is at most the number of values
+ * @param key
+ * @param nValues
+ * @param threshold the Value3 a file name must reach
+ * @return true if the file name can reach the threshold, otherwise false
+ */
+bool MapReduce::CanReachTop(const k2Base *const key, size_t nValues, const v3Base *const threshold) const
+{
+	(void)key;
+	return nValues >= (size_t)((Value3*)threshold)->value;
+}
+
+/**
+ * Combine method, sums part of a file name's values
+ * @param key
+ * @param vals
+ * @return a new Value2 holding the partial sum
+ */
+v2Base *MapReduce::Combine(const k2Base *const key, const V2_RANGE &vals) const
+{
+	(void)key;
+	return new Value2(sumValues(vals));
+}
+
+/**
+ * Checkpoint serialization of the intermediate pairs
+ * @param key
+ * @param val
+ * @param out
+ * @return always true
+ */
+bool MapReduce::SerializeK2V2(const k2Base *const key, const v2Base *const val, std::string &out) const
+{
+	serializePair(key, val, out);
+	return true;
+}
+
+/**
+ * Checkpoint deserialization of the intermediate pairs
+ * @param data
+ * @param size
+ * @param key
+ * @param val
+ * @return true if successful, otherwise false
+ */
+bool MapReduce::DeserializeK2V2(const char *data, size_t size, k2Base *&key, v2Base *&val) const
+{
+	return deserializePair(data, size, key, val);
+}
+
+/**
+ * Index job map method, lists the folder
+ * @param key
+ * @param val
+ * @return the folder listing request
+ */
+AsyncRequest IndexMapReduce::MapRequest(const k1Base *const key, const v1Base *const val) const
+{
+	(void)val;
+	return AsyncRequest(ASYNC_LIST_DIR, ((Key1*)key)->key);
+}
+
+/**
+ * Index job map method, emits every file name in the listed folder
+ * @param key
+ * @param val
+ * @param result the folder listing
+ */
+void IndexMapReduce::MapComplete(const k1Base *const key, const v1Base *const val, const AsyncResult &result) const
+{
+	(void)key;
+	(void)val;
+	// return if directory doesn't exists
+	if (result.error != 0)
+		return;
+
+	for (const std::string &filename : result.entries)
+		Emit2(new Key2(InternedString(filename)), new Value2(1));
+}
+
+/**
+ * Index job reduce method
+ * @param key
+ * @param vals
+ */
+void IndexMapReduce::Reduce(const k2Base *const key, const V2_VEC &vals) const
+{
+	ReduceRange(key, V2_RANGE(vals));
+}
+
+/**
+ * Index job reduce method for values grouped in place, counts the folders the file name
+ * appeared in and extracts its trigrams
+ * @param key
+ * @param vals
+ */
+void IndexMapReduce::ReduceRange(const k2Base *const key, const V2_RANGE &vals) const
+{
+	int sum = sumValues(vals);
+
+	std::string filename = (((Key2*)key)->key).str();
+
+	IndexValue3* value3 = new IndexValue3(sum);
+	extractTrigrams(filename, value3->trigrams);
+
+	Emit3(new Key3(filename), value3);
+}
+
+/**
+ * Index job combine method, sums part of a file name's values
+ * @param key
+ * @param vals
+ * @return a new Value2 holding the partial sum
+ */
+v2Base *IndexMapReduce::Combine(const k2Base *const key, const V2_RANGE &vals) const
+{
+	(void)key;
+	return new Value2(sumValues(vals));
+}
+
+/**
+ * Index job checkpoint serialization of the intermediate pairs
+ * @param key
+ * @param val
+ * @param out
+ * @return always true
+ */
+bool IndexMapReduce::SerializeK2V2(const k2Base *const key, const v2Base *const val, std::string &out) const
+{
+	serializePair(key, val, out);
+	return true;
+}
+
+/**
+ * Index job checkpoint deserialization of the intermediate pairs
+ * @param data
+ * @param size
+ * @param key
+ * @param val
+ * @return true if successful, otherwise false
+ */
+bool IndexMapReduce::DeserializeK2V2(const char *data, size_t size, k2Base *&key, v2Base *&val) const
+{
+	return deserializePair(data, size, key, val);
+}
+
+/**
+ * Print the given vector, when searching for several substrings each substring
+ * is printed on its own line followed by its file names
  * @param vec the vector to print
+ * @param out the output stream
  */
-static void printResult(OUT_ITEMS_VEC vec)
+static void printResult(const OUT_ITEMS_VEC &vec, std::ostream &out)
 {
+	int pattern = -1;
 	for (const OUT_ITEM &p : vec)
 	{
-		std::string filename = ((Key3*)p.first)->key;
+		Key3* key3 = (Key3*)p.first;
+		if (gPatterns.size() > 1 && key3->pattern != pattern)
+		{
+			if (pattern != -1)
+				out << std::endl;
+			pattern = key3->pattern;
+			out << gPatterns[pattern] << ": ";
+		}
+
+		std::string filename = key3->key;
 		int nTimesAppeared = ((Value3*)p.second)->value;
 		for (int i = 0; i < nTimesAppeared; ++i)
-			std::cout << filename << " ";
+			out << filename << " ";
 	}
+	if (pattern != -1)
+		out << std::endl;
 }
 
 /**
@@ -109,32 +581,234 @@ static void freeInItemsVec()
 		delete ((Key1*) pair.first);
 		delete ((Value1*) pair.second);
 	}
+	inItemsVector.clear();
 }
 
 /**
- * @brief Main function
+ * Hashes the substrings and the folders of inItemsVector, a checkpoint written for other ones is
+ * ignored
+ * @param patterns the substrings, empty for the index job
+ * @return FNV-1a hash of the strings, each followed by a null byte
+ */
+static uint64_t checkpointFingerprint(const std::vector<std::string> &patterns)
+{
+	std::string data;
+	for (const std::string &pattern : patterns)
+		data.append(pattern.c_str(), pattern.size() + 1);
+	// the arguments never hold a null byte, so an empty string separates the lists
+	data.push_back('\0');
+	for (const IN_ITEM &item : inItemsVector)
+		data.append(((Key1*)item.first)->key.c_str(), ((Key1*)item.first)->key.size() + 1);
+
+	uint64_t hash = FNV_OFFSET;
+	for (char c : data)
+		hash = (hash ^ (unsigned char)c) * FNV_PRIME;
+	return hash;
+}
+
+/**
+ * Reads the cost file, every line is a listing time in nanoseconds and a folder path
+ * @param costs the times by folder path
+ */
+static void readCostFile(std::map<std::string, uint64_t> &costs)
+{
+	std::ifstream file(gCostFile.c_str());
+	uint64_t cost;
+	std::string folder;
+	while (file >> cost && file.get() == '\t' && std::getline(file, folder))
+		costs[folder] = cost;
+}
+
+/**
+ * Estimates the listing time of every folder of inItemsVector. A folder listed before gets its
+ * measured time, the others their directory size scaled by the time per byte of the measured
+ * folders. This assumes a folder's st_size is proportional to the work of listing it, which holds
+ * where the directory size grows with its entries (e.g. ext4, btrfs). Where it doesn't, such as
+ * small XFS folders stored inline or file systems that report a fixed size, unmeasured folders
+ * cost about the same and only the measured times order the items.
+ * @param costs the estimates in the order of inItemsVector
+ */
+static void estimateCosts(std::vector<uint64_t> &costs)
+{
+	std::map<std::string, uint64_t> measured;
+	readCostFile(measured);
+
+	std::vector<uint64_t> sizes;
+	uint64_t measuredTime = 0, measuredSize = 0;
+	for (const IN_ITEM &item : inItemsVector)
+	{
+		const std::string &folder = ((Key1*)item.first)->key;
+		struct stat st;
+		sizes.push_back(stat(folder.c_str(), &st) == 0 ? (uint64_t)st.st_size : 0);
+
+		auto found = measured.find(folder);
+		costs.push_back(found != measured.end() ? found->second : 0);
+		if (found != measured.end())
+		{
+			measuredTime += found->second;
+			measuredSize += sizes.back();
+		}
+	}
+
+	for (size_t i = 0; i < costs.size(); ++i)
+	{
+		if (measured.count(((Key1*)inItemsVector[i].first)->key) != 0)
+			continue;
+		costs[i] = (measuredSize > 0) ? (uint64_t)((double)sizes[i] * measuredTime / measuredSize) : sizes[i];
+	}
+}
+
+/**
+ * Stores the listing times of the folders of inItemsVector in the cost file, keeping the times of
+ * other folders
+ * @param times the times in the order of inItemsVector
+ */
+static void writeCostFile(const std::vector<uint64_t> &times)
+{
+	std::map<std::string, uint64_t> costs;
+	readCostFile(costs);
+	for (size_t i = 0; i < times.size(); ++i)
+		costs[((Key1*)inItemsVector[i].first)->key] = times[i];
+
+	// write to a temporary file and rename it, so an interrupted run never leaves a truncated file
+	std::string tmpPath = gCostFile + ".tmp";
+	std::ofstream file(tmpPath.c_str(), std::ios::out | std::ios::trunc);
+	for (const auto &cost : costs)
+		file << cost.second << '\t' << cost.first << '\n';
+	file.close();
+	if (file.fail() || rename(tmpPath.c_str(), gCostFile.c_str()) != 0)
+	{
+		std::cerr << "Failed to write cost file " << gCostFile << std::endl;
+		unlink(tmpPath.c_str());
+	}
+}
+
+/**
+ * Builds a trigram index of the file names in the given folders
  * @param argc number of arguments
- * @param argv[] command line arguments
+ * @param argv[] command line arguments, the index path followed by the folders
  * @return 0 if successful otherwise 1
  */
-int main(int argc, char* argv[])
+static int buildIndex(int argc, char* argv[])
 {
-	if (argc == 1)
+	if (argc < 3)
 	{
 		std::cerr << MSG_USAGE << std::endl;
 		return 1;
 	}
 
-	gSubString = argv[1];
+	std::string indexPath = argv[2];
+	TrigramIndexWriter writer;
+
+	if (argc > 3)
+	{
+		IndexMapReduce indexMapReduce;
+
+		for (int i = 3; i < argc; ++i)
+		{
+			k1Base* key = (k1Base*) new Key1(std::string(argv[i]));
+			v1Base* value = (v1Base*) new Value1(nullptr);
+
+			inItemsVector.push_back(std::make_pair(key, value));
+		}
+
+		int multiThreadLevel = argc - 3;
+
+		MapReduceOptions options = gFrameworkOptions;
+		options.checkpointFingerprint = checkpointFingerprint(std::vector<std::string>());
+		OUT_ITEMS_VEC outItemsVector = RunMapReduceFramework(indexMapReduce, inItemsVector,
+															 multiThreadLevel, true, options);
+
+		// the output is sorted by file name, so the position is the file id
+		for (const OUT_ITEM &p : outItemsVector)
+		{
+			IndexValue3* value3 = (IndexValue3*)p.second;
+			writer.add(((Key3*)p.first)->key, value3->value, value3->trigrams);
+
+			delete ((Key3*)p.first);
+			delete value3;
+		}
+
+		freeInItemsVec();
+	}
+
+	if (!writer.write(indexPath))
+	{
+		std::cerr << "Failed to write index " << indexPath << std::endl;
+		return 1;
+	}
+	return 0;
+}
 
-	if (argc == 2)	// no folders specified
+/**
+ * Searches a trigram index built by buildIndex for file names containing a substring
+ * @param argc number of arguments
+ * @param argv[] command line arguments, the index path followed by the substring
+ * @return 0 if successful otherwise 1
+ */
+static int queryIndex(int argc, char* argv[])
+{
+	if (argc != 4)
+	{
+		std::cerr << MSG_USAGE << std::endl;
+		return 1;
+	}
+
+	TrigramIndex index;
+	if (!index.open(argv[2]))
+	{
+		std::cerr << "Failed to open index " << argv[2] << std::endl;
+		return 1;
+	}
+
+	std::vector<INDEX_MATCH> matches;
+	index.query(std::string(argv[3]), matches);
+
+	for (const INDEX_MATCH &match : matches)
+		for (int i = 0; i < match.second; ++i)
+			std::cout << match.first << " ";
+
+	return 0;
+}
+
+/**
+ * Searches the folders for file names containing the substrings and prints them
+ * @param argc number of arguments
+ * @param argv[] command line arguments, the substrings followed by the folders
+ * @param mapReduce the job
+ * @param maxThreads maximal thread level, 0 for a thread per folder
+ * @param out the output stream
+ * @return 0 if successful, 1 if the arguments are invalid
+ */
+static int search(int argc, char* argv[], MapReduce &mapReduce, int maxThreads, std::ostream &out)
+{
+	gPatterns.clear();
+
+	// collect the substrings, either a single positional one or any number of -e flags
+	int firstFolder = 1;
+	if (strcmp(argv[1], FLAG_PATTERN) == 0)
+	{
+		while (firstFolder + 1 < argc && strcmp(argv[firstFolder], FLAG_PATTERN) == 0)
+		{
+			gPatterns.push_back(std::string(argv[firstFolder + 1]));
+			firstFolder += 2;
+		}
+		if (gPatterns.empty())
+			return 1;
+	}
+	else
+	{
+		gPatterns.push_back(std::string(argv[1]));
+		firstFolder = 2;
+	}
+
+	if (firstFolder >= argc)	// no folders specified
 		return 0;
 
-	// initialized the class containing the Map & Reduce methods
-	MapReduce mapReduce;
+	gMatcher.build(gPatterns);
 
 	// create <folder, null> list
-	for (int i = 2; i < argc; ++i)
+	for (int i = firstFolder; i < argc; ++i)
 	{
 		k1Base* key = (k1Base*) new Key1(std::string(argv[i]));
 		v1Base* value = (v1Base*) new Value1(nullptr);
@@ -142,13 +816,198 @@ int main(int argc, char* argv[])
 		inItemsVector.push_back(std::make_pair(key, value));
 	}
 
-	int multiThreadLevel = argc - 2;
+	int multiThreadLevel = argc - firstFolder;
+	if (maxThreads > 0)
+		multiThreadLevel = std::min(multiThreadLevel, maxThreads);
 
-	OUT_ITEMS_VEC outItemsVector = RunMapReduceFramework(mapReduce, inItemsVector, multiThreadLevel, true);
+	// chunk files hold v2 objects, a checkpointed search emits them instead of numbers
+	MapReduceOptions options = gFrameworkOptions;
+	mapReduce.numeric = gNumeric && options.checkpointDir.empty();
+	if (mapReduce.numeric)
+	{
+		// numeric jobs group by sorting and reduce a key's values in one pass
+		options.shuffleMode = SHUFFLE_SORT;
+		options.skewThreshold = 0;
+	}
+	options.checkpointFingerprint = checkpointFingerprint(gPatterns);
+	options.outputLimit = gTopFiles;
+	options.outputValueLess = &value3Less;
+	std::vector<uint64_t> times;
+	if (!gCostFile.empty())
+	{
+		estimateCosts(options.itemCosts);
+		options.itemTimes = &times;
+	}
+	OUT_ITEMS_VEC outItemsVector = RunMapReduceFramework(mapReduce, inItemsVector, multiThreadLevel,
+														 true, options);
+	if (!gCostFile.empty())
+		writeCostFile(times);
 
 	// print all the file names
-	printResult(outItemsVector);
+	printResult(outItemsVector, out);
 
+	for (const OUT_ITEM &p : outItemsVector)
+	{
+		delete ((Key3*)p.first);
+		delete ((Value3*)p.second);
+	}
 	freeInItemsVec();
 	return 0;
 }
+
+/**
+ * Reads the options that precede the search arguments. Options start with OPTION_PREFIX, so
+ * the original <substring> <folders> form is only read as options if the substring starts with
+ * it, and such a substring can follow FLAG_END_OPTIONS.
+ * @param argc number of arguments, decreased by the number of options
+ * @param argv command line arguments, advanced past the options
+ * @return true if successful, false if an option is unknown or invalid
+ */
+static bool parseOptions(int &argc, char** &argv)
+{
+	while (argc > 1 && strncmp(argv[1], OPTION_PREFIX, strlen(OPTION_PREFIX)) == 0)
+	{
+		const char* option = argv[1];
+		const char* value = (argc > 2) ? argv[2] : nullptr;
+		int used = 1;
+
+		if (strcmp(option, FLAG_END_OPTIONS) == 0)
+		{
+			argc--;
+			argv++;
+			break;
+		}
+
+		if (strcmp(option, FLAG_PERF) == 0)
+			gFrameworkOptions.perfCounters = true;
+		else if (strcmp(option, FLAG_SPECULATE) == 0)
+			gFrameworkOptions.speculativeMap = true;
+		else if (strcmp(option, FLAG_ASYNC) == 0)
+			gFrameworkOptions.asyncMap = true;
+		else if (strcmp(option, FLAG_SORT) == 0)
+			gFrameworkOptions.shuffleMode = SHUFFLE_SORT;
+		else if (strcmp(option, FLAG_NUMERIC) == 0)
+			gNumeric = true;
+		else if (value == nullptr)	// the options below take a value
+			return false;
+		else
+		{
+			used = 2;
+			if (strcmp(option, FLAG_TRACE) == 0)
+				gFrameworkOptions.traceFile = value;
+			else if (strcmp(option, FLAG_CHECKPOINT) == 0)
+				gFrameworkOptions.checkpointDir = value;
+			else if (strcmp(option, FLAG_COSTS) == 0)
+				gCostFile = value;
+			else if (strcmp(option, FLAG_TOP) != 0 || !parseCount(value, gTopFiles))
+				return false;
+		}
+
+		argc -= used;
+		argv += used;
+	}
+	return true;
+}
+
+/**
+ * Runs a search received by the server against the cached folder listings
+ * @param args the search arguments
+ * @param out the search output
+ * @return 0 if successful otherwise 1
+ */
+static int serveQuery(const std::vector<std::string> &args, std::ostream &out)
+{
+	std::vector<char*> argv;
+	argv.push_back((char*)"Search");
+	for (const std::string &arg : args)
+		argv.push_back((char*)arg.c_str());
+	argv.push_back(nullptr);
+
+	// the query's options apply to it alone, the server's are restored after it
+	MapReduceOptions serverOptions = gFrameworkOptions;
+	size_t serverTopFiles = gTopFiles;
+	std::string serverCostFile = gCostFile;
+	bool serverNumeric = gNumeric;
+	int argc = (int)argv.size() - 1;
+	char** queryArgv = argv.data();
+	bool valid = parseOptions(argc, queryArgv) && argc >= 3;
+
+	// the listings are in memory, more threads than cores don't help
+	CachedMapReduce mapReduce;
+	int maxThreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	valid = valid && search(argc, queryArgv, mapReduce, maxThreads, out) == 0;
+	gFrameworkOptions = serverOptions;
+	gTopFiles = serverTopFiles;
+	gCostFile = serverCostFile;
+	gNumeric = serverNumeric;
+	if (!valid)
+	{
+		out << MSG_USAGE;
+		return 1;
+	}
+
+	size_t hits, misses;
+	gDirectoryCache.takeStats(hits, misses);
+	std::clog << "Search: " << hits << " cached and " << misses << " listed folders" << std::endl;
+	return 0;
+}
+
+/**
+ * @brief Main function
+ * @param argc number of arguments
+ * @param argv[] command line arguments
+ * @return 0 if successful otherwise 1
+ */
+int main(int argc, char* argv[])
+{
+	gFrameworkOptions.skewThreshold = SKEW_THRESHOLD;
+
+	// options come first, skip them so the modes see their own arguments at argv[1]
+	if (!parseOptions(argc, argv))
+	{
+		std::cerr << MSG_USAGE << std::endl;
+		return 1;
+	}
+
+	if (argc == 1)
+	{
+		std::cerr << MSG_USAGE << std::endl;
+		return 1;
+	}
+
+	if (strcmp(argv[1], FLAG_BUILD_INDEX) == 0)
+		return buildIndex(argc, argv);
+
+	if (strcmp(argv[1], FLAG_QUERY_INDEX) == 0)
+		return queryIndex(argc, argv);
+
+	if (strcmp(argv[1], FLAG_SERVER) == 0)
+	{
+		if (argc != 3)
+		{
+			std::cerr << MSG_USAGE << std::endl;
+			return 1;
+		}
+		// the queries' jobs reuse the threads of the earlier ones
+		gFrameworkOptions.keepThreads = true;
+		return runServer(argv[2], &serveQuery);
+	}
+
+	if (strcmp(argv[1], FLAG_CLIENT) == 0)
+	{
+		if (argc < 4)
+		{
+			std::cerr << MSG_USAGE << std::endl;
+			return 1;
+		}
+		return runClient(argv[2], std::vector<std::string>(argv + 3, argv + argc));
+	}
+
+	MapReduce mapReduce;
+	if (search(argc, argv, mapReduce, 0, std::cout) != 0)
+	{
+		std::cerr << MSG_USAGE << std::endl;
+		return 1;
+	}
+	return 0;
+}
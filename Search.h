@@ -6,7 +6,10 @@
 #define MAPREDUCE2_SEARCH_H
 
 #include <string>
+#include <vector>
 #include "MapReduceClient.h"
+#include "InternedString.h"
+#include "TrigramIndex.h"
 
 /**
  * @brief Folder key class
@@ -32,15 +35,23 @@ struct Value1: public v1Base {
 	~Value1() {}
 };
 
+/**
+ * File name key, pattern is the index of the matched pattern.
+ * The file name is interned so duplicate names emitted by different folders share one copy.
+ */
 struct Key2 : public k2Base
 {
-	std::string key;
-	Key2(std::string filename) : key(filename) {}
-	Key2(Key2 &key2) : key(key2.key) {}
+	InternedString key;
+	int pattern;
+	Key2(const InternedString &filename, int pattern = 0) : key(filename), pattern(pattern) {}
+	Key2(Key2 &key2) : key(key2.key), pattern(key2.pattern) {}
 	~Key2() {}
 	virtual bool operator<(const k2Base &other) const
 	{
-		return key < ((Key2*)(&other))->key;
+		const Key2* otherKey = (Key2*)(&other);
+		if (pattern != otherKey->pattern)
+			return pattern < otherKey->pattern;
+		return key < otherKey->key;
 	}
 };
 
@@ -52,15 +63,22 @@ struct Value2 : public v2Base
 	~Value2() {}
 };
 
+/**
+ * File name key, pattern is the index of the matched pattern
+ */
 struct Key3 : public k3Base
 {
 	std::string key;
-	Key3(std::string filename) : key(filename) {}
-	Key3(Key3 &key3) : key(key3.key) {}
+	int pattern;
+	Key3(std::string filename, int pattern = 0) : key(filename), pattern(pattern) {}
+	Key3(Key3 &key3) : key(key3.key), pattern(key3.pattern) {}
 	~Key3() {}
 	virtual bool operator<(const k3Base &other) const
 	{
-		return key < ((Key3*)(&other))->key;
+		const Key3* otherKey = (Key3*)(&other);
+		if (pattern != otherKey->pattern)
+			return pattern < otherKey->pattern;
+		return key < otherKey->key;
 	}
 };
 
@@ -75,10 +93,64 @@ struct Value3 : public v3Base
 /**
  * Class containing the Map and Reduce methods
  */
-struct MapReduce : public MapReduceBase
+struct MapReduce : public AsyncMapReduceBase
 {
-	virtual void Map(const k1Base *const key, const v1Base *const val) const;
+	MapReduce() : numeric(false) {}
+
+	virtual AsyncRequest MapRequest(const k1Base *const key, const v1Base *const val) const;
+	virtual void MapComplete(const k1Base *const key, const v1Base *const val, const AsyncResult &result) const;
     virtual void Reduce(const k2Base *const key, const V2_VEC &vals) const;
+	virtual void ReduceRange(const k2Base *const key, const V2_RANGE &vals) const;
+	virtual bool IsAssociative() const { return true; }
+	virtual bool IsIdempotent() const { return true; }
+	virtual v2Base *Combine(const k2Base *const key, const V2_RANGE &vals) const;
+	virtual NumericReduceOp NumericOp() const;
+	virtual void ReduceNumeric(const k2Base *const key, int64_t result, size_t count) const;
+	virtual bool CanReachTop(const k2Base *const key, size_t nValues, const v3Base *const threshold) const;
+	virtual bool SerializeK2V2(const k2Base *const key, const v2Base *const val, std::string &out) const;
+	virtual bool DeserializeK2V2(const char *data, size_t size, k2Base *&key, v2Base *&val) const;
+
+	/**
+	 * If true Map emits the matches with Emit2Numeric and the framework sums them, otherwise with
+	 * Emit2 and Value2 objects
+	 */
+	bool numeric;
+};
+
+/**
+ * Search server job, reads the folder listings from the directory cache instead of listing them
+ */
+struct CachedMapReduce : public MapReduce
+{
+	virtual AsyncRequest MapRequest(const k1Base *const key, const v1Base *const val) const;
+	virtual void MapComplete(const k1Base *const key, const v1Base *const val, const AsyncResult &result) const;
+};
+
+/**
+ * Index job output value, the number of folders a file name appeared in and its trigrams
+ */
+struct IndexValue3 : public v3Base
+{
+	int value;
+	std::vector<TRIGRAM> trigrams;
+	IndexValue3(int v) : value(v) {}
+	~IndexValue3() {}
+};
+
+/**
+ * Class containing the Map and Reduce methods of the index building job
+ */
+struct IndexMapReduce : public AsyncMapReduceBase
+{
+	virtual AsyncRequest MapRequest(const k1Base *const key, const v1Base *const val) const;
+	virtual void MapComplete(const k1Base *const key, const v1Base *const val, const AsyncResult &result) const;
+	virtual void Reduce(const k2Base *const key, const V2_VEC &vals) const;
+	virtual void ReduceRange(const k2Base *const key, const V2_RANGE &vals) const;
+	virtual bool IsAssociative() const { return true; }
+	virtual bool IsIdempotent() const { return true; }
+	virtual v2Base *Combine(const k2Base *const key, const V2_RANGE &vals) const;
+	virtual bool SerializeK2V2(const k2Base *const key, const v2Base *const val, std::string &out) const;
+	virtual bool DeserializeK2V2(const char *data, size_t size, k2Base *&key, v2Base *&val) const;
 };
 
 #endif //MAPREDUCE2_SEARCH_H
@@ -0,0 +1,414 @@
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "SearchServer.h"
+
+//--------------------------------------- Definitions ----------------------------------------------
+/**
+ * Largest query the server reads, in bytes
+ */
+#define MAX_QUERY (1024 * 1024)
+
+/**
+ * Seconds a client may take to send its query or read the reply before the server drops it
+ */
+#define CLIENT_TIMEOUT 5
+
+/**
+ * Buffer size of socket reads
+ */
+#define READ_BUFFER 65536
+
+/**
+ * Reply status bytes
+ */
+#define STATUS_OK '0'
+#define STATUS_ERROR '1'
+
+/**
+ * Reply to a query whose worker process exited
+ */
+#define MSG_QUERY_FAILED "Search: the server failed to run the query"
+
+/**
+ * Seconds the server waits before it replaces a worker that exited
+ */
+#define RESTART_DELAY 1
+
+//---------------------------------------------------------------------------------------------------
+
+/**
+ * The client whose query the worker process runs, -1 between queries
+ */
+static int gQueryClient = -1;
+
+/**
+ * Prints a failed system call and its errno
+ * @param functionName the name of the failed function
+ */
+static void printError(const std::string &functionName)
+{
+	std::cerr << "Search: " << functionName << " failed: " << strerror(errno) << std::endl;
+}
+
+/**
+ * @param lhs a timestamp
+ * @param rhs a timestamp
+ * @return true if the timestamps are equal, otherwise false
+ */
+static bool sameTime(const struct timespec &lhs, const struct timespec &rhs)
+{
+	return lhs.tv_sec == rhs.tv_sec && lhs.tv_nsec == rhs.tv_nsec;
+}
+
+/**
+ * Writes the whole buffer to a socket
+ * @param fd the socket
+ * @param data the buffer
+ * @param size number of bytes
+ * @return true if successful, otherwise false
+ */
+static bool writeAll(int fd, const char *data, size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t count = write(fd, data, size);
+		if (count == -1 && errno == EINTR)
+			continue;
+		if (count == -1)
+			return false;
+		data += count;
+		size -= count;
+	}
+	return true;
+}
+
+/**
+ * Reads from a socket until the peer shuts down its side, fails when a receive timeout expires
+ * @param fd the socket
+ * @param data the bytes read
+ * @param maxSize fail if the peer sends more bytes than this, 0 for no limit
+ * @return true if successful, otherwise false
+ */
+static bool readAll(int fd, std::string &data, size_t maxSize)
+{
+	char buffer[READ_BUFFER];
+	while (true)
+	{
+		ssize_t count = read(fd, buffer, sizeof(buffer));
+		if (count == -1 && errno == EINTR)
+			continue;
+		if (count == -1)
+			return false;
+		if (count == 0)
+			return true;
+		data.append(buffer, count);
+		if (maxSize != 0 && data.size() > maxSize)
+			return false;
+	}
+}
+
+/**
+ * Fills a socket address with the given path
+ * @param addr the address
+ * @param socketPath the socket path
+ * @return true if successful, false if the path is too long
+ */
+static bool socketAddress(struct sockaddr_un &addr, const std::string &socketPath)
+{
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (socketPath.size() >= sizeof(addr.sun_path))
+	{
+		std::cerr << "Search: socket path too long " << socketPath << std::endl;
+		return false;
+	}
+	memcpy(addr.sun_path, socketPath.c_str(), socketPath.size());
+	return true;
+}
+
+//----------------------------------------- Cache --------------------------------------------------
+
+DirectoryCache::DirectoryCache(size_t maxNames) : maxNames(maxNames), nNames(0), hits(0), misses(0)
+{
+	pthread_mutex_init(&mut_entries, nullptr);
+}
+
+DirectoryCache::~DirectoryCache()
+{
+	pthread_mutex_destroy(&mut_entries);
+}
+
+DIRECTORY_LISTING DirectoryCache::get(const std::string &path)
+{
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+		return nullptr;
+
+	pthread_mutex_lock(&mut_entries);
+	auto found = entries.find(path);
+	if (found != entries.end() && found->second.dev == st.st_dev && found->second.ino == st.st_ino &&
+		sameTime(found->second.mtime, st.st_mtim) && sameTime(found->second.ctime, st.st_ctim))
+	{
+		hits++;
+		recentlyUsed.splice(recentlyUsed.begin(), recentlyUsed, found->second.used);
+		DIRECTORY_LISTING listing = found->second.listing;
+		pthread_mutex_unlock(&mut_entries);
+		return listing;
+	}
+	misses++;
+	pthread_mutex_unlock(&mut_entries);
+
+	// list without the lock, other folders are looked up meanwhile
+	struct timespec listed;
+	clock_gettime(CLOCK_REALTIME, &listed);
+	DIR* dirp = opendir(path.c_str());
+	if (dirp == NULL)
+		return nullptr;
+
+	std::vector<std::string>* names = new std::vector<std::string>;
+	struct dirent* dirstruct;
+	while ((dirstruct = readdir(dirp)) != NULL)
+		names->push_back(dirstruct->d_name);
+	closedir(dirp);
+	DIRECTORY_LISTING listing(names);
+
+	// a change in the same clock tick as the stat doesn't move mtime, so only listings taken a
+	// second after the last change are trusted
+	if (listed.tv_sec > st.st_mtim.tv_sec + 1 && listed.tv_sec > st.st_ctim.tv_sec + 1)
+	{
+		pthread_mutex_lock(&mut_entries);
+		insert(path, Entry{st.st_dev, st.st_ino, st.st_mtim, st.st_ctim, listing, recentlyUsed.end()});
+		pthread_mutex_unlock(&mut_entries);
+	}
+	return listing;
+}
+
+/**
+ * Caches a listing as the most recently used one, replacing an older listing of the path and
+ * dropping the least recently used listings until the names fit in maxNames. Called with
+ * mut_entries locked.
+ * @param path the directory path
+ * @param entry the listing and the directory's identity and times
+ */
+void DirectoryCache::insert(const std::string &path, const Entry &entry)
+{
+	auto found = entries.find(path);
+	if (found != entries.end())
+		erase(found);
+
+	// a listing larger than the whole cache is never kept
+	size_t size = entry.listing->size();
+	if (size > maxNames)
+		return;
+	while (nNames + size > maxNames)
+		erase(entries.find(recentlyUsed.back()));
+
+	recentlyUsed.push_front(path);
+	Entry &added = entries[path];
+	added = entry;
+	added.used = recentlyUsed.begin();
+	nNames += size;
+}
+
+/**
+ * Drops a cached listing, the jobs still reading it keep their reference. Called with mut_entries
+ * locked.
+ * @param found the listing
+ */
+void DirectoryCache::erase(std::map<std::string, Entry>::iterator found)
+{
+	nNames -= found->second.listing->size();
+	recentlyUsed.erase(found->second.used);
+	entries.erase(found);
+}
+
+void DirectoryCache::takeStats(size_t &hits, size_t &misses)
+{
+	pthread_mutex_lock(&mut_entries);
+	hits = this->hits;
+	misses = this->misses;
+	this->hits = 0;
+	this->misses = 0;
+	pthread_mutex_unlock(&mut_entries);
+}
+
+//----------------------------------------- Server -------------------------------------------------
+
+/**
+ * Replies with an error to the client whose query exits the worker process, registered with atexit
+ */
+static void replyQueryFailed()
+{
+	if (gQueryClient == -1)
+		return;
+
+	std::string reply = STATUS_ERROR + std::string(MSG_QUERY_FAILED);
+	writeAll(gQueryClient, reply.data(), reply.size());
+	close(gQueryClient);
+	gQueryClient = -1;
+}
+
+/**
+ * Accepts and runs queries until the process exits, the loop of a worker process
+ * @param server the listening socket
+ * @param handler runs the queries
+ */
+static void serveQueries(int server, QUERY_HANDLER handler)
+{
+	atexit(&replyQueryFailed);
+
+	while (true)
+	{
+		int client = accept4(server, nullptr, nullptr, SOCK_CLOEXEC);
+		if (client == -1)
+		{
+			if (errno != EINTR && errno != ECONNABORTED)
+				printError("accept");
+			continue;
+		}
+
+		// a client that never sends or reads must not hold the server up
+		struct timeval timeout = {CLIENT_TIMEOUT, 0};
+		if (setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0 ||
+			setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) != 0)
+		{
+			printError("setsockopt");
+			close(client);
+			continue;
+		}
+
+		std::string query;
+		if (!readAll(client, query, MAX_QUERY))
+		{
+			close(client);
+			continue;
+		}
+
+		// split the null terminated arguments
+		std::vector<std::string> args;
+		size_t start = 0;
+		for (size_t end = query.find('\0'); end != std::string::npos; end = query.find('\0', start))
+		{
+			args.push_back(query.substr(start, end - start));
+			start = end + 1;
+		}
+
+		gQueryClient = client;
+		std::stringstream out;
+		char status = (handler(args, out) == 0) ? STATUS_OK : STATUS_ERROR;
+		gQueryClient = -1;
+
+		std::string reply = status + out.str();
+		writeAll(client, reply.data(), reply.size());
+		close(client);
+	}
+}
+
+int runServer(const std::string &socketPath, QUERY_HANDLER handler)
+{
+	struct sockaddr_un addr;
+	if (!socketAddress(addr, socketPath))
+		return 1;
+
+	// a client that goes away must not kill the server
+	signal(SIGPIPE, SIG_IGN);
+
+	int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (server == -1)
+	{
+		printError("socket");
+		return 1;
+	}
+
+	// replace the socket of a server that didn't exit cleanly, never another kind of file
+	struct stat st;
+	if (lstat(socketPath.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(socketPath.c_str());
+
+	if (bind(server, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(server, SOMAXCONN) != 0)
+	{
+		printError("bind");
+		close(server);
+		return 1;
+	}
+
+	// the framework exits the process when a job fails, so a worker process runs the queries and
+	// is replaced when it exits. The server process creates no threads, so forking is safe.
+	while (true)
+	{
+		pid_t worker = fork();
+		if (worker == -1)
+		{
+			printError("fork");
+			close(server);
+			return 1;
+		}
+		if (worker == 0)
+		{
+			prctl(PR_SET_PDEATHSIG, SIGTERM);
+			serveQueries(server, handler);
+		}
+
+		int status;
+		while (waitpid(worker, &status, 0) == -1 && errno == EINTR)
+			continue;
+		std::cerr << "Search: server worker exited, starting a new one" << std::endl;
+		sleep(RESTART_DELAY);
+	}
+}
+
+//----------------------------------------- Client -------------------------------------------------
+
+int runClient(const std::string &socketPath, const std::vector<std::string> &args)
+{
+	struct sockaddr_un addr;
+	if (!socketAddress(addr, socketPath))
+		return 1;
+
+	int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (server == -1)
+	{
+		printError("socket");
+		return 1;
+	}
+	if (connect(server, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+	{
+		printError("connect");
+		close(server);
+		return 1;
+	}
+
+	std::string query;
+	for (const std::string &arg : args)
+		query.append(arg.c_str(), arg.size() + 1);
+
+	std::string reply;
+	bool success = writeAll(server, query.data(), query.size()) && shutdown(server, SHUT_WR) == 0 &&
+				   readAll(server, reply, 0);
+	close(server);
+	if (!success || reply.empty())
+	{
+		std::cerr << "Search: no reply from " << socketPath << std::endl;
+		return 1;
+	}
+
+	if (reply[0] != STATUS_OK)
+	{
+		std::cerr << reply.substr(1) << std::endl;
+		return 1;
+	}
+	std::cout << reply.substr(1);
+	return 0;
+}
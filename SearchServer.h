@@ -0,0 +1,105 @@
+#ifndef SEARCHSERVER_H
+#define SEARCHSERVER_H
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <ctime>
+#include <list>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/**
+ * The entry names of a directory, shared by the cache and the jobs that read it
+ */
+typedef std::shared_ptr<const std::vector<std::string>> DIRECTORY_LISTING;
+
+/**
+ * Runs a query received by the server
+ * @param args the query arguments
+ * @param out the query output
+ * @return 0 if successful otherwise 1, out then holds the error message
+ */
+typedef int (*QUERY_HANDLER)(const std::vector<std::string> &args, std::ostream &out);
+
+/**
+ * @brief Directory listings kept in memory between queries.
+ * A listing is reused as long as the directory's inode, mtime and ctime didn't change. The cache
+ * holds up to a given number of entry names, the least recently used listings are dropped first.
+ */
+class DirectoryCache
+{
+public:
+	/**
+	 * @param maxNames the maximal number of entry names in the cached listings
+	 */
+	explicit DirectoryCache(size_t maxNames);
+	~DirectoryCache();
+
+	/**
+	 * Returns the entries of a directory, listing it only if it changed since it was cached.
+	 * Safe to call from several threads.
+	 * @param path the directory path
+	 * @return the entries, nullptr if the directory can't be listed
+	 */
+	DIRECTORY_LISTING get(const std::string &path);
+
+	/**
+	 * Returns the number of get calls answered from the cache and the number that listed the
+	 * directory since the last call, and resets them
+	 * @param hits set to the number of cached listings
+	 * @param misses set to the number of new listings
+	 */
+	void takeStats(size_t &hits, size_t &misses);
+
+private:
+	DirectoryCache(const DirectoryCache &);
+	DirectoryCache &operator=(const DirectoryCache &);
+
+	struct Entry
+	{
+		dev_t dev;
+		ino_t ino;
+		struct timespec mtime;
+		struct timespec ctime;
+		DIRECTORY_LISTING listing;
+		std::list<std::string>::iterator used;	// position in the recently used list
+	};
+
+	void insert(const std::string &path, const Entry &entry);
+	void erase(std::map<std::string, Entry>::iterator found);
+
+	std::map<std::string, Entry> entries;
+	std::list<std::string> recentlyUsed;	// the cached paths, most recently used first
+	size_t maxNames;
+	size_t nNames;
+	size_t hits;
+	size_t misses;
+	pthread_mutex_t mut_entries;
+};
+
+/**
+ * Serves queries on a Unix domain socket until the process is killed. A query is the arguments
+ * of a search, each terminated by a null byte, and ends when the client shuts down its side of
+ * the connection. The reply is '0' or '1', the handler's return value, followed by its output.
+ * Queries are served one at a time, a client that doesn't complete its query or read its reply
+ * within 5 seconds is dropped. The queries' jobs keep their threads for the next one.
+ * The queries run in a worker process. A query that exits the worker, like a map reduce framework
+ * failure, gets an error reply and the server starts a new worker, with an empty cache.
+ * @param socketPath the socket path, a stale socket at the path is replaced
+ * @param handler runs the queries
+ * @return 1 if the socket can't be set up, otherwise doesn't return
+ */
+int runServer(const std::string &socketPath, QUERY_HANDLER handler);
+
+/**
+ * Sends a query to a server, prints the output to stdout or the error to stderr
+ * @param socketPath the server socket path
+ * @param args the query arguments
+ * @return 0 if successful otherwise 1
+ */
+int runClient(const std::string &socketPath, const std::vector<std::string> &args);
+
+#endif //SEARCHSERVER_H
@@ -0,0 +1,320 @@
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "TrigramIndex.h"
+
+//--------------------------------------- Definitions ----------------------------------------------
+/**
+ * Identifies an index file and its format version
+ */
+#define INDEX_MAGIC "MRTRIGR1"
+
+/**
+ * Length of the magic string, without the terminating null
+ */
+#define INDEX_MAGIC_LENGTH 8
+
+//--------------------------------------- File layout ----------------------------------------------
+/**
+ * Index file header, all offsets are in bytes from the beginning of the file.
+ * The header is followed by the file table, the trigram table, the postings and the names.
+ */
+struct IndexHeader
+{
+	char magic[INDEX_MAGIC_LENGTH];
+	uint32_t nFiles;
+	uint32_t nTrigrams;
+	uint64_t filesOffset;
+	uint64_t trigramsOffset;
+	uint64_t postingsOffset;
+	uint64_t namesOffset;
+	uint64_t namesSize;
+};
+
+/**
+ * File table entry, the file id is the entry position in the table
+ */
+struct FileEntry
+{
+	uint32_t nameOffset;
+	uint32_t nameLength;
+	uint32_t count;
+};
+
+/**
+ * Trigram table entry, the table is sorted by trigram.
+ * first and length select the trigram file ids in the postings array.
+ */
+struct TrigramEntry
+{
+	uint32_t trigram;
+	uint32_t first;
+	uint32_t length;
+};
+
+/**
+ * Trigram table comperator for binary search
+ * @param entry trigram table entry
+ * @param trigram trigram to search for
+ * @return true if entry.trigram < trigram, otherwise false
+ */
+static bool TRIGRAM_ENTRY_COMP(TrigramEntry const& entry, TRIGRAM trigram)
+{
+	return entry.trigram < trigram;
+}
+
+/**
+ * Posting list size comperator
+ * @param rhs trigram table entry
+ * @param lhs trigram table entry
+ * @return true if rhs has a shorter posting list than lhs, otherwise false
+ */
+static bool POSTING_SIZE_COMP(TrigramEntry const* rhs, TrigramEntry const* lhs)
+{
+	return rhs->length < lhs->length;
+}
+
+/**
+ * Checks that a table lies inside the mapped file without overflowing
+ * @param offset table offset from the beginning of the file
+ * @param count number of table entries
+ * @param entrySize size of a table entry
+ * @param size mapped file size
+ * @return true if the table ends within the file, otherwise false
+ */
+static bool IN_MAPPING(uint64_t offset, uint64_t count, uint64_t entrySize, uint64_t size)
+{
+	return offset <= size && count <= (size - offset) / entrySize;
+}
+
+//---------------------------------------------------------------------------------------------------
+
+void extractTrigrams(const std::string &str, std::vector<TRIGRAM> &out)
+{
+	out.clear();
+	if (str.size() < TRIGRAM_LENGTH)
+		return;
+
+	out.reserve(str.size() - TRIGRAM_LENGTH + 1);
+	for (size_t i = 0; i + TRIGRAM_LENGTH <= str.size(); ++i)
+	{
+		TRIGRAM trigram = ((TRIGRAM)(unsigned char)str[i] << 16) |
+						  ((TRIGRAM)(unsigned char)str[i + 1] << 8) |
+						  (TRIGRAM)(unsigned char)str[i + 2];
+		out.push_back(trigram);
+	}
+
+	std::sort(out.begin(), out.end());
+	out.erase(std::unique(out.begin(), out.end()), out.end());
+}
+
+//----------------------------------------- Writer -------------------------------------------------
+
+void TrigramIndexWriter::add(const std::string &name, int count, const std::vector<TRIGRAM> &trigrams)
+{
+	uint32_t id = (uint32_t)counts.size();
+
+	nameOffsets.push_back((uint32_t)names.size());
+	names.append(name);
+	counts.push_back((uint32_t)count);
+
+	for (TRIGRAM trigram : trigrams)
+		postings.push_back(std::make_pair(trigram, id));
+}
+
+bool TrigramIndexWriter::write(const std::string &path) const
+{
+	// offsets are stored as 32 bit values
+	if (names.size() > UINT32_MAX || postings.size() > UINT32_MAX)
+		return false;
+
+	// group the postings by trigram, ids of the same trigram stay in ascending order
+	std::vector<std::pair<TRIGRAM, uint32_t>> sorted(postings);
+	std::sort(sorted.begin(), sorted.end());
+
+	std::vector<TrigramEntry> trigrams;
+	std::vector<uint32_t> ids(sorted.size());
+	for (size_t i = 0; i < sorted.size(); ++i)
+	{
+		if (trigrams.empty() || trigrams.back().trigram != sorted[i].first)
+		{
+			TrigramEntry entry = {sorted[i].first, (uint32_t)i, 0};
+			trigrams.push_back(entry);
+		}
+		trigrams.back().length++;
+		ids[i] = sorted[i].second;
+	}
+
+	std::vector<FileEntry> files(counts.size());
+	for (size_t i = 0; i < counts.size(); ++i)
+	{
+		size_t end = (i + 1 < nameOffsets.size()) ? nameOffsets[i + 1] : names.size();
+		files[i].nameOffset = nameOffsets[i];
+		files[i].nameLength = (uint32_t)(end - nameOffsets[i]);
+		files[i].count = counts[i];
+	}
+
+	IndexHeader header;
+	memcpy(header.magic, INDEX_MAGIC, INDEX_MAGIC_LENGTH);
+	header.nFiles = (uint32_t)files.size();
+	header.nTrigrams = (uint32_t)trigrams.size();
+	header.filesOffset = sizeof(IndexHeader);
+	header.trigramsOffset = header.filesOffset + files.size() * sizeof(FileEntry);
+	header.postingsOffset = header.trigramsOffset + trigrams.size() * sizeof(TrigramEntry);
+	header.namesOffset = header.postingsOffset + ids.size() * sizeof(uint32_t);
+	header.namesSize = names.size();
+
+	// write to a temporary file and rename it so readers never map a partial index
+	std::string tmpPath = path + ".tmp";
+	std::ofstream file(tmpPath.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	if (file.fail())
+		return false;
+
+	file.write((const char*)&header, sizeof(header));
+	file.write((const char*)files.data(), files.size() * sizeof(FileEntry));
+	file.write((const char*)trigrams.data(), trigrams.size() * sizeof(TrigramEntry));
+	file.write((const char*)ids.data(), ids.size() * sizeof(uint32_t));
+	file.write(names.data(), names.size());
+	file.close();
+
+	if (file.fail())
+	{
+		unlink(tmpPath.c_str());
+		return false;
+	}
+
+	return rename(tmpPath.c_str(), path.c_str()) == 0;
+}
+
+//----------------------------------------- Reader -------------------------------------------------
+
+TrigramIndex::TrigramIndex() : data(nullptr), size(0) {}
+
+TrigramIndex::~TrigramIndex()
+{
+	if (data != nullptr)
+		munmap((void*)data, size);
+}
+
+bool TrigramIndex::open(const std::string &path)
+{
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd == -1)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(IndexHeader))
+	{
+		close(fd);
+		return false;
+	}
+
+	void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);	// the mapping stays valid after the descriptor is closed
+	if (addr == MAP_FAILED)
+		return false;
+
+	data = (const char*)addr;
+	size = st.st_size;
+
+	// validate the header before trusting any offset in it, every table must lie inside the
+	// mapping and the tables must follow each other in the file layout order
+	const IndexHeader* header = (const IndexHeader*)data;
+	bool valid = memcmp(header->magic, INDEX_MAGIC, INDEX_MAGIC_LENGTH) == 0 &&
+				 header->filesOffset >= sizeof(IndexHeader) &&
+				 IN_MAPPING(header->filesOffset, header->nFiles, sizeof(FileEntry), size) &&
+				 IN_MAPPING(header->trigramsOffset, header->nTrigrams, sizeof(TrigramEntry), size) &&
+				 IN_MAPPING(header->namesOffset, header->namesSize, 1, size) &&
+				 header->filesOffset + (uint64_t)header->nFiles * sizeof(FileEntry) <= header->trigramsOffset &&
+				 header->trigramsOffset + (uint64_t)header->nTrigrams * sizeof(TrigramEntry) <=
+				 header->postingsOffset &&
+				 header->postingsOffset <= header->namesOffset &&
+				 header->filesOffset % sizeof(uint32_t) == 0 &&
+				 header->trigramsOffset % sizeof(uint32_t) == 0 &&
+				 header->postingsOffset % sizeof(uint32_t) == 0;
+	if (!valid)
+	{
+		munmap(addr, size);
+		data = nullptr;
+		size = 0;
+	}
+	return valid;
+}
+
+void TrigramIndex::query(const std::string &pattern, std::vector<INDEX_MATCH> &out) const
+{
+	const IndexHeader* header = (const IndexHeader*)data;
+	const TrigramEntry* table = (const TrigramEntry*)(data + header->trigramsOffset);
+	const TrigramEntry* tableEnd = table + header->nTrigrams;
+	const uint32_t* postings = (const uint32_t*)(data + header->postingsOffset);
+
+	// patterns shorter than a trigram can't use the postings, scan the file table instead
+	if (pattern.size() < TRIGRAM_LENGTH)
+	{
+		for (uint32_t id = 0; id < header->nFiles; ++id)
+			verify(id, pattern, out);
+		return;
+	}
+
+	std::vector<TRIGRAM> trigrams;
+	extractTrigrams(pattern, trigrams);
+
+	// find the posting list of every trigram, a missing trigram means there are no matches
+	std::vector<const TrigramEntry*> lists;
+	for (TRIGRAM trigram : trigrams)
+	{
+		const TrigramEntry* entry = std::lower_bound(table, tableEnd, trigram, TRIGRAM_ENTRY_COMP);
+		if (entry == tableEnd || entry->trigram != trigram)
+			return;
+		if (((uint64_t)entry->first + entry->length) * sizeof(uint32_t) >
+			header->namesOffset - header->postingsOffset)
+			return;
+		lists.push_back(entry);
+	}
+
+	// intersect the shortest lists first to keep the candidate set small
+	std::sort(lists.begin(), lists.end(), POSTING_SIZE_COMP);
+	std::vector<uint32_t> candidates(postings + lists[0]->first,
+									 postings + lists[0]->first + lists[0]->length);
+	std::vector<uint32_t> intersection;
+	for (size_t i = 1; i < lists.size() && !candidates.empty(); ++i)
+	{
+		const uint32_t* first = postings + lists[i]->first;
+		intersection.clear();
+		std::set_intersection(candidates.begin(), candidates.end(), first, first + lists[i]->length,
+							  std::back_inserter(intersection));
+		candidates.swap(intersection);
+	}
+
+	// trigrams can match out of order, verify each candidate
+	for (uint32_t id : candidates)
+		verify(id, pattern, out);
+}
+
+/**
+ * Appends the given file to out if its name contains the pattern
+ * @param id file id
+ * @param pattern the substring to search for
+ * @param out vector of matches
+ */
+void TrigramIndex::verify(uint32_t id, const std::string &pattern, std::vector<INDEX_MATCH> &out) const
+{
+	const IndexHeader* header = (const IndexHeader*)data;
+	if (id >= header->nFiles)
+		return;
+
+	const FileEntry* file = (const FileEntry*)(data + header->filesOffset) + id;
+	const char* names = data + header->namesOffset;
+	if ((uint64_t)file->nameOffset + file->nameLength > header->namesSize)
+		return;
+
+	std::string name(names + file->nameOffset, file->nameLength);
+	if (name.find(pattern) != std::string::npos)
+		out.push_back(std::make_pair(name, (int)file->count));
+}
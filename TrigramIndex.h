@@ -0,0 +1,95 @@
+#ifndef MAPREDUCE2_TRIGRAMINDEX_H
+#define MAPREDUCE2_TRIGRAMINDEX_H
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstddef>
+#include <stdint.h>
+
+/**
+ * Three consecutive bytes of a file name packed into the low 24 bits
+ */
+typedef uint32_t TRIGRAM;
+
+/**
+ * A file name matched by a query and the number of indexed folders it appeared in
+ */
+typedef std::pair<std::string, int> INDEX_MATCH;
+
+/**
+ * Patterns shorter than this can't be looked up in the posting lists
+ */
+#define TRIGRAM_LENGTH 3
+
+/**
+ * Puts the sorted, unique trigrams of the given string in out
+ * @param str the string to split
+ * @param out vector the trigrams are written to, its previous content is discarded
+ */
+void extractTrigrams(const std::string &str, std::vector<TRIGRAM> &out);
+
+/**
+ * @brief Builds the on-disk index file.
+ * File names must be added in ascending order, their position is used as the file id
+ * in the posting lists.
+ */
+class TrigramIndexWriter
+{
+public:
+	/**
+	 * Adds a file name to the index
+	 * @param name the file name
+	 * @param count number of folders the file name appeared in
+	 * @param trigrams sorted unique trigrams of the file name
+	 */
+	void add(const std::string &name, int count, const std::vector<TRIGRAM> &trigrams);
+
+	/**
+	 * Writes the index to the given path
+	 * @param path index file path
+	 * @return true if successful, otherwise false
+	 */
+	bool write(const std::string &path) const;
+
+private:
+	std::string names;
+	std::vector<uint32_t> nameOffsets;
+	std::vector<uint32_t> counts;
+	std::vector<std::pair<TRIGRAM, uint32_t>> postings;
+};
+
+/**
+ * @brief Read only view of an index file, the file is memory mapped and never copied.
+ */
+class TrigramIndex
+{
+public:
+	TrigramIndex();
+	~TrigramIndex();
+
+	/**
+	 * Maps the given index file
+	 * @param path index file path
+	 * @return true if the file was mapped and has a valid header, otherwise false
+	 */
+	bool open(const std::string &path);
+
+	/**
+	 * Finds the indexed file names containing the given pattern, sorted by file name
+	 * @param pattern the substring to search for
+	 * @param out vector the matches are appended to
+	 */
+	void query(const std::string &pattern, std::vector<INDEX_MATCH> &out) const;
+
+private:
+	TrigramIndex(const TrigramIndex &);
+	TrigramIndex &operator=(const TrigramIndex &);
+
+	void verify(uint32_t id, const std::string &pattern, std::vector<INDEX_MATCH> &out) const;
+
+	const char *data;
+	size_t size;
+};
+
+#endif //MAPREDUCE2_TRIGRAMINDEX_H